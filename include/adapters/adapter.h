@@ -16,6 +16,8 @@ namespace RedisCluster
     class Adapter
     {
     public:
+        typedef void (*Task)( void* );
+
         Adapter() {}
         virtual ~Adapter() {}
     
@@ -25,6 +27,30 @@ namespace RedisCluster
         {
             return REDIS_ERR;
         }
+
+        // Runs task once in the loop thread, after the events of current loop
+        // iteration are processed. Must be called from the loop thread.
+        // Returns REDIS_OK on success, REDIS_ERR if event library is not supported.
+        virtual int runLater( Task, void * )
+        {
+            return REDIS_ERR;
+        }
+
+        // Runs task once in the loop thread after the delay. Must be called from the loop thread,
+        // scheduled task can't be cancelled.
+        // Returns REDIS_OK on success, REDIS_ERR if event library is not supported.
+        virtual int runAfter( const struct timeval &, Task, void * )
+        {
+            return REDIS_ERR;
+        }
+
+        // Wakes up the loop and runs task once in the loop thread.
+        // Can be called from any thread.
+        // Returns REDIS_OK on success, REDIS_ERR if event library is not supported.
+        virtual int post( Task, void * )
+        {
+            return REDIS_ERR;
+        }
     };  // class Adapter
 }  // namespace RedisCluster
 
@@ -5,6 +5,8 @@
 
 #include <vector>
 
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/bind.hpp>
 #include <boost/make_shared.hpp>
 #include <boost/shared_ptr.hpp>
 
@@ -39,7 +41,37 @@ namespace RedisCluster
             return REDIS_OK;
         }
 
+        // io_service runs posted handlers after the handlers that are ready now.
+        virtual int runLater( Task task, void *data )
+        {
+            io_service_.post( boost::bind( task, data ) );
+            return REDIS_OK;
+        }
+
+        virtual int runAfter( const struct timeval &delay, Task task, void *data )
+        {
+            TimerSptr timer = boost::make_shared<boost::asio::deadline_timer>( io_service_,
+                boost::posix_time::seconds( delay.tv_sec ) + boost::posix_time::microseconds( delay.tv_usec ) );
+            // timer is kept alive by the handler
+            timer->async_wait( boost::bind( onAfter, timer, task, data ) );
+            return REDIS_OK;
+        }
+
+        // io_service::post is thread safe
+        virtual int post( Task task, void *data )
+        {
+            io_service_.post( boost::bind( task, data ) );
+            return REDIS_OK;
+        }
+
     private:
+        typedef boost::shared_ptr<boost::asio::deadline_timer> TimerSptr;
+
+        static void onAfter( TimerSptr, Task task, void *data )
+        {
+            task( data );
+        }
+
         boost::asio::io_service & io_service_;
 
         typedef boost::shared_ptr<redisBoostClient> ClientSptr;
@@ -0,0 +1,496 @@
+/*
+ * Copyright (c) 2015, Dmitrii Shinkevich <shinmail at gmail dot com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef __libredisCluster_adapters_epolladapter_h__
+#define __libredisCluster_adapters_epolladapter_h__
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "adapter.h"  // for Adapter
+
+extern "C"
+{
+#include <hiredis/async.h>
+}
+
+namespace RedisCluster
+{
+    // Adapter with its own event loop built on epoll, eventfd and timerfd, so no event
+    // library is needed (Linux only).
+    //
+    // Connection sockets are registered once, edge triggered for both read and write.
+    // hiredis asks for write readiness after every command, here it costs no epoll_ctl:
+    // the context is put to the list of pending writes, which are done together after the
+    // events of the current loop iteration. Events are taken by batches of MaxEvents.
+    //
+    // Loop is run by run() in the calling thread or by start() in a dedicated thread. Like
+    // event_base_dispatch it returns when there are no connections and no tasks left (i.e.
+    // after cluster disconnect), or after stop(). Connections must be attached before the
+    // loop is started or from the loop thread; adapter must outlive attached contexts.
+    class EpollAdapter : public Adapter
+    {
+        EpollAdapter(const EpollAdapter&) = delete;
+        EpollAdapter& operator=(const EpollAdapter&) = delete;
+
+        typedef std::chrono::steady_clock Clock;
+        typedef std::pair<Task, void*> TaskData;
+        typedef std::vector<TaskData> TaskList;
+        typedef std::multimap<Clock::time_point, TaskData> Timers;
+
+        // state of one attached connection, it's freed after the loop iteration where
+        // hiredis cleaned up the context, because events of this iteration can refer to it
+        struct Watch
+        {
+            Watch( EpollAdapter *adapter, redisAsyncContext *ac ) :
+                adapter( adapter ), ac( ac ), fd( ac->c.fd ), reading( false ), writing( false ),
+                queued( false ), handlingWrite( false ), closed( false ), timer( false ), timeout() {}
+
+            EpollAdapter *adapter;
+            redisAsyncContext *ac;
+            int fd;
+            bool reading;
+            bool writing;
+            bool queued;
+            bool handlingWrite;
+            bool closed;
+            bool timer;
+            Timers::iterator timeout;
+        };
+
+    public:
+        static const int MaxEvents = 256;
+
+        EpollAdapter() :
+            epfd_( epoll_create1( EPOLL_CLOEXEC ) ),
+            wakefd_( eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC ) ),
+            timerfd_( timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC ) ),
+            watches_( 0 ), writes_(), flushing_(), closed_(), timers_(), armed_(),
+            tasks_(), running_(), postLock_(), posted_(), postRunning_(),
+            stopped_( false ), thread_()
+        {
+            if( valid() )
+            {
+                epoll_event wake = {};
+                wake.events = EPOLLIN;
+                wake.data.ptr = &wakefd_;
+                epoll_event timer = {};
+                timer.events = EPOLLIN;
+                timer.data.ptr = &timerfd_;
+                if( epoll_ctl( epfd_, EPOLL_CTL_ADD, wakefd_, &wake ) != 0 ||
+                    epoll_ctl( epfd_, EPOLL_CTL_ADD, timerfd_, &timer ) != 0 )
+                    closeFds();
+            }
+        }
+
+        virtual ~EpollAdapter()
+        {
+            stop();
+            join();
+            for( Watch *watch : closed_ )
+                delete watch;
+            closeFds();
+        }
+
+    public:
+        // false if epoll instance could not be created, every call fails then
+        inline bool valid() const
+        {
+            return epfd_ >= 0 && wakefd_ >= 0 && timerfd_ >= 0;
+        }
+
+        virtual int attachContext( redisAsyncContext &ac ) override
+        {
+            if( !valid() || ac.ev.data != NULL )
+                return REDIS_ERR;
+
+            Watch *watch = new Watch( this, &ac );
+
+            epoll_event event = {};
+            event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            event.data.ptr = watch;
+            if( epoll_ctl( epfd_, EPOLL_CTL_ADD, watch->fd, &event ) != 0 )
+            {
+                delete watch;
+                return REDIS_ERR;
+            }
+
+            ac.ev.addRead = addRead;
+            ac.ev.delRead = delRead;
+            ac.ev.addWrite = addWrite;
+            ac.ev.delWrite = delWrite;
+            ac.ev.cleanup = cleanup;
+#if defined(HIREDIS_MAJOR) && HIREDIS_MAJOR >= 1
+            ac.ev.scheduleTimer = scheduleTimer;
+#endif
+            ac.ev.data = watch;
+            ++watches_;
+            return REDIS_OK;
+        }
+
+        // tasks are run after the events and pending writes of the current iteration
+        virtual int runLater( Task task, void *data ) override
+        {
+            if( !valid() )
+                return REDIS_ERR;
+            tasks_.push_back( TaskData( task, data ) );
+            return REDIS_OK;
+        }
+
+        // timers are kept ordered by expiration time, timerfd is armed for the nearest one
+        virtual int runAfter( const struct timeval &delay, Task task, void *data ) override
+        {
+            if( !valid() )
+                return REDIS_ERR;
+            addTimer( delay, TaskData( task, data ) );
+            return REDIS_OK;
+        }
+
+        // only the first task posted after the loop took the previous ones wakes it up
+        virtual int post( Task task, void *data ) override
+        {
+            if( !valid() )
+                return REDIS_ERR;
+            bool wake = false;
+            {
+                std::lock_guard<std::mutex> locker( postLock_ );
+                wake = posted_.empty();
+                posted_.push_back( TaskData( task, data ) );
+            }
+            if( wake )
+                wakeUp();
+            return REDIS_OK;
+        }
+
+        // runs the loop in the calling thread until there is nothing to wait for or stop() is called
+        int run()
+        {
+            if( !valid() )
+                return REDIS_ERR;
+
+            epoll_event events[MaxEvents];
+            while( !stopped_.load() && !idle() )
+            {
+                int timeout = ( writes_.empty() && tasks_.empty() ) ? -1 : 0;
+                int count = epoll_wait( epfd_, events, MaxEvents, timeout );
+                if( count < 0 )
+                {
+                    if( errno == EINTR )
+                        continue;
+                    return REDIS_ERR;
+                }
+                for( int i = 0; i < count; ++i )
+                    dispatch( events[i] );
+
+                flushWrites();
+                runTasks();
+                for( Watch *watch : closed_ )
+                    delete watch;
+                closed_.clear();
+            }
+            stopped_.store( false );
+            return REDIS_OK;
+        }
+
+        // runs the loop in a dedicated thread
+        void start()
+        {
+            join();
+            thread_ = std::thread( [this]() { run(); } );
+        }
+
+        // can be called from any thread, loop returns after the current iteration
+        void stop()
+        {
+            stopped_.store( true );
+            if( valid() )
+                wakeUp();
+        }
+
+        void join()
+        {
+            if( thread_.joinable() && thread_.get_id() != std::this_thread::get_id() )
+                thread_.join();
+        }
+
+    private:
+        inline bool idle() const
+        {
+            return watches_ == 0 && timers_.empty() && tasks_.empty() && writes_.empty();
+        }
+
+        void dispatch( const epoll_event &event )
+        {
+            if( event.data.ptr == &wakefd_ )
+            {
+                uint64_t value;
+                ssize_t bytes = read( wakefd_, &value, sizeof( value ) );
+                (void)bytes;
+                runPosted();
+                return;
+            }
+            if( event.data.ptr == &timerfd_ )
+            {
+                uint64_t value;
+                ssize_t bytes = read( timerfd_, &value, sizeof( value ) );
+                (void)bytes;
+                runTimers();
+                return;
+            }
+
+            Watch *watch = static_cast<Watch*>( event.data.ptr );
+            if( watch->closed )
+                return;
+
+            if( watch->reading && ( event.events & ( EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ) )
+                handleRead( watch, event.events );
+
+            if( !watch->closed && watch->writing && ( event.events & ( EPOLLOUT | EPOLLHUP | EPOLLERR ) ) )
+                handleWrite( watch );
+        }
+
+        // edge triggered socket must be read out, hiredis reads one buffer per call
+        static void handleRead( Watch *watch, uint32_t events )
+        {
+            redisAsyncContext *ac = watch->ac;
+            redisAsyncHandleRead( ac );
+            while( !watch->closed && watch->reading && available( watch->fd ) )
+                redisAsyncHandleRead( ac );
+            // peer closed the connection, the next read sees the end of stream
+            if( !watch->closed && watch->reading && ( events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ) )
+                redisAsyncHandleRead( ac );
+        }
+
+        // hiredis asks for write readiness again if the buffer wasn't written completely,
+        // it doesn't queue the context again: the next EPOLLOUT edge comes when the socket
+        // buffer has room
+        static void handleWrite( Watch *watch )
+        {
+            watch->handlingWrite = true;
+            redisAsyncHandleWrite( watch->ac );
+            watch->handlingWrite = false;
+        }
+
+        static bool available( int fd )
+        {
+            int bytes = 0;
+            return ioctl( fd, FIONREAD, &bytes ) == 0 && bytes > 0;
+        }
+
+        void flushWrites()
+        {
+            flushing_.swap( writes_ );
+            for( Watch *watch : flushing_ )
+            {
+                watch->queued = false;
+                if( !watch->closed && watch->writing )
+                    handleWrite( watch );
+            }
+            flushing_.clear();
+        }
+
+        void runTasks()
+        {
+            running_.swap( tasks_ );
+            for( size_t i = 0; i < running_.size(); ++i )
+                running_[i].first( running_[i].second );
+            running_.clear();
+        }
+
+        void runPosted()
+        {
+            {
+                std::lock_guard<std::mutex> locker( postLock_ );
+                postRunning_.swap( posted_ );
+            }
+            for( size_t i = 0; i < postRunning_.size(); ++i )
+                postRunning_[i].first( postRunning_[i].second );
+            postRunning_.clear();
+        }
+
+        Timers::iterator addTimer( const struct timeval &delay, const TaskData &task )
+        {
+            Timers::iterator timer = timers_.insert( Timers::value_type(
+                Clock::now() + std::chrono::seconds( delay.tv_sec ) + std::chrono::microseconds( delay.tv_usec ),
+                task ) );
+            armTimer();
+            return timer;
+        }
+
+        void runTimers()
+        {
+            Clock::time_point now = Clock::now();
+            while( !timers_.empty() && timers_.begin()->first <= now )
+            {
+                TaskData task = timers_.begin()->second;
+                timers_.erase( timers_.begin() );
+                task.first( task.second );
+            }
+            armed_ = Clock::time_point();
+            armTimer();
+        }
+
+        // timerfd is reprogrammed only when the nearest expiration changes
+        void armTimer()
+        {
+            if( timers_.empty() || timers_.begin()->first == armed_ )
+                return;
+            armed_ = timers_.begin()->first;
+
+            // steady clock is CLOCK_MONOTONIC on Linux
+            std::chrono::nanoseconds since = armed_.time_since_epoch();
+            itimerspec spec = {};
+            spec.it_value.tv_sec = static_cast<time_t>( since.count() / 1000000000 );
+            spec.it_value.tv_nsec = static_cast<long>( since.count() % 1000000000 );
+            if( spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0 )
+                spec.it_value.tv_nsec = 1;
+            timerfd_settime( timerfd_, TFD_TIMER_ABSTIME, &spec, NULL );
+        }
+
+        void wakeUp()
+        {
+            uint64_t one = 1;
+            ssize_t written = write( wakefd_, &one, sizeof( one ) );
+            (void)written;
+        }
+
+        void closeFds()
+        {
+            if( epfd_ >= 0 )
+                close( epfd_ );
+            if( wakefd_ >= 0 )
+                close( wakefd_ );
+            if( timerfd_ >= 0 )
+                close( timerfd_ );
+            epfd_ = wakefd_ = timerfd_ = -1;
+        }
+
+        // hiredis event hooks
+        static void addRead( void *privdata )
+        {
+            static_cast<Watch*>( privdata )->reading = true;
+        }
+
+        static void delRead( void *privdata )
+        {
+            static_cast<Watch*>( privdata )->reading = false;
+        }
+
+        // connected context is written at the end of the iteration, connecting one waits
+        // for EPOLLOUT edge which tells that the connection is established
+        static void addWrite( void *privdata )
+        {
+            Watch *watch = static_cast<Watch*>( privdata );
+            watch->writing = true;
+            if( !watch->queued && !watch->handlingWrite && ( watch->ac->c.flags & REDIS_CONNECTED ) )
+            {
+                watch->queued = true;
+                watch->adapter->writes_.push_back( watch );
+            }
+        }
+
+        static void delWrite( void *privdata )
+        {
+            static_cast<Watch*>( privdata )->writing = false;
+        }
+
+        static void cleanup( void *privdata )
+        {
+            Watch *watch = static_cast<Watch*>( privdata );
+            EpollAdapter *that = watch->adapter;
+            epoll_ctl( that->epfd_, EPOLL_CTL_DEL, watch->fd, NULL );
+            if( watch->timer )
+                that->timers_.erase( watch->timeout );
+            if( watch->queued )
+                that->writes_.erase( std::find( that->writes_.begin(), that->writes_.end(), watch ) );
+            watch->reading = watch->writing = watch->timer = watch->queued = false;
+            watch->closed = true;
+            watch->ac->ev.data = NULL;
+            that->closed_.push_back( watch );
+            --that->watches_;
+        }
+
+#if defined(HIREDIS_MAJOR) && HIREDIS_MAJOR >= 1
+        // connect and command timeouts of hiredis
+        static void scheduleTimer( void *privdata, struct timeval tv )
+        {
+            Watch *watch = static_cast<Watch*>( privdata );
+            EpollAdapter *that = watch->adapter;
+            if( watch->timer )
+                that->timers_.erase( watch->timeout );
+            watch->timeout = that->addTimer( tv, TaskData( onTimeout, watch ) );
+            watch->timer = true;
+        }
+
+        static void onTimeout( void *data )
+        {
+            Watch *watch = static_cast<Watch*>( data );
+            watch->timer = false;
+            if( !watch->closed )
+                redisAsyncHandleTimeout( watch->ac );
+        }
+#endif
+
+    private:
+        int epfd_;
+        int wakefd_;
+        int timerfd_;
+
+        int watches_;
+        std::vector<Watch*> writes_;
+        std::vector<Watch*> flushing_;
+        std::vector<Watch*> closed_;
+
+        Timers timers_;
+        Clock::time_point armed_;
+        TaskList tasks_;
+        TaskList running_;
+
+        std::mutex postLock_;
+        TaskList posted_;
+        TaskList postRunning_;
+
+        std::atomic<bool> stopped_;
+        std::thread thread_;
+    };  // class EpollAdapter
+}  // namespace RedisCluster
+
+#endif  // __libredisCluster_adapters_epolladapter_h__
@@ -4,6 +4,7 @@
 #define __libredisCluster_adapters_libeventadapter_h__
 
 #include <cassert>  // for assert()
+#include <vector>
 
 #include "adapter.h"  // for Adapter
 
@@ -17,18 +18,91 @@ namespace RedisCluster
     // Wrap hiredis libevent adapter.
     class LibeventAdapter : public Adapter
     {
+        LibeventAdapter(const LibeventAdapter&) = delete;
+        LibeventAdapter& operator=(const LibeventAdapter&) = delete;
+
     public:
-        explicit LibeventAdapter( struct event_base & base ) : base_( base ) {}
-        virtual ~LibeventAdapter() {}
+        explicit LibeventAdapter( struct event_base & base ) :
+            base_( base ), later_( nullptr ), tasks_(), running_() {}
+        virtual ~LibeventAdapter()
+        {
+            if( later_ != nullptr )
+                event_free( later_ );
+        }
     
     public:
         virtual int attachContext( redisAsyncContext &ac ) override
         {
             return redisLibeventAttach( &ac, &base_ );
         }
-    
+
+        // Tasks are run by one manually activated event, libevent processes it
+        // in the same loop iteration after already active events.
+        virtual int runLater( Task task, void *data ) override
+        {
+            if( later_ == nullptr )
+            {
+                later_ = event_new( &base_, -1, 0, onLater, this );
+                if( later_ == nullptr )
+                    return REDIS_ERR;
+            }
+            tasks_.push_back( TaskData( task, data ) );
+            if( tasks_.size() == 1 )
+                event_active( later_, EV_TIMEOUT, 0 );
+            return REDIS_OK;
+        }
+
+        virtual int runAfter( const struct timeval &delay, Task task, void *data ) override
+        {
+            TaskData *taskData = new TaskData( task, data );
+            if( event_base_once( &base_, -1, EV_TIMEOUT, onPost, taskData, &delay ) != 0 )
+            {
+                delete taskData;
+                return REDIS_ERR;
+            }
+            return REDIS_OK;
+        }
+
+        // libevent must be initialized for threads (evthread_use_pthreads() is called
+        // before the event base is created), otherwise post works only from loop thread.
+        virtual int post( Task task, void *data ) override
+        {
+            static const struct timeval now = { 0, 0 };
+            TaskData *taskData = new TaskData( task, data );
+            if( event_base_once( &base_, -1, EV_TIMEOUT, onPost, taskData, &now ) != 0 )
+            {
+                delete taskData;
+                return REDIS_ERR;
+            }
+            return REDIS_OK;
+        }
+
+    private:
+        typedef std::pair<Task, void*> TaskData;
+        typedef std::vector<TaskData> TaskList;
+
+        static void onPost( evutil_socket_t, short, void *arg )
+        {
+            TaskData *taskData = static_cast<TaskData*>( arg );
+            taskData->first( taskData->second );
+            delete taskData;
+        }
+
+        static void onLater( evutil_socket_t, short, void *arg )
+        {
+            LibeventAdapter *that = static_cast<LibeventAdapter*>( arg );
+            // tasks can schedule other tasks, they would run in the next activation
+            that->running_.swap( that->tasks_ );
+            for( size_t i = 0; i < that->running_.size(); ++i )
+                that->running_[i].first( that->running_[i].second );
+            that->running_.clear();
+        }
+
     private:
         struct event_base & base_;
+        struct event *later_;
+        TaskList tasks_;
+        TaskList running_;
     };  // class Adapter
 }  // namespace RedisCluster
 
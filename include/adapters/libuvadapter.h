@@ -3,6 +3,9 @@
 #ifndef __libredisCluster_adapters_libuvadapter_h__
 #define __libredisCluster_adapters_libuvadapter_h__
 
+#include <mutex>
+#include <vector>
+
 #include "adapter.h"  // for Adapter
 
 extern "C"
@@ -16,8 +19,22 @@ namespace RedisCluster
     class LibUvAdapter : public Adapter
     {
     public:
-        explicit LibUvAdapter( uv_loop_t* loop = uv_default_loop() ) : loop_( loop ) {}
-        virtual ~LibUvAdapter() {}
+        // must be created in the loop thread
+        explicit LibUvAdapter( uv_loop_t* loop = uv_default_loop() ) :
+            loop_( loop ), later_( nullptr ), async_( new uv_async_t ),
+            tasks_(), running_(), postLock_(), posted_(), postRunning_()
+        {
+            uv_async_init( loop_, async_, onPost );
+            async_->data = this;
+            // wakeup handle must not keep the loop running
+            uv_unref( reinterpret_cast<uv_handle_t*>( async_ ) );
+        }
+        virtual ~LibUvAdapter()
+        {
+            if( later_ != nullptr )
+                uv_close( reinterpret_cast<uv_handle_t*>( later_ ), onClose );
+            uv_close( reinterpret_cast<uv_handle_t*>( async_ ), onCloseAsync );
+        }
 
     public:
         virtual int attachContext( redisAsyncContext &ac ) override
@@ -25,8 +42,103 @@ namespace RedisCluster
             return redisLibuvAttach( &ac, loop_ );
         }
 
+        // Tasks are run by zero timeout timer, so they are processed right after
+        // the current poll phase of the loop.
+        virtual int runLater( Task task, void *data ) override
+        {
+            if( later_ == nullptr )
+            {
+                later_ = new uv_timer_t;
+                if( uv_timer_init( loop_, later_ ) != 0 )
+                {
+                    delete later_;
+                    later_ = nullptr;
+                    return REDIS_ERR;
+                }
+                later_->data = this;
+            }
+            tasks_.push_back( TaskData( task, data ) );
+            if( tasks_.size() == 1 )
+                uv_timer_start( later_, onLater, 0, 0 );
+            return REDIS_OK;
+        }
+
+        // every delayed task has its own timer handle, it's closed after the task is run
+        virtual int runAfter( const struct timeval &delay, Task task, void *data ) override
+        {
+            uv_timer_t *timer = new uv_timer_t;
+            if( uv_timer_init( loop_, timer ) != 0 )
+            {
+                delete timer;
+                return REDIS_ERR;
+            }
+            timer->data = new TaskData( task, data );
+            uint64_t timeout = static_cast<uint64_t>( delay.tv_sec ) * 1000 + delay.tv_usec / 1000;
+            uv_timer_start( timer, onAfter, timeout, 0 );
+            return REDIS_OK;
+        }
+
+        virtual int post( Task task, void *data ) override
+        {
+            {
+                std::lock_guard<std::mutex> locker( postLock_ );
+                posted_.push_back( TaskData( task, data ) );
+            }
+            return uv_async_send( async_ ) == 0 ? REDIS_OK : REDIS_ERR;
+        }
+
+    private:
+        typedef std::pair<Task, void*> TaskData;
+        typedef std::vector<TaskData> TaskList;
+
+        static void onPost( uv_async_t *handle )
+        {
+            LibUvAdapter *that = static_cast<LibUvAdapter*>( handle->data );
+            {
+                std::lock_guard<std::mutex> locker( that->postLock_ );
+                that->postRunning_.swap( that->posted_ );
+            }
+            for( size_t i = 0; i < that->postRunning_.size(); ++i )
+                that->postRunning_[i].first( that->postRunning_[i].second );
+            that->postRunning_.clear();
+        }
+
+        static void onCloseAsync( uv_handle_t *handle )
+        {
+            delete reinterpret_cast<uv_async_t*>( handle );
+        }
+
+        static void onLater( uv_timer_t *handle )
+        {
+            LibUvAdapter *that = static_cast<LibUvAdapter*>( handle->data );
+            that->running_.swap( that->tasks_ );
+            for( size_t i = 0; i < that->running_.size(); ++i )
+                that->running_[i].first( that->running_[i].second );
+            that->running_.clear();
+        }
+
+        static void onAfter( uv_timer_t *handle )
+        {
+            TaskData *taskData = static_cast<TaskData*>( handle->data );
+            taskData->first( taskData->second );
+            delete taskData;
+            uv_close( reinterpret_cast<uv_handle_t*>( handle ), onClose );
+        }
+
+        static void onClose( uv_handle_t *handle )
+        {
+            delete reinterpret_cast<uv_timer_t*>( handle );
+        }
+
     private:
         uv_loop_t* loop_;
+        uv_timer_t* later_;
+        uv_async_t* async_;
+        TaskList tasks_;
+        TaskList running_;
+        std::mutex postLock_;
+        TaskList posted_;
+        TaskList postRunning_;
     };  // class Adapter
 }  // namespace RedisCluster
 
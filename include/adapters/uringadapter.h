@@ -0,0 +1,731 @@
+/*
+ * Copyright (c) 2015, Dmitrii Shinkevich <shinmail at gmail dot com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef __libredisCluster_adapters_uringadapter_h__
+#define __libredisCluster_adapters_uringadapter_h__
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <liburing.h>
+
+#include "adapter.h"  // for Adapter
+
+extern "C"
+{
+#include <hiredis/async.h>
+}
+
+#if !defined(HIREDIS_MAJOR) || HIREDIS_MAJOR < 1
+#error "UringAdapter needs hiredis 1.0 or newer"
+#endif
+
+namespace RedisCluster
+{
+    // Adapter with its own event loop on io_uring (Linux 5.6+, liburing, hiredis 1.0+).
+    //
+    // Sockets are read and written through the ring: read and write functions of an
+    // attached context (redisContextFuncs) are replaced, so hiredis takes replies from
+    // completed read requests and hands commands over to write requests instead of calling
+    // recv and send itself. Every connection has a read and a write buffer, all of them are
+    // one block registered with the kernel (fixed buffers, plain reads and writes are used
+    // if registration fails, i.e. because of RLIMIT_MEMLOCK). While hiredis waits for replies
+    // a read is kept in flight, so sockets are never polled for readiness.
+    //
+    // Requests prepared during a loop iteration are submitted for all connections with a
+    // single io_uring_enter which also waits for completions (or for the nearest timer).
+    // Like EpollAdapter, writes requested by hiredis during the iteration are done together
+    // after its completions; a connection has one write in flight and commands issued
+    // meanwhile are written after it. Only connecting waits for a poll request.
+    //
+    // attachContext() fails for TLS contexts and when Options::connections contexts are
+    // attached already. Loop is run by run() in the calling thread or by start() in
+    // a dedicated thread, it returns when there are no connections and no tasks left or
+    // after stop(). Connections must be attached before the loop is started or from the
+    // loop thread; adapter must outlive attached contexts.
+    class UringAdapter : public Adapter
+    {
+        UringAdapter(const UringAdapter&) = delete;
+        UringAdapter& operator=(const UringAdapter&) = delete;
+
+        typedef std::chrono::steady_clock Clock;
+        typedef std::pair<Task, void*> TaskData;
+        typedef std::vector<TaskData> TaskList;
+        typedef std::multimap<Clock::time_point, TaskData> Timers;
+
+        struct Watch;
+
+        // request in flight, its address is the user data of the request
+        struct Request
+        {
+            explicit Request( Watch *watch ) : watch( watch ), armed( false ) {}
+
+            Watch *watch;
+            bool armed;
+        };
+
+        // state of one attached connection, after hiredis cleaned up the context it's freed
+        // when its requests are completed or cancelled
+        struct Watch
+        {
+            Watch( UringAdapter *adapter, redisAsyncContext *ac, size_t slot, char *buffer ) :
+                adapter( adapter ), ac( ac ), fd( ac->c.fd ), slot( slot ), buffer( buffer ),
+                funcs( *ac->c.funcs ), original( ac->c.funcs ),
+                readStart( 0 ), readEnd( 0 ), writeStart( 0 ), writeEnd( 0 ), error( 0 ),
+                reading( false ), writing( false ), queued( false ), handling( false ),
+                closed( false ), timer( false ), timeout(),
+                connect( this ), in( this ), out( this ) {}
+
+            Watch(const Watch&) = delete;
+            Watch& operator=(const Watch&) = delete;
+
+            UringAdapter *adapter;
+            redisAsyncContext *ac;
+            int fd;
+            size_t slot;
+            // read buffer followed by write buffer
+            char *buffer;
+            // functions of the context, restored on cleanup
+            redisContextFuncs funcs;
+            const redisContextFuncs *original;
+            // received bytes not taken by hiredis yet
+            size_t readStart;
+            size_t readEnd;
+            // bytes of the write in flight not sent yet
+            size_t writeStart;
+            size_t writeEnd;
+            // errno of failed read or write, -1 if the server closed the connection
+            int error;
+            bool reading;
+            bool writing;
+            bool queued;
+            bool handling;
+            bool closed;
+            bool timer;
+            Timers::iterator timeout;
+            Request connect;
+            Request in;
+            Request out;
+        };
+
+    public:
+        struct Options
+        {
+            Options() :
+            entries( 1024 ),
+            connections( 256 ),
+            buffer( 16 * 1024 )
+            {}
+
+            // size of the submission queue
+            unsigned int entries;
+            // most contexts attached at the same time
+            size_t connections;
+            // size of the read and of the write buffer of a connection
+            size_t buffer;
+        };
+
+        explicit UringAdapter( const Options &options = Options() ) :
+            ring_(), valid_( false ), fixed_( false ), options_( options ),
+            buffers_(), slots_(),
+            wakefd_( eventfd( 0, EFD_CLOEXEC ) ), wakeValue_( 0 ),
+            watches_( 0 ), writes_(), flushing_(), closing_(), closed_(), timers_(),
+            tasks_(), running_(), postLock_(), posted_(), postRunning_(),
+            stopped_( false ), thread_()
+        {
+            if( wakefd_ >= 0 && options.buffer > 0 && io_uring_queue_init( options.entries, &ring_, 0 ) == 0 )
+            {
+                valid_ = true;
+                buffers_.resize( options.connections * options.buffer * 2 );
+                for( size_t slot = options.connections; slot > 0; --slot )
+                    slots_.push_back( slot - 1 );
+                if( !buffers_.empty() )
+                {
+                    struct iovec block;
+                    block.iov_base = &buffers_[0];
+                    block.iov_len = buffers_.size();
+                    fixed_ = io_uring_register_buffers( &ring_, &block, 1 ) == 0;
+                }
+                armWake();
+            }
+        }
+
+        virtual ~UringAdapter()
+        {
+            stop();
+            join();
+            if( valid_ )
+                io_uring_queue_exit( &ring_ );
+            for( Watch *watch : closing_ )
+                delete watch;
+            for( Watch *watch : closed_ )
+                delete watch;
+            if( wakefd_ >= 0 )
+                close( wakefd_ );
+        }
+
+    public:
+        // false if io_uring instance could not be created (i.e. old kernel), every call fails then
+        inline bool valid() const
+        {
+            return valid_;
+        }
+
+        // true if buffers of connections are registered with the kernel
+        inline bool fixedBuffers() const
+        {
+            return fixed_;
+        }
+
+        virtual int attachContext( redisAsyncContext &ac ) override
+        {
+            if( !valid_ || ac.ev.data != NULL || slots_.empty() ||
+                ac.c.funcs == NULL || ac.c.funcs->async_read != redisAsyncRead )
+                return REDIS_ERR;
+
+            size_t slot = slots_.back();
+            slots_.pop_back();
+            Watch *watch = new Watch( this, &ac, slot, &buffers_[slot * options_.buffer * 2] );
+            watch->funcs.read = ringRead;
+            watch->funcs.write = ringWrite;
+            ac.c.funcs = &watch->funcs;
+            ac.ev.addRead = addRead;
+            ac.ev.delRead = delRead;
+            ac.ev.addWrite = addWrite;
+            ac.ev.delWrite = delWrite;
+            ac.ev.cleanup = cleanup;
+            ac.ev.scheduleTimer = scheduleTimer;
+            ac.ev.data = watch;
+            ++watches_;
+            return REDIS_OK;
+        }
+
+        virtual int runLater( Task task, void *data ) override
+        {
+            if( !valid_ )
+                return REDIS_ERR;
+            tasks_.push_back( TaskData( task, data ) );
+            return REDIS_OK;
+        }
+
+        virtual int runAfter( const struct timeval &delay, Task task, void *data ) override
+        {
+            if( !valid_ )
+                return REDIS_ERR;
+            addTimer( delay, TaskData( task, data ) );
+            return REDIS_OK;
+        }
+
+        virtual int post( Task task, void *data ) override
+        {
+            if( !valid_ )
+                return REDIS_ERR;
+            bool wake = false;
+            {
+                std::lock_guard<std::mutex> locker( postLock_ );
+                wake = posted_.empty();
+                posted_.push_back( TaskData( task, data ) );
+            }
+            if( wake )
+                wakeUp();
+            return REDIS_OK;
+        }
+
+        int run()
+        {
+            if( !valid_ )
+                return REDIS_ERR;
+
+            while( !stopped_.load() && !idle() )
+            {
+                if( wait() != 0 )
+                    return REDIS_ERR;
+
+                runTimers();
+                struct io_uring_cqe *cqes[64];
+                unsigned int count;
+                while( ( count = io_uring_peek_batch_cqe( &ring_, cqes, 64 ) ) > 0 )
+                {
+                    for( unsigned int i = 0; i < count; ++i )
+                        complete( io_uring_cqe_get_data( cqes[i] ), cqes[i]->res );
+                    io_uring_cq_advance( &ring_, count );
+                }
+
+                flushWrites();
+                runTasks();
+                for( Watch *watch : closed_ )
+                {
+                    slots_.push_back( watch->slot );
+                    delete watch;
+                }
+                closed_.clear();
+            }
+            stopped_.store( false );
+            return REDIS_OK;
+        }
+
+        void start()
+        {
+            join();
+            thread_ = std::thread( [this]() { run(); } );
+        }
+
+        void stop()
+        {
+            stopped_.store( true );
+            if( valid_ )
+                wakeUp();
+        }
+
+        void join()
+        {
+            if( thread_.joinable() && thread_.get_id() != std::this_thread::get_id() )
+                thread_.join();
+        }
+
+    private:
+        inline bool idle() const
+        {
+            return watches_ == 0 && closing_.empty() && timers_.empty() && tasks_.empty() && writes_.empty();
+        }
+
+        // submits everything prepared during the iteration and waits for completions with
+        // the same system call, doesn't wait if there is work left for the next iteration
+        int wait()
+        {
+            int result = 0;
+            if( !writes_.empty() || !tasks_.empty() )
+            {
+                result = io_uring_submit( &ring_ );
+            }
+            else if( timers_.empty() )
+            {
+                result = io_uring_submit_and_wait( &ring_, 1 );
+            }
+            else
+            {
+                long long left = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    timers_.begin()->first - Clock::now() ).count();
+                if( left < 0 )
+                    left = 0;
+                struct __kernel_timespec ts;
+                ts.tv_sec = left / 1000000000;
+                ts.tv_nsec = left % 1000000000;
+                struct io_uring_cqe *cqe = nullptr;
+#if defined(IO_URING_VERSION_MAJOR)
+                result = io_uring_submit_and_wait_timeout( &ring_, &cqe, 1, &ts, nullptr );
+#else
+                // wait with extended arguments doesn't submit, old liburing has no call doing both
+                result = io_uring_submit( &ring_ );
+                if( result >= 0 )
+                    result = io_uring_wait_cqe_timeout( &ring_, &cqe, &ts );
+#endif
+                if( result == -ETIME )
+                    result = 0;
+            }
+            return ( result < 0 && result != -EINTR && result != -EAGAIN && result != -EBUSY ) ? result : 0;
+        }
+
+        void complete( void *data, int res )
+        {
+            // cancellations and timeout of wait on kernels without extended arguments
+            if( data == nullptr || data == reinterpret_cast<void*>( LIBURING_UDATA_TIMEOUT ) )
+                return;
+            if( data == &wakeValue_ )
+            {
+                runPosted();
+                armWake();
+                return;
+            }
+
+            Request *request = static_cast<Request*>( data );
+            Watch *watch = request->watch;
+            request->armed = false;
+            if( watch->closed )
+            {
+                release( watch );
+                return;
+            }
+
+            if( request == &watch->in )
+            {
+                if( res > 0 )
+                {
+                    watch->readStart = 0;
+                    watch->readEnd = res;
+                }
+                else if( res != -EINTR && res != -EAGAIN )
+                {
+                    watch->error = ( res == 0 ) ? -1 : -res;
+                }
+                handleRead( watch );
+            }
+            else if( request == &watch->out )
+            {
+                if( res > 0 )
+                    watch->writeStart += res;
+                else if( res != -EINTR && res != -EAGAIN )
+                    watch->error = ( res == 0 ) ? EPIPE : -res;
+                if( watch->error == 0 && watch->writeStart < watch->writeEnd )
+                    send( watch );
+                else if( watch->writing || watch->error != 0 )
+                    queue( watch );
+            }
+            else if( watch->writing )
+            {
+                // connect is completed or failed, hiredis checks which
+                redisAsyncHandleWrite( watch->ac );
+            }
+        }
+
+        // hiredis takes the received bytes, then read request is sent again
+        void handleRead( Watch *watch )
+        {
+            watch->handling = true;
+            while( !watch->closed && watch->reading &&
+                   ( watch->readStart < watch->readEnd || watch->error != 0 ) )
+                redisAsyncHandleRead( watch->ac );
+            watch->handling = false;
+            if( !watch->closed )
+                receive( watch );
+        }
+
+        // read is armed while hiredis waits for replies, received bytes it didn't take
+        // when it stopped reading are handled at the end of the iteration
+        void receive( Watch *watch )
+        {
+            if( watch->handling || watch->in.armed || !watch->reading ||
+                !( watch->ac->c.flags & REDIS_CONNECTED ) )
+                return;
+            if( watch->readStart < watch->readEnd || watch->error != 0 )
+            {
+                queue( watch );
+                return;
+            }
+            char *buffer = watch->buffer;
+            struct io_uring_sqe *sqe = getSqe();
+            if( fixed_ )
+                io_uring_prep_read_fixed( sqe, watch->fd, buffer, options_.buffer, 0, 0 );
+            else
+                io_uring_prep_read( sqe, watch->fd, buffer, options_.buffer, 0 );
+            io_uring_sqe_set_data( sqe, &watch->in );
+            watch->in.armed = true;
+        }
+
+        void send( Watch *watch )
+        {
+            char *buffer = watch->buffer + options_.buffer + watch->writeStart;
+            unsigned int len = watch->writeEnd - watch->writeStart;
+            struct io_uring_sqe *sqe = getSqe();
+            if( fixed_ )
+                io_uring_prep_write_fixed( sqe, watch->fd, buffer, len, 0, 0 );
+            else
+                io_uring_prep_write( sqe, watch->fd, buffer, len, 0 );
+            io_uring_sqe_set_data( sqe, &watch->out );
+            watch->out.armed = true;
+        }
+
+        void arm( Request &request, unsigned int mask )
+        {
+            struct io_uring_sqe *sqe = getSqe();
+            io_uring_prep_poll_add( sqe, request.watch->fd, mask );
+            io_uring_sqe_set_data( sqe, &request );
+            request.armed = true;
+        }
+
+        void cancel( Request &request )
+        {
+            struct io_uring_sqe *sqe = getSqe();
+            if( &request == &request.watch->connect )
+                io_uring_prep_poll_remove( sqe, reinterpret_cast<__u64>( &request ) );
+            else
+                io_uring_prep_cancel( sqe, &request, 0 );
+            io_uring_sqe_set_data( sqe, nullptr );
+        }
+
+        // closed connection is freed when none of its requests can complete anymore
+        void release( Watch *watch )
+        {
+            if( watch->connect.armed || watch->in.armed || watch->out.armed )
+                return;
+            std::vector<Watch*>::iterator found = std::find( closing_.begin(), closing_.end(), watch );
+            if( found != closing_.end() )
+                closing_.erase( found );
+            closed_.push_back( watch );
+        }
+
+        void armWake()
+        {
+            struct io_uring_sqe *sqe = getSqe();
+            io_uring_prep_read( sqe, wakefd_, &wakeValue_, sizeof( wakeValue_ ), 0 );
+            io_uring_sqe_set_data( sqe, &wakeValue_ );
+        }
+
+        // submission queue is flushed to the kernel when it's full
+        struct io_uring_sqe* getSqe()
+        {
+            struct io_uring_sqe *sqe = io_uring_get_sqe( &ring_ );
+            while( sqe == nullptr )
+            {
+                io_uring_submit( &ring_ );
+                sqe = io_uring_get_sqe( &ring_ );
+            }
+            return sqe;
+        }
+
+        void queue( Watch *watch )
+        {
+            if( watch->queued )
+                return;
+            watch->queued = true;
+            writes_.push_back( watch );
+        }
+
+        // connections with received bytes left, failed ones and ones with commands to write
+        void flushWrites()
+        {
+            flushing_.swap( writes_ );
+            for( Watch *watch : flushing_ )
+            {
+                watch->queued = false;
+                if( !watch->closed && watch->reading )
+                    handleRead( watch );
+                if( !watch->closed && ( watch->writing || watch->error != 0 ) && !watch->out.armed )
+                    redisAsyncHandleWrite( watch->ac );
+            }
+            flushing_.clear();
+        }
+
+        void runTasks()
+        {
+            running_.swap( tasks_ );
+            for( size_t i = 0; i < running_.size(); ++i )
+                running_[i].first( running_[i].second );
+            running_.clear();
+        }
+
+        void runPosted()
+        {
+            {
+                std::lock_guard<std::mutex> locker( postLock_ );
+                postRunning_.swap( posted_ );
+            }
+            for( size_t i = 0; i < postRunning_.size(); ++i )
+                postRunning_[i].first( postRunning_[i].second );
+            postRunning_.clear();
+        }
+
+        Timers::iterator addTimer( const struct timeval &delay, const TaskData &task )
+        {
+            return timers_.insert( Timers::value_type(
+                Clock::now() + std::chrono::seconds( delay.tv_sec ) + std::chrono::microseconds( delay.tv_usec ),
+                task ) );
+        }
+
+        void runTimers()
+        {
+            Clock::time_point now = Clock::now();
+            while( !timers_.empty() && timers_.begin()->first <= now )
+            {
+                TaskData task = timers_.begin()->second;
+                timers_.erase( timers_.begin() );
+                task.first( task.second );
+            }
+        }
+
+        void wakeUp()
+        {
+            uint64_t one = 1;
+            ssize_t written = write( wakefd_, &one, sizeof( one ) );
+            (void)written;
+        }
+
+        static int fail( redisContext *c, int error )
+        {
+            if( error < 0 )
+            {
+                c->err = REDIS_ERR_EOF;
+                snprintf( c->errstr, sizeof( c->errstr ), "%s", "Server closed the connection" );
+            }
+            else
+            {
+                c->err = REDIS_ERR_IO;
+                snprintf( c->errstr, sizeof( c->errstr ), "%s", strerror( error ) );
+            }
+            return -1;
+        }
+
+        // hiredis read and write functions, the context is the first member of the async one
+        static ssize_t ringRead( redisContext *c, char *buf, size_t size )
+        {
+            Watch *watch = static_cast<Watch*>( reinterpret_cast<redisAsyncContext*>( c )->ev.data );
+            if( watch->readStart == watch->readEnd )
+                return watch->error != 0 ? fail( c, watch->error ) : 0;
+            size_t len = std::min( size, watch->readEnd - watch->readStart );
+            memcpy( buf, watch->buffer + watch->readStart, len );
+            watch->readStart += len;
+            return len;
+        }
+
+        // bytes are copied to the write buffer and written when the iteration is submitted,
+        // nothing is taken while the previous write is in flight
+        static ssize_t ringWrite( redisContext *c )
+        {
+            Watch *watch = static_cast<Watch*>( reinterpret_cast<redisAsyncContext*>( c )->ev.data );
+            if( watch->error != 0 )
+                return fail( c, watch->error );
+            if( watch->out.armed )
+                return 0;
+            size_t len = std::min( sdslen( c->obuf ), watch->adapter->options_.buffer );
+            memcpy( watch->buffer + watch->adapter->options_.buffer, c->obuf, len );
+            watch->writeStart = 0;
+            watch->writeEnd = len;
+            watch->adapter->send( watch );
+            return len;
+        }
+
+        // hiredis event hooks
+        static void addRead( void *privdata )
+        {
+            Watch *watch = static_cast<Watch*>( privdata );
+            watch->reading = true;
+            watch->adapter->receive( watch );
+        }
+
+        static void delRead( void *privdata )
+        {
+            static_cast<Watch*>( privdata )->reading = false;
+        }
+
+        // connected context is written at the end of the iteration, connecting one waits
+        // for POLLOUT which tells that the connection is established
+        static void addWrite( void *privdata )
+        {
+            Watch *watch = static_cast<Watch*>( privdata );
+            watch->writing = true;
+            if( watch->ac->c.flags & REDIS_CONNECTED )
+            {
+                if( !watch->out.armed )
+                    watch->adapter->queue( watch );
+            }
+            else if( !watch->connect.armed )
+            {
+                watch->adapter->arm( watch->connect, POLLOUT );
+            }
+        }
+
+        static void delWrite( void *privdata )
+        {
+            static_cast<Watch*>( privdata )->writing = false;
+        }
+
+        static void cleanup( void *privdata )
+        {
+            Watch *watch = static_cast<Watch*>( privdata );
+            UringAdapter *that = watch->adapter;
+            watch->ac->c.funcs = watch->original;
+            if( watch->timer )
+                that->timers_.erase( watch->timeout );
+            if( watch->queued )
+                that->writes_.erase( std::find( that->writes_.begin(), that->writes_.end(), watch ) );
+            for( Request *request : { &watch->connect, &watch->in, &watch->out } )
+            {
+                if( request->armed )
+                    that->cancel( *request );
+            }
+            watch->reading = watch->writing = watch->timer = watch->queued = false;
+            watch->closed = true;
+            watch->ac->ev.data = NULL;
+            that->closing_.push_back( watch );
+            that->release( watch );
+            --that->watches_;
+        }
+
+        static void scheduleTimer( void *privdata, struct timeval tv )
+        {
+            Watch *watch = static_cast<Watch*>( privdata );
+            UringAdapter *that = watch->adapter;
+            if( watch->timer )
+                that->timers_.erase( watch->timeout );
+            watch->timeout = that->addTimer( tv, TaskData( onTimeout, watch ) );
+            watch->timer = true;
+        }
+
+        static void onTimeout( void *data )
+        {
+            Watch *watch = static_cast<Watch*>( data );
+            watch->timer = false;
+            if( !watch->closed )
+                redisAsyncHandleTimeout( watch->ac );
+        }
+
+    private:
+        struct io_uring ring_;
+        bool valid_;
+        bool fixed_;
+        Options options_;
+        // read and write buffers of every connection, registered as one block
+        std::vector<char> buffers_;
+        std::vector<size_t> slots_;
+        int wakefd_;
+        uint64_t wakeValue_;
+
+        int watches_;
+        std::vector<Watch*> writes_;
+        std::vector<Watch*> flushing_;
+        std::vector<Watch*> closing_;
+        std::vector<Watch*> closed_;
+
+        Timers timers_;
+        TaskList tasks_;
+        TaskList running_;
+
+        std::mutex postLock_;
+        TaskList posted_;
+        TaskList postRunning_;
+
+        std::atomic<bool> stopped_;
+        std::thread thread_;
+    };  // class UringAdapter
+}  // namespace RedisCluster
+
+#endif  // __libredisCluster_adapters_uringadapter_h__
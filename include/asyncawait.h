@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2015, Dmitrii Shinkevich <shinmail at gmail dot com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __libredisCluster__asyncawait__
+#define __libredisCluster__asyncawait__
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#include <coroutine>
+#include <cstdarg>
+
+#include "asynchirediscommand.h"
+#include "reply.h"
+
+namespace RedisCluster
+{
+    // C++20 awaitable asynchronous command, usage inside a coroutine running in event loop thread:
+    //
+    //     Reply reply = co_await AwaitCommand( cluster_p, "FOO", "GET %s", "FOO" );
+    //
+    // Command is formatted right away and sent when coroutine suspends. Coroutine is resumed
+    // straight from the hiredis reply callback with an owned copy of the reply. Redirections,
+    // retries and user error callback work the same way as for AsyncHiredisCommand callbacks,
+    // so error replies (lost connection and timeout errors too) are returned as REDIS_REPLY_ERROR replies.
+    // Exceptions thrown while sending the command are rethrown from co_await.
+    template < typename Cluster = Cluster<redisAsyncContext> >
+    class AwaitableCommand
+    {
+        typedef AsyncHiredisCommand<Cluster> Command;
+
+        AwaitableCommand(const AwaitableCommand&) = delete;
+        AwaitableCommand& operator=(const AwaitableCommand&) = delete;
+
+    public:
+        AwaitableCommand( typename Cluster::ptr_t cluster_p, const string &key, char *cmd, int len ) :
+        cluster_p_( cluster_p ),
+        key_( key ),
+        cmd_( cmd ),
+        len_( len ),
+        userErrorCb_( nullptr ),
+        timeout_{ 0, 0 },
+        handle_(),
+        reply_(),
+        suspended_( false ),
+        completed_( false )
+        {
+        }
+
+        AwaitableCommand( AwaitableCommand &&other ) :
+        cluster_p_( other.cluster_p_ ),
+        key_( std::move( other.key_ ) ),
+        cmd_( other.cmd_ ),
+        len_( other.len_ ),
+        userErrorCb_( other.userErrorCb_ ),
+        timeout_( other.timeout_ ),
+        handle_(),
+        reply_(),
+        suspended_( false ),
+        completed_( false )
+        {
+            other.cmd_ = nullptr;
+        }
+
+        ~AwaitableCommand()
+        {
+            // command was never sent
+            free( cmd_ );
+        }
+
+        // set user error handler for the command, see AsyncHiredisCommand::setUserErrorCb
+        AwaitableCommand& setUserErrorCb( typename Command::userErrorCallbackFn *userErrorCb )
+        {
+            userErrorCb_ = userErrorCb;
+            return *this;
+        }
+
+        // deadline of the command, see AsyncHiredisCommand::setTimeout
+        AwaitableCommand& setTimeout( const struct timeval &timeout )
+        {
+            timeout_ = timeout;
+            return *this;
+        }
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        // user error handler and deadline are given to the command before it's sent, coroutine
+        // isn't suspended if the command completes before it returns
+        bool await_suspend( std::coroutine_handle<> handle )
+        {
+            handle_ = handle;
+            char *cmd = cmd_;
+            cmd_ = nullptr;
+            // callback captures only this pointer, so it is stored inline in the command
+            Command::FormattedCommand( cluster_p_, key_, cmd, len_,
+                [this]( const redisReply &reply ) {
+                    reply_ = copyReply( reply );
+                    completed_ = true;
+                    if( suspended_ )
+                        handle_.resume();
+                }, userErrorCb_, timeout_ );
+            suspended_ = !completed_;
+            return suspended_;
+        }
+
+        Reply await_resume()
+        {
+            return std::move( reply_ );
+        }
+
+    private:
+        typename Cluster::ptr_t cluster_p_;
+        string key_;
+        char *cmd_;
+        int len_;
+        typename Command::userErrorCallbackFn *userErrorCb_;
+        struct timeval timeout_;
+        std::coroutine_handle<> handle_;
+        Reply reply_;
+        bool suspended_;
+        bool completed_;
+    };
+
+    template < typename Cluster >
+    inline AwaitableCommand<Cluster> AwaitCommand( Cluster *cluster_p,
+                                                  const string &key,
+                                                  const char *format, ... )
+    {
+        char *cmd = nullptr;
+        va_list ap;
+        va_start( ap, format );
+        int len = redisvFormatCommand( &cmd, format, ap );
+        va_end( ap );
+        if( len < 0 )
+            throw InvalidArgument(nullptr);
+        return AwaitableCommand<Cluster>( cluster_p, key, cmd, len );
+    }
+
+    template < typename Cluster >
+    inline AwaitableCommand<Cluster> AwaitCommand( Cluster *cluster_p,
+                                                  const string &key,
+                                                  int argc,
+                                                  const char ** argv,
+                                                  const size_t *argvlen )
+    {
+        char *cmd = nullptr;
+        long long len = redisFormatCommandArgv( &cmd, argc, argv, argvlen );
+        if( len < 0 )
+            throw InvalidArgument(nullptr);
+        return AwaitableCommand<Cluster>( cluster_p, key, cmd, static_cast<int>( len ) );
+    }
+}
+
+#endif /* __cpp_impl_coroutine */
+
+#endif /* defined(__libredisCluster__asyncawait__) */
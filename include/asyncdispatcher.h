@@ -0,0 +1,361 @@
+/*
+ * Copyright (c) 2015, Dmitrii Shinkevich <shinmail at gmail dot com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __libredisCluster__asyncdispatcher__
+#define __libredisCluster__asyncdispatcher__
+
+#include <atomic>
+#include <cstdarg>
+#include <future>
+#include <memory>
+
+#include "adapters/adapter.h"  // for Adapter
+#include "asynchirediscommand.h"
+#include "inlinefunction.h"
+#include "reply.h"
+
+namespace RedisCluster
+{
+    // Thread safe front end of asynchronous cluster. Any thread can submit commands,
+    // they are formatted in the calling thread and pushed to lock free multiple producers
+    // single consumer queue. The event loop is woken up through Adapter::post and sends
+    // them with AsyncHiredisCommand. So one event loop serves a pool of worker threads
+    // over a small number of multiplexed connections.
+    //
+    // Results come back either as std::future<Reply> or to completion callback, which is
+    // invoked in the event loop thread. Cluster and dispatcher must be created and
+    // destroyed in the loop thread, commands left in the queue are finished with error.
+    template < typename Cluster = Cluster<redisAsyncContext> >
+    class AsyncDispatcher
+    {
+        typedef AsyncHiredisCommand<Cluster> AsyncCommand;
+
+        AsyncDispatcher(const AsyncDispatcher&) = delete;
+        AsyncDispatcher& operator=(const AsyncDispatcher&) = delete;
+
+    public:
+        // completion token, invoked in the event loop thread with owned reply. If command
+        // can't be sent, reply is REDIS_REPLY_ERROR with exception description
+        typedef InlineFunction<void (const Reply& reply)> Completion;
+
+    private:
+        struct Request
+        {
+            Request() : next( nullptr ), key(), cmd( nullptr ), len( 0 ), completion(), promise() {}
+
+            Request( const Request& ) = delete;
+            Request& operator=( const Request& ) = delete;
+
+            ~Request()
+            {
+                free( cmd );
+            }
+
+            std::atomic<Request*> next;
+            string key;
+            char *cmd;
+            int len;
+            Completion completion;
+            std::shared_ptr< std::promise<Reply> > promise;
+        };
+
+        // token of wakeups posted to the loop, it's shared by dispatcher and posted
+        // wakeups, so dispatcher destroyed before them only detaches it
+        struct Wakeup
+        {
+            explicit Wakeup( AsyncDispatcher *owner ) : owner( owner ), refs( 1 ) {}
+
+            Wakeup( const Wakeup& ) = delete;
+            Wakeup& operator=( const Wakeup& ) = delete;
+
+            AsyncDispatcher *owner;
+            std::atomic<int> refs;
+        };
+
+        static void release( Wakeup *wakeup )
+        {
+            if( wakeup->refs.fetch_sub( 1, std::memory_order_acq_rel ) == 1 )
+                delete wakeup;
+        }
+
+    public:
+        AsyncDispatcher( typename Cluster::ptr_t cluster_p, Adapter &adapter ) :
+        cluster_p_( cluster_p ),
+        adapter_( adapter ),
+        userErrorCb_( nullptr ),
+        timeout_(),
+        head_( &stub_ ),
+        tail_( &stub_ ),
+        stub_(),
+        scheduled_( false ),
+        wakeup_( nullptr )
+        {
+            if( cluster_p == nullptr )
+                throw InvalidArgument(nullptr);
+            wakeup_ = new Wakeup( this );
+        }
+
+        // wakeups which haven't run yet find the token detached
+        ~AsyncDispatcher()
+        {
+            wakeup_->owner = nullptr;
+            release( wakeup_ );
+            while( Request *request = pop() )
+            {
+                fail( request, std::make_exception_ptr( DisconnectedException() ) );
+            }
+        }
+
+        // user error handler for all commands sent by dispatcher
+        inline void setUserErrorCb( typename AsyncCommand::userErrorCallbackFn *userErrorCb )
+        {
+            userErrorCb_ = userErrorCb;
+        }
+
+        // deadline of every command sent by dispatcher counted from the moment the loop
+        // sends it, zero timeout (default) means no deadline
+        inline void setTimeout( const struct timeval &timeout )
+        {
+            timeout_ = timeout;
+        }
+
+        // thread safe submission of the command, reply is passed to completion in the loop thread
+        void Command( const string &key, const Completion &completion, const char *format, ... )
+        {
+            va_list ap;
+            va_start( ap, format );
+            Request *request = makeRequest( key, format, ap );
+            va_end( ap );
+            request->completion = completion;
+            push( request );
+        }
+
+        void Command( const string &key, const Completion &completion, const char *format, va_list ap )
+        {
+            Request *request = makeRequest( key, format, ap );
+            request->completion = completion;
+            push( request );
+        }
+
+        void Command( const string &key, const Completion &completion,
+                     int argc, const char ** argv, const size_t *argvlen )
+        {
+            Request *request = makeRequest( key, argc, argv, argvlen );
+            request->completion = completion;
+            push( request );
+        }
+
+        // thread safe submission of the command, reply is returned through the future
+        std::future<Reply> Command( const string &key, const char *format, ... )
+        {
+            va_list ap;
+            va_start( ap, format );
+            Request *request = makeRequest( key, format, ap );
+            va_end( ap );
+            return pushWithPromise( request );
+        }
+
+        std::future<Reply> Command( const string &key, const char *format, va_list ap )
+        {
+            return pushWithPromise( makeRequest( key, format, ap ) );
+        }
+
+        std::future<Reply> Command( const string &key, int argc, const char ** argv, const size_t *argvlen )
+        {
+            return pushWithPromise( makeRequest( key, argc, argv, argvlen ) );
+        }
+
+    private:
+        static Request* makeRequest( const string &key, const char *format, va_list ap )
+        {
+            Request *request = new Request();
+            request->key = key;
+            request->len = redisvFormatCommand( &request->cmd, format, ap );
+            if( request->len < 0 )
+            {
+                delete request;
+                throw InvalidArgument(nullptr);
+            }
+            return request;
+        }
+
+        static Request* makeRequest( const string &key, int argc, const char ** argv, const size_t *argvlen )
+        {
+            Request *request = new Request();
+            request->key = key;
+            request->len = static_cast<int>( redisFormatCommandArgv( &request->cmd, argc, argv, argvlen ) );
+            if( request->len < 0 )
+            {
+                delete request;
+                throw InvalidArgument(nullptr);
+            }
+            return request;
+        }
+
+        std::future<Reply> pushWithPromise( Request *request )
+        {
+            request->promise = std::make_shared< std::promise<Reply> >();
+            std::future<Reply> future = request->promise->get_future();
+            push( request );
+            return future;
+        }
+
+        // producers side of intrusive MPSC queue (Dmitry Vyukov's algorithm)
+        void enqueue( Request *request )
+        {
+            request->next.store( nullptr, std::memory_order_relaxed );
+            Request *prev = head_.exchange( request, std::memory_order_acq_rel );
+            prev->next.store( request, std::memory_order_release );
+        }
+
+        void push( Request *request )
+        {
+            enqueue( request );
+            // only the first command after the loop drained the queue wakes it up
+            if( !scheduled_.exchange( true, std::memory_order_acq_rel ) )
+            {
+                wakeup_->refs.fetch_add( 1, std::memory_order_relaxed );
+                if( adapter_.post( drain, wakeup_ ) != REDIS_OK )
+                {
+                    release( wakeup_ );
+                    scheduled_.store( false );
+                    throw LogicError(nullptr, "adapter doesn't support posting from other threads");
+                }
+            }
+        }
+
+        // consumer side, called only from the loop thread
+        Request* pop()
+        {
+            Request *tail = tail_;
+            Request *next = tail->next.load( std::memory_order_acquire );
+            if( tail == &stub_ )
+            {
+                if( next == nullptr )
+                    return nullptr;
+                tail_ = next;
+                tail = next;
+                next = next->next.load( std::memory_order_acquire );
+            }
+            if( next != nullptr )
+            {
+                tail_ = next;
+                return tail;
+            }
+            if( tail != head_.load( std::memory_order_acquire ) )
+            {
+                // producer is in the middle of push, it would wake us up again
+                return nullptr;
+            }
+            enqueue( &stub_ );
+            next = tail->next.load( std::memory_order_acquire );
+            if( next != nullptr )
+            {
+                tail_ = next;
+                return tail;
+            }
+            return nullptr;
+        }
+
+        static void drain( void *data )
+        {
+            Wakeup *wakeup = static_cast<Wakeup*>( data );
+            AsyncDispatcher *that = wakeup->owner;
+            release( wakeup );
+            if( that == nullptr )
+                return;
+            that->scheduled_.store( false, std::memory_order_release );
+            while( Request *request = that->pop() )
+            {
+                that->send( request );
+            }
+        }
+
+        void send( Request *request )
+        {
+            char *cmd = request->cmd;
+            request->cmd = nullptr;
+            try
+            {
+                typename AsyncCommand::RedisCallback callback = [request]( const redisReply &reply ) {
+                    finish( request, reply );
+                };
+                // handler and deadline are given before sending, so a command finished
+                // synchronously reaches the handler too
+                AsyncCommand::FormattedCommand( cluster_p_, request->key, cmd, request->len, callback, userErrorCb_, timeout_ );
+            }
+            catch( ... )
+            {
+                fail( request, std::current_exception() );
+            }
+        }
+
+        static void finish( Request *request, const redisReply &reply )
+        {
+            if( request->promise )
+                request->promise->set_value( copyReply( reply ) );
+            else if( request->completion )
+                request->completion( copyReply( reply ) );
+            delete request;
+        }
+
+        static void fail( Request *request, std::exception_ptr error )
+        {
+            if( request->promise )
+            {
+                request->promise->set_exception( error );
+            }
+            else if( request->completion )
+            {
+                try
+                {
+                    std::rethrow_exception( error );
+                }
+                catch( const std::exception &e )
+                {
+                    request->completion( copyReply( makeErrorReply( e.what() ) ) );
+                }
+            }
+            delete request;
+        }
+
+        typename Cluster::ptr_t cluster_p_;
+        Adapter &adapter_;
+        typename AsyncCommand::userErrorCallbackFn *userErrorCb_;
+        struct timeval timeout_;
+
+        std::atomic<Request*> head_;
+        Request *tail_;
+        Request stub_;
+        // loop is woken up and will drain the queue
+        std::atomic<bool> scheduled_;
+        Wakeup *wakeup_;
+    };
+}
+
+#endif /* defined(__libredisCluster__asyncdispatcher__) */
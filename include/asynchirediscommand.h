@@ -29,13 +29,24 @@
 #ifndef __libredisCluster__asynchirediscommand__
 #define __libredisCluster__asynchirediscommand__
 
+#include <algorithm>
 #include <assert.h>
-#include <functional>  // for function<>
 #include <iostream>
+#include <list>
+#include <vector>
 
 #include "adapters/adapter.h"  // for Adapter
 #include "cluster.h"
+#include "commandtemplate.h"
 #include "hiredisprocess.h"
+#include "inflightlimiter.h"
+#include "inlinefunction.h"
+#include "reply.h"
+#include "replyarena.h"
+#include "replyview.h"
+#include "slabpool.h"
+#include "timerwheel.h"
+#include "writebatcher.h"
 
 extern "C"
 {
@@ -52,11 +63,32 @@ namespace RedisCluster
     class AsyncHiredisCommand
     {
         typedef redisAsyncContext Connection;
+        enum CommandType
+        {
+            SDS,
+            FORMATTED_STRING
+        };
 
+        struct Reconnection;
+        struct DownNode;
+        typedef std::list<AsyncHiredisCommand<Cluster>*> WaitList;
+        
         struct ConnectContext {
             Adapter *adapter;
             typename Cluster::ptr_t pcluster;
             int lifetime;
+            WriteBatcher *batcher;
+            InFlightLimiter *limiter;
+            // lost nodes being reconnected, nullptr if reconnection is disabled
+            Reconnection *reconnection;
+            // deadlines of commands
+            TimerWheel *wheel;
+            // replies are built in arenas
+            bool replyArena;
+            // connections speak RESP3
+            bool resp3;
+            // handler of RESP3 push messages
+            void (*pushCb)( typename Cluster::ptr_t, const redisReply & );
         };
         
         AsyncHiredisCommand(const AsyncHiredisCommand&) = delete;
@@ -72,7 +104,57 @@ namespace RedisCluster
             RETRY
         };
         
-        typedef std::function<void (const redisReply& reply)> RedisCallback;
+        // handler of RESP3 push messages (i.e. client tracking invalidations), it's called
+        // in the loop thread, reply is owned by hiredis
+        typedef void (pushCallbackFn)( typename Cluster::ptr_t cluster_p, const redisReply &reply );
+        
+        // options of asynchronous cluster, all features are disabled by default
+        struct Options
+        {
+            Options() :
+            corking( false ),
+            limiter( nullptr ),
+            reconnect( false ),
+            reconnectQueue( 10000 ),
+            reconnectDelay{ 0, 100000 },
+            reconnectMaxDelay{ 5, 0 },
+            timerResolution{ 0, 10000 },
+            replyArena( false ),
+            resp3( false ),
+            pushCb( nullptr )
+            {}
+            
+            // gather commands issued during one event loop iteration and send
+            // them to every node with a single write at the end of iteration
+            // (adapter must support Adapter::runLater)
+            bool corking;
+            // limits of commands in flight, owned by user and used by one cluster only
+            InFlightLimiter *limiter;
+            // lost node connection is reconnected when a command for the node comes, commands
+            // wait for it in bounded queue, failed attempts are repeated with exponential backoff
+            // starting from reconnectDelay. Waiting commands fail after an attempt failed with
+            // reconnectMaxDelay (adapter must support Adapter::runAfter). Commands sent before
+            // the loss are not repeated, they could be executed already.
+            bool reconnect;
+            size_t reconnectQueue;
+            struct timeval reconnectDelay;
+            struct timeval reconnectMaxDelay;
+            // precision of command deadlines (see setTimeout)
+            struct timeval timerResolution;
+            // every reply is built in one arena instead of allocation per node (see ReplyArena)
+            bool replyArena;
+            // every connection sends HELLO 3 before any command and speaks RESP3: maps, sets,
+            // doubles, booleans and push messages come with their own reply types (hiredis 1.1+).
+            // Connection is closed if the node refuses it
+            bool resp3;
+            // push messages are passed to pushCb, they are dropped if it's not set
+            pushCallbackFn *pushCb;
+        };
+        
+        // callbacks up to 48 bytes (i.e. lambdas capturing a few values) are stored
+        // inside the command object without heap allocation. It was std::function before,
+        // std::function is still accepted and assigned to it (bigger ones go to heap)
+        typedef InlineFunction<void (const redisReply& reply)> RedisCallback;
         typedef Action (userErrorCallbackFn)( const AsyncHiredisCommand<Cluster> &,
                                                       const ClusterException &,
                                                       HiredisProcess::processState );
@@ -80,7 +162,7 @@ namespace RedisCluster
         
         static inline AsyncHiredisCommand<Cluster>& Command(
             typename Cluster::ptr_t cluster_p,
-            string key,  // todo: const
+            const string &key,
             int argc,
             const char ** argv,
             const size_t *argvlen,
@@ -89,17 +171,12 @@ namespace RedisCluster
             // would be deleted in redis reply callback or in case of error
             AsyncHiredisCommand<Cluster> *c = new AsyncHiredisCommand<Cluster>(
                 cluster_p, key, argc, argv, argvlen, redisCallback );
-            if( c->process() != REDIS_OK )
-            {
-                delete c;
-                throw DisconnectedException();
-            }
-            return *c;
+            return send( c );
         }
         
         static inline AsyncHiredisCommand<Cluster>& Command(
             typename Cluster::ptr_t cluster_p,
-            string key,
+            const string &key,
             const RedisCallback& redisCallback,
             const char *format, ... )
         {
@@ -108,30 +185,82 @@ namespace RedisCluster
             // would be deleted in redis reply callback or in case of error
             AsyncHiredisCommand<Cluster> *c = new AsyncHiredisCommand<Cluster>(
                 cluster_p, key, format, ap, redisCallback );
-            if( c->process() != REDIS_OK )
-            {
-                delete c;
-                throw DisconnectedException();
-            }
             va_end(ap);
-            return *c;
+            return send( c );
         }
         
         static inline AsyncHiredisCommand<Cluster>& Command(
             typename Cluster::ptr_t cluster_p,
-            string key,
+            const string &key,
             const char *format, va_list ap,
             const RedisCallback& redisCallback = RedisCallback())
         {
             // would be deleted in redis reply callback or in case of error
             AsyncHiredisCommand<Cluster> *c = new AsyncHiredisCommand<Cluster>(
                 cluster_p, key, format, ap, redisCallback );
-            if( c->process() != REDIS_OK )
+            return send( c );
+        }
+
+        // sends command already formatted in redis protocol, cmd must be allocated
+        // with malloc (i.e. by redisFormatCommand) and is owned by command since now
+        static inline AsyncHiredisCommand<Cluster>& FormattedCommand(
+            typename Cluster::ptr_t cluster_p,
+            const string &key,
+            char *cmd,
+            int len,
+            const RedisCallback& redisCallback = RedisCallback())
+        {
+            AsyncHiredisCommand<Cluster> *c = nullptr;
+            try
             {
-                delete c;
-                throw DisconnectedException();
+                c = new AsyncHiredisCommand<Cluster>( cluster_p, key, cmd, len, redisCallback );
             }
-            return *c;
+            catch( ... )
+            {
+                free( cmd );
+                throw;
+            }
+            return send( c );
+        }
+
+        // same with user error handler and deadline (zero timeout means no deadline) given
+        // before the command is sent, so they are in place whenever the command completes
+        static inline AsyncHiredisCommand<Cluster>& FormattedCommand(
+            typename Cluster::ptr_t cluster_p,
+            const string &key,
+            char *cmd,
+            int len,
+            const RedisCallback& redisCallback,
+            userErrorCallbackFn *userErrorCb,
+            const struct timeval &timeout )
+        {
+            AsyncHiredisCommand<Cluster> *c = nullptr;
+            try
+            {
+                c = new AsyncHiredisCommand<Cluster>( cluster_p, key, cmd, len, redisCallback );
+            }
+            catch( ... )
+            {
+                free( cmd );
+                throw;
+            }
+            c->userErrorCb_ = userErrorCb;
+            return send( c, &timeout );
+        }
+
+        // command prepared by CommandTemplate::bind, command keeps a copy of template
+        // buffer for redirections, so the template can be bound again right away
+        static inline AsyncHiredisCommand<Cluster>& Command(
+            typename Cluster::ptr_t cluster_p,
+            const string &key,
+            const CommandTemplate &command,
+            const RedisCallback& redisCallback = RedisCallback())
+        {
+            char *cmd = static_cast<char*>( malloc( command.size() ) );
+            if( cmd == nullptr )
+                throw std::bad_alloc();
+            memcpy( cmd, command.data(), command.size() );
+            return FormattedCommand( cluster_p, key, cmd, static_cast<int>( command.size() ), redisCallback );
         }
 
         // Todo: Allow hosts
@@ -140,6 +269,16 @@ namespace RedisCluster
             int port,
             Adapter& adapter,
             const struct timeval &timeout = { 3, 0 } )
+        {
+            return createCluster( host, port, adapter, Options(), timeout );
+        }
+        
+        static typename Cluster::ptr_t createCluster(
+            const char* host,
+            int port,
+            Adapter& adapter,
+            const Options& options,
+            const struct timeval &timeout = { 3, 0 } )
         {
             typename Cluster::ptr_t cluster(NULL);
             redisReply *reply = nullptr;
@@ -149,14 +288,56 @@ namespace RedisCluster
                 throw ConnectionFailedException(nullptr);
             
             reply = static_cast<redisReply*>( redisCommand( con, Cluster::CmdInit() ) );
+            redisFree( con );
             HiredisProcess::checkCritical( reply, true );
             
-            ConnectContext *cc = new ConnectContext({ &adapter, nullptr, 0});
-            cluster = new Cluster(reply, connect, disconnect, (void*)cc, clusterDestructCB, static_cast<void*>(cc));
-            cc->pcluster = cluster;
+            try
+            {
+                cluster = createCluster( reply, adapter, options );
+            }
+            catch( ... )
+            {
+                freeReplyObject( reply );
+                throw;
+            }
             
             freeReplyObject( reply );
-            redisFree( con );
+            
+            return cluster;
+        }
+        
+        // creates cluster from already received "CLUSTER SLOTS" reply, so several clusters
+        // (i.e. one per event loop) can be built from a single routing table. Reply stays
+        // owned by the caller and is never freed here, even when an exception is thrown
+        static typename Cluster::ptr_t createCluster(
+            redisReply *reply,
+            Adapter& adapter,
+            const Options& options = Options() )
+        {
+            // malformed reply would be freed by the exception of cluster constructor
+            if( !Cluster::isSlotsReply( reply ) )
+                throw ConnectionFailedException(nullptr);
+            
+            typename Cluster::ptr_t cluster(NULL);
+            ConnectContext *cc = new ConnectContext({ &adapter, nullptr, 0, nullptr, options.limiter, nullptr,
+                new TimerWheel( adapter, options.timerResolution ), options.replyArena,
+                options.resp3, options.pushCb });
+            if( options.corking )
+                cc->batcher = new WriteBatcher( adapter );
+            if( options.reconnect )
+                cc->reconnection = new Reconnection( options );
+            
+            try
+            {
+                cluster = new Cluster(reply, connect, disconnect, (void*)cc, clusterDestructCB, static_cast<void*>(cc));
+            }
+            catch( ... )
+            {
+                cc->pcluster = nullptr;
+                releaseContext( cc );
+                throw;
+            }
+            cc->pcluster = cluster;
             
             return cluster;
         }
@@ -166,10 +347,18 @@ namespace RedisCluster
             userErrorCb_ = userErrorCb;
         }
         
+        // deadline of the command counted from now, it covers waiting in queues and redirections.
+        // When it expires user error handler gets TimeoutException and callback gets error reply,
+        // reply coming later is dropped. Precision is Options::timerResolution
+        inline void setTimeout( const struct timeval &timeout )
+        {
+            context_->wheel->schedule( timer_, timeout );
+        }
+        
     protected:
         
         AsyncHiredisCommand( typename Cluster::ptr_t cluster_p,
-            string key,
+            const string &key,
             int argc,
             const char ** argv,
             const size_t *argvlen,
@@ -178,61 +367,306 @@ namespace RedisCluster
         redisCallback_( redisCallback ),
         userErrorCb_( NULL ),
         con_( {"",  NULL} ),
-        key_( key ),
-        cmd_{} {
+        slotCon_( { {0, 0}, NULL } ),
+        limiter_( nullptr ),
+        limitedHost_(),
+        ticket_(),
+        queued_( false ),
+        downNode_( nullptr ),
+        nodeWaiting_(),
+        context_( nullptr ),
+        timer_( onTimeout, this ),
+        timedOut_( false ),
+        slot_( SlotHash::SlotByKey( key.data(), key.size() ) ),
+        cmd_( nullptr ),
+        len_( 0 ),
+        type_( SDS ) {
             if(!cluster_p)
                 throw InvalidArgument(nullptr);
+            // formatted buffer is owned by command till the end, no copy is made
             sds buf = nullptr;
-            int len = redisFormatSdsCommandArgv(&buf, argc, argv, argvlen);
-            cmd_ = string(static_cast<char*>(buf), len);
-            sdsfree(buf);
+            len_ = redisFormatSdsCommandArgv(&buf, argc, argv, argvlen);
+            cmd_ = buf;
         }
         
         AsyncHiredisCommand( typename Cluster::ptr_t cluster_p,
-            string key,
+            const string &key,
             const char *format, va_list ap,
             const RedisCallback& redisCallback = RedisCallback()) :
         cluster_p_( cluster_p ),
         redisCallback_( redisCallback ),
         userErrorCb_( NULL ),
         con_( {"", NULL} ),
-        key_( key ),
-        cmd_{} {
+        slotCon_( { {0, 0}, NULL } ),
+        limiter_( nullptr ),
+        limitedHost_(),
+        ticket_(),
+        queued_( false ),
+        downNode_( nullptr ),
+        nodeWaiting_(),
+        context_( nullptr ),
+        timer_( onTimeout, this ),
+        timedOut_( false ),
+        slot_( SlotHash::SlotByKey( key.data(), key.size() ) ),
+        cmd_( nullptr ),
+        len_( 0 ),
+        type_( FORMATTED_STRING ) {
             if(!cluster_p)
                 throw InvalidArgument(nullptr);
-            char * buf = nullptr;
-            int len = redisvFormatCommand(&buf, format, ap);
-            cmd_ = string(buf,len);
-            free(buf);
+            len_ = redisvFormatCommand(&cmd_, format, ap);
+        }
+        
+        AsyncHiredisCommand( typename Cluster::ptr_t cluster_p,
+            const string &key,
+            char *cmd, int len,
+            const RedisCallback& redisCallback = RedisCallback()) :
+        cluster_p_( cluster_p ),
+        redisCallback_( redisCallback ),
+        userErrorCb_( NULL ),
+        con_( {"", NULL} ),
+        slotCon_( { {0, 0}, NULL } ),
+        limiter_( nullptr ),
+        limitedHost_(),
+        ticket_(),
+        queued_( false ),
+        downNode_( nullptr ),
+        nodeWaiting_(),
+        context_( nullptr ),
+        timer_( onTimeout, this ),
+        timedOut_( false ),
+        slot_( SlotHash::SlotByKey( key.data(), key.size() ) ),
+        cmd_( nullptr ),
+        len_( 0 ),
+        type_( FORMATTED_STRING ) {
+            if(!cluster_p)
+                throw InvalidArgument(nullptr);
+            cmd_ = cmd;
+            len_ = len;
         }
          
         ~AsyncHiredisCommand()
         {
+            if( timer_.scheduled() )
+            {
+                context_->wheel->cancel( timer_ );
+            }
             if( con_.second != NULL )
             {
                 redisAsyncDisconnect( con_.second );
             }
+            if( type_ == SDS )
+            {
+                sdsfree( (sds)cmd_ );
+            }
+            else
+            {
+                free( cmd_ );
+            }
+        }
+        
+        // commands are created and deleted for every request, so they are taken
+        // from the thread local pool of the event loop thread
+        static void* operator new( size_t size )
+        {
+            return SlabPool::allocate( size );
+        }
+        
+        static void operator delete( void *p, size_t size )
+        {
+            SlabPool::deallocate( p, size );
         }
         
         static void clusterDestructCB(void *data) {
             ConnectContext *context = static_cast<ConnectContext*>(data);
-            delete context;
+            // commands waiting for room are finished with error
+            if( context->limiter != nullptr )
+                context->limiter->cancel();
+            context->pcluster = nullptr;
+            releaseContext( context );
+        }
+        
+        // connect context is shared by cluster and all its connections, so it's
+        // deleted when cluster is destroyed and the last connection is freed
+        static void releaseContext( ConnectContext *context ) {
+            if( context->pcluster == nullptr && context->lifetime <= 0 )
+            {
+                if( context->batcher != nullptr )
+                    context->batcher->destroy();
+                delete context->reconnection;
+                context->wheel->destroy();
+                delete context;
+            }
         }
         
         static void disconnect(Connection *ac) {
-            redisAsyncDisconnect( ac );
+            ConnectContext *context = static_cast<ConnectContext*>( ac->data );
+            DownNode *node = findDownNode( context, ac );
+            if( node != nullptr )
+                closeDownNode( node );
+            else
+                redisAsyncDisconnect( ac );
         }
         
-        inline int process()
+        // deletes command if it can't be sent. Command is never completed inside send, it's
+        // either sent, queued or thrown
+        static AsyncHiredisCommand<Cluster>& send( AsyncHiredisCommand<Cluster> *c,
+                                                   const struct timeval *timeout = nullptr )
         {
-            typename Cluster::SlotConnection con = cluster_p_->getConnection( key_ );
-            return processHiredisCommand( con.second );
+            int result = REDIS_ERR;
+            try
+            {
+                result = c->process( timeout );
+            }
+            catch( ... )
+            {
+                delete c;
+                throw;
+            }
+            if( result != REDIS_OK )
+            {
+                delete c;
+                throw DisconnectedException();
+            }
+            return *c;
+        }
+        
+        // slot connection is held (counted as pending by pooling containers) until the first reply,
+        // command over the in flight limit is queued and sent later from resumeQueued
+        // command for lost node waits for reconnection. The deadline is set before the command
+        // is sent or queued, so if the timer can't be armed the command isn't sent at all
+        inline int process( const struct timeval *timeout = nullptr )
+        {
+            InFlightLimiter *limiter = nullptr;
+            DownNode *node = nullptr;
+            Admission admission = admit( limiter, node );
+            if( timeout != nullptr && ( timeout->tv_sec != 0 || timeout->tv_usec != 0 ) )
+            {
+                try
+                {
+                    setTimeout( *timeout );
+                }
+                catch( ... )
+                {
+                    releaseSlotConnection();
+                    throw;
+                }
+            }
+            switch( admission )
+            {
+                case NO_ROOM:
+                    enqueue( limiter );
+                    return REDIS_OK;
+                case NODE_DOWN:
+                    waitForNode( node, this );
+                    return REDIS_OK;
+                default:
+                    return sendAdmitted();
+            }
+        }
+        
+        enum Admission
+        {
+            ADMITTED,
+            NO_ROOM,
+            NODE_DOWN
+        };
+        
+        // takes slot connection and a place within in flight limits
+        inline Admission admit( InFlightLimiter *&limiter, DownNode *&node )
+        {
+            slotCon_ = cluster_p_->getConnection( slot_ );
+            ConnectContext *context = static_cast<ConnectContext*>( slotCon_.second->data );
+            context_ = context;
+            // only placeholders of lost connections are kept in container with error
+            if( slotCon_.second->err != 0 && ( node = findDownNode( context, slotCon_.second ) ) != nullptr )
+            {
+                cluster_p_->releaseConnection( slotCon_ );
+                slotCon_.second = NULL;
+                return NODE_DOWN;
+            }
+            limiter = context->limiter;
+            if( limiter != nullptr )
+            {
+                limitedHost_ = cluster_p_->hosts( slot_ ).front();
+                if( !limiter->acquire( limitedHost_ ) )
+                {
+                    cluster_p_->releaseConnection( slotCon_ );
+                    slotCon_.second = NULL;
+                    return NO_ROOM;
+                }
+                limiter_ = limiter;
+            }
+            return ADMITTED;
+        }
+        
+        // waits for room of the node admit() found full
+        inline void enqueue( InFlightLimiter *limiter )
+        {
+            if( !limiter->enqueue( limitedHost_, this, resumeQueued, ticket_ ) )
+                throw OverloadedException();
+            queued_ = true;
+        }
+        
+        inline int sendAdmitted()
+        {
+            int result = processHiredisCommand( slotCon_.second );
+            if( result != REDIS_OK )
+                releaseSlotConnection();
+            return result;
+        }
+        
+        inline void releaseSlotConnection()
+        {
+            if( slotCon_.second != NULL )
+            {
+                if( limiter_ != nullptr )
+                {
+                    InFlightLimiter *limiter = limiter_;
+                    limiter_ = nullptr;
+                    limiter->release( limitedHost_ );
+                }
+                cluster_p_->releaseConnection( slotCon_ );
+                slotCon_.second = NULL;
+            }
+        }
+        
+        // timed out command is taken out of the queue, so it's never resumed
+        static void resumeQueued( void *data, bool cancel )
+        {
+            AsyncHiredisCommand<Cluster>* that = static_cast<AsyncHiredisCommand<Cluster>*>( data );
+            that->queued_ = false;
+            if( cancel )
+            {
+                that->fail( DisconnectedException() );
+                return;
+            }
+            try
+            {
+                InFlightLimiter *limiter = nullptr;
+                DownNode *node = nullptr;
+                switch( that->admit( limiter, node ) )
+                {
+                    case NO_ROOM:
+                        that->enqueue( limiter );
+                        break;
+                    case NODE_DOWN:
+                        waitForNode( node, that );
+                        break;
+                    default:
+                        if( that->sendAdmitted() != REDIS_OK )
+                            throw DisconnectedException();
+                }
+            }
+            catch( const ClusterException &ce )
+            {
+                that->fail( ce );
+            }
         }
         
         inline int processHiredisCommand( Connection* con )
         {
             return redisAsyncFormattedCommand( con, processCommandReply,
-                static_cast<void*>( this ), cmd_.data(), cmd_.size() );
+                static_cast<void*>( this ), cmd_, len_ );
         }
         
         static void runRedisCallback( Connection* con, void *r, void *data )
@@ -240,6 +674,18 @@ namespace RedisCluster
             redisReply *reply = static_cast<redisReply*>(r);
             AsyncHiredisCommand<Cluster>* that = static_cast<AsyncHiredisCommand<Cluster>*>( data );
             Action commandState = ASK;
+            
+            if( reply == NULL )
+            {
+                that->connectionLost( con, HiredisProcess::ASK );
+                return;
+            }
+            
+            if( that->timedOut_ )
+            {
+                delete that;
+                return;
+            }
 
             try
             {
@@ -288,6 +734,20 @@ namespace RedisCluster
             HiredisProcess::processState state = HiredisProcess::FAILED;
             string host, port;
             
+            if( reply == NULL )
+            {
+                that->connectionLost( con, state );
+                return;
+            }
+            
+            that->releaseSlotConnection();
+            
+            if( that->timedOut_ )
+            {
+                delete that;
+                return;
+            }
+            
             try {
                 HiredisProcess::checkCritical( reply, false, false );
                 state = HiredisProcess::processResult( reply, host, port);
@@ -301,7 +761,7 @@ namespace RedisCluster
                             throw AskingFailedException(nullptr);
                         break;
                     case HiredisProcess::MOVED:
-                        that->cluster_p_->moved();
+                        that->cluster_p_->moved( HiredisProcess::parseslot( reply ) );
                         if( that->con_.second == NULL )
                             that->con_ = that->cluster_p_->createNewConnection( host, port );
                         if( that->processHiredisCommand( that->con_.second ) == REDIS_OK )
@@ -344,8 +804,8 @@ namespace RedisCluster
             
             if( that->processHiredisCommand( con ) != REDIS_OK )
             {
-                // XXX check NULL
-                that->userErrorCb_( *that, DisconnectedException(), HiredisProcess::FAILED );
+                if( that->userErrorCb_ != NULL )
+                    that->userErrorCb_( *that, DisconnectedException(), HiredisProcess::FAILED );
                 assert(r);
                 redisReply *reply = static_cast< redisReply* >(r);
                 that->runRedisCallback( *reply );
@@ -353,10 +813,32 @@ namespace RedisCluster
             }
         }
         
-        static void disconnectCb(const struct redisAsyncContext*ctx, int /*status*/) {
+        static void disconnectCb(const struct redisAsyncContext*ctx, int status) {
             ConnectContext *context = static_cast<ConnectContext*>(ctx->data);
             context->lifetime--;
-            context->pcluster->deleteConnection(ctx);
+            if( context->pcluster != nullptr )
+            {
+                // connection lost not by user request is replaced by placeholder till reconnection
+                if( status != REDIS_OK && context->reconnection != nullptr &&
+                    ctx->c.connection_type == REDIS_CONN_TCP && ctx->c.tcp.host != nullptr )
+                {
+                    DownNode *node = new DownNode( context, ctx->c.tcp.host, ctx->c.tcp.port );
+                    if( context->pcluster->replaceConnection( ctx, &node->placeholder ) )
+                    {
+                        context->reconnection->nodes.push_back( node );
+                        context->lifetime++;
+                    }
+                    else
+                    {
+                        delete node;
+                    }
+                }
+                context->pcluster->deleteConnection(ctx);
+            }
+            else
+            {
+                releaseContext( context );
+            }
         }
         
         static Connection* connect( const char* host, int port, void *data )
@@ -369,6 +851,13 @@ namespace RedisCluster
             if( con == NULL || con->err != 0 ||
                 context->adapter->attachContext( *con ) != REDIS_OK )
                 throw ConnectionFailedException(nullptr);
+            
+            if( context->batcher != nullptr )
+                context->batcher->attach( *con );
+            if( context->replyArena )
+                ReplyArena::install( con->c );
+            if( context->resp3 )
+                hello( con, context );
 
             context->lifetime++;
             con->data = static_cast<void*>(context);
@@ -377,6 +866,317 @@ namespace RedisCluster
         }
 
     private:
+        // HELLO is the first command of the connection, so all the replies after it are RESP3
+        static void hello( Connection *con, ConnectContext *context )
+        {
+#if defined(HIREDIS_MAJOR) && HIREDIS_MAJOR >= 1
+            if( context->pushCb != nullptr )
+                redisAsyncSetPushCallback( con, pushCb );
+            if( redisAsyncCommand( con, helloCb, nullptr, "HELLO 3" ) != REDIS_OK )
+                throw ConnectionFailedException(nullptr);
+#else
+            (void)con;
+            (void)context;
+            throw LogicError(nullptr, "RESP3 requires hiredis 1.0 or newer");
+#endif
+        }
+        
+        static void helloCb( Connection *con, void *r, void * )
+        {
+            redisReply *reply = static_cast<redisReply*>( r );
+            // node doesn't support RESP3, commands queued behind HELLO fail with disconnection
+            if( reply != nullptr && reply->type == REDIS_REPLY_ERROR )
+                redisAsyncDisconnect( con );
+        }
+        
+#if defined(HIREDIS_MAJOR) && HIREDIS_MAJOR >= 1
+        static void pushCb( Connection *con, void *r )
+        {
+            ConnectContext *context = static_cast<ConnectContext*>( con->data );
+            redisReply *reply = static_cast<redisReply*>( r );
+            if( context != nullptr && context->pcluster != nullptr && reply != nullptr )
+                context->pushCb( context->pcluster, *reply );
+        }
+#endif
+        
+        // lost node connection being reconnected, placeholder context stands in container
+        // instead of lost connection, so commands for the node find it and wait
+        struct DownNode
+        {
+            DownNode( ConnectContext *context, const char *host, int port ) :
+            placeholder(),
+            context( context ),
+            host( host ),
+            port( port ),
+            connecting( nullptr ),
+            waiting(),
+            delay( context->reconnection->delay ),
+            timerArmed( false ),
+            closed( false )
+            {
+                memset( &placeholder, 0, sizeof(placeholder) );
+                placeholder.err = REDIS_ERR_EOF;
+                placeholder.c.err = REDIS_ERR_EOF;
+                strcpy( placeholder.c.errstr, "node connection is lost" );
+                placeholder.errstr = placeholder.c.errstr;
+                placeholder.data = context;
+            }
+            
+            DownNode(const DownNode&) = delete;
+            DownNode& operator=(const DownNode&) = delete;
+            
+            Connection placeholder;
+            ConnectContext *context;
+            string host;
+            int port;
+            // connection being established
+            Connection *connecting;
+            WaitList waiting;
+            // next backoff delay
+            struct timeval delay;
+            bool timerArmed;
+            // node is removed from cluster, it's deleted when the timer fires
+            bool closed;
+        };
+        
+        struct Reconnection
+        {
+            Reconnection( const Options &options ) :
+            queue( options.reconnectQueue ),
+            delay( options.reconnectDelay ),
+            maxDelay( options.reconnectMaxDelay ),
+            nodes()
+            {
+            }
+            
+            size_t queue;
+            struct timeval delay;
+            struct timeval maxDelay;
+            std::vector<DownNode*> nodes;
+        };
+        
+        static DownNode* findDownNode( ConnectContext *context, const Connection *con )
+        {
+            if( context->reconnection != nullptr )
+            {
+                for( DownNode *node : context->reconnection->nodes )
+                {
+                    if( &node->placeholder == con || node->connecting == con )
+                        return node;
+                }
+            }
+            return nullptr;
+        }
+        
+        // reconnection is started before the command is queued, so if the node is given up
+        // right away, the command isn't failed (and deleted) under the caller, it's thrown
+        static void waitForNode( DownNode *node, AsyncHiredisCommand<Cluster> *command )
+        {
+            if( node->waiting.size() >= node->context->reconnection->queue )
+                throw DisconnectedException();
+            if( node->connecting == nullptr && !node->timerArmed && !reconnectNode( node ) )
+                throw DisconnectedException();
+            node->waiting.push_back( command );
+            command->downNode_ = node;
+            command->nodeWaiting_ = --node->waiting.end();
+        }
+        
+        // takes all commands waiting for the node
+        static void takeWaiting( DownNode *node, WaitList &waiting )
+        {
+            waiting.swap( node->waiting );
+            for( AsyncHiredisCommand<Cluster> *command : waiting )
+                command->downNode_ = nullptr;
+        }
+        
+        // returns false if the node is given up
+        static bool reconnectNode( DownNode *node )
+        {
+            try
+            {
+                node->connecting = connect( node->host.c_str(), node->port, node->context );
+                redisAsyncSetConnectCallback( node->connecting, connectCb );
+            }
+            catch( const ClusterException & )
+            {
+                node->connecting = nullptr;
+                return reconnectFailed( node );
+            }
+            return true;
+        }
+        
+        static void connectCb( const struct redisAsyncContext *ac, int status )
+        {
+            ConnectContext *context = static_cast<ConnectContext*>( ac->data );
+            DownNode *node = findDownNode( context, ac );
+            if( node == nullptr || node->connecting != ac )
+                return;
+            node->connecting = nullptr;
+            if( status != REDIS_OK )
+            {
+                // hiredis frees context that failed to connect without disconnect callback
+                context->lifetime--;
+                reconnectFailed( node );
+                return;
+            }
+            
+            Connection *con = const_cast<Connection*>( ac );
+            context->pcluster->replaceConnection( &node->placeholder, con );
+            removeDownNode( node );
+            WaitList waiting;
+            takeWaiting( node, waiting );
+            deleteDownNode( node );
+            for( AsyncHiredisCommand<Cluster> *command : waiting )
+                resend( command );
+        }
+        
+        // timed out command is taken out of the node queue, so it's never resent
+        static void resend( AsyncHiredisCommand<Cluster> *command )
+        {
+            try
+            {
+                if( command->process() != REDIS_OK )
+                    throw DisconnectedException();
+            }
+            catch( const ClusterException &ce )
+            {
+                command->fail( ce );
+            }
+        }
+        
+        // waiting commands are failed when backoff is exhausted, returns false then
+        static bool reconnectFailed( DownNode *node )
+        {
+            const struct timeval &maxDelay = node->context->reconnection->maxDelay;
+            bool exhausted = !timercmp( &node->delay, &maxDelay, < );
+            struct timeval delay = node->delay;
+            timeradd( &node->delay, &node->delay, &node->delay );
+            if( timercmp( &node->delay, &maxDelay, > ) )
+                node->delay = maxDelay;
+            
+            if( node->context->adapter->runAfter( delay, onReconnectTimer, node ) == REDIS_OK )
+                node->timerArmed = true;
+            else
+                exhausted = true;
+            if( exhausted )
+                failWaiting( node );
+            return !exhausted;
+        }
+        
+        static void onReconnectTimer( void *data )
+        {
+            DownNode *node = static_cast<DownNode*>( data );
+            node->timerArmed = false;
+            if( node->closed )
+                deleteDownNode( node );
+            else if( !node->waiting.empty() )
+                reconnectNode( node );
+        }
+        
+        static void failWaiting( DownNode *node )
+        {
+            WaitList waiting;
+            takeWaiting( node, waiting );
+            for( AsyncHiredisCommand<Cluster> *command : waiting )
+                command->fail( DisconnectedException() );
+        }
+        
+        // called when container frees the placeholder
+        static void closeDownNode( DownNode *node )
+        {
+            removeDownNode( node );
+            node->closed = true;
+            if( node->connecting != nullptr )
+            {
+                // not connected context is freed without callbacks
+                Connection *con = node->connecting;
+                node->connecting = nullptr;
+                redisAsyncFree( con );
+                node->context->lifetime--;
+            }
+            failWaiting( node );
+            if( !node->timerArmed )
+                deleteDownNode( node );
+        }
+        
+        static void removeDownNode( DownNode *node )
+        {
+            std::vector<DownNode*> &nodes = node->context->reconnection->nodes;
+            nodes.erase( std::remove( nodes.begin(), nodes.end(), node ), nodes.end() );
+        }
+        
+        static void deleteDownNode( DownNode *node )
+        {
+            ConnectContext *context = node->context;
+            delete node;
+            context->lifetime--;
+            releaseContext( context );
+        }
+        
+        // hiredis passes NULL reply to all pending callbacks when connection is freed,
+        // command can't be retried here, so user callback gets an error reply
+        void connectionLost( Connection *con, HiredisProcess::processState state )
+        {
+            static const redisReply lostReply = makeErrorReply( "ERR connection to cluster node is lost" );
+            
+            // lost connection is removed from container, so it's not released, waiting commands
+            // are resumed later as cluster may be in the middle of destruction now
+            if( limiter_ != nullptr )
+            {
+                limiter_->release( limitedHost_, false );
+                static_cast<ConnectContext*>( con->data )->adapter->runLater( InFlightLimiter::drainLater, limiter_ );
+                limiter_ = nullptr;
+            }
+            slotCon_.second = NULL;
+            
+            if( !timedOut_ )
+            {
+                if( userErrorCb_ != NULL )
+                    userErrorCb_( *this, DisconnectedException(), state );
+                runRedisCallback( lostReply );
+            }
+            if( !( con->c.flags & ( REDIS_SUBSCRIBED ) ) )
+                delete this;
+        }
+        
+        // command that was never sent is finished with error reply
+        void fail( const ClusterException &ce )
+        {
+            releaseSlotConnection();
+            if( !timedOut_ )
+            {
+                if( userErrorCb_ != NULL )
+                    userErrorCb_( *this, ce, HiredisProcess::FAILED );
+                runRedisCallback( makeErrorReply( ce.what() ) );
+            }
+            delete this;
+        }
+        
+        // sent command stays alive till hiredis returns its reply, command waiting for room
+        // or for reconnection is taken out of its queue and deleted
+        static void onTimeout( void *data )
+        {
+            static const redisReply timeoutReply = makeErrorReply( "ERR command timed out" );
+            AsyncHiredisCommand<Cluster>* that = static_cast<AsyncHiredisCommand<Cluster>*>( data );
+            bool unsent = that->queued_ || that->downNode_ != nullptr;
+            if( that->queued_ )
+            {
+                that->context_->limiter->remove( that->ticket_ );
+                that->queued_ = false;
+            }
+            if( that->downNode_ != nullptr )
+            {
+                that->downNode_->waiting.erase( that->nodeWaiting_ );
+                that->downNode_ = nullptr;
+            }
+            that->timedOut_ = true;
+            if( that->userErrorCb_ != NULL )
+                that->userErrorCb_( *that, TimeoutException(), HiredisProcess::FAILED );
+            that->runRedisCallback( timeoutReply );
+            if( unsent )
+                delete that;
+        }
+        
         void runRedisCallback( const redisReply& reply ) const
         {
             if (redisCallback_)
@@ -394,10 +1194,29 @@ namespace RedisCluster
         
         // pointer to async context ( in case of redirection class creates new connection )
         typename Cluster::HostConnection con_;
+        // initial connection of the slot, held until the first reply
+        typename Cluster::SlotConnection slotCon_;
+        // in flight limiter holding a place for the command
+        InFlightLimiter *limiter_;
+        // node the place is held or waited for, "host:port"
+        string limitedHost_;
+        // place in the limiter queue while queued_ is set
+        InFlightLimiter::Ticket ticket_;
+        bool queued_;
+        // lost node the command waits for and its place in the node queue
+        DownNode *downNode_;
+        typename WaitList::iterator nodeWaiting_;
+        // context of the cluster, set when command is sent
+        ConnectContext *context_;
+        TimerWheel::Timer timer_;
+        bool timedOut_;
 
-        // key of redis command to find proper cluster node
-        string key_;
-        string cmd_;
+        // slot of the key of redis command to find proper cluster node
+        typename Cluster::SlotIndex slot_;
+        // hiredis formatted command
+        char *cmd_;
+        int len_;
+        CommandType type_;
     };
 }
 
@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2015, Dmitrii Shinkevich <shinmail at gmail dot com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __libredisCluster__bulkloader__
+#define __libredisCluster__bulkloader__
+
+#include <cerrno>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "cluster.h"
+#include "hiredisprocess.h"
+
+extern "C"
+{
+#include <hiredis/hiredis.h>
+}
+
+namespace RedisCluster
+{
+    using std::string;
+    
+    // Bulk loader streaming commands to every node of the cluster like "redis-cli --pipe", but
+    // cluster aware. Commands are routed by key slot to the node serving it, encoded into a large
+    // per node buffer and written without waiting for replies; each node connection keeps up to
+    // Options::window commands unacknowledged, replies are read while writing. So loading speed
+    // is limited by network bandwidth instead of round trip time.
+    //
+    //     BulkLoader<> loader( cluster_p );
+    //     loader.Command( "FOO", "SET %s %s", "FOO", "BAR" );
+    //     ...
+    //     for( const BulkLoader<>::NodeReport &node : loader.finish() )
+    //         cout << node.host << " " << node.rate() << " commands/s, errors: " << node.errors << endl;
+    //
+    // Loader opens its own connections to the nodes found in cluster (see Cluster::hosts), cluster
+    // connections are not used. Redirections are not followed, they are counted as errors like
+    // the other error replies, so the topology must not change while loading. Loader is not
+    // thread safe, several loaders can run in parallel.
+    template < typename Cluster = Cluster<redisContext> >
+    class BulkLoader
+    {
+        typedef std::chrono::steady_clock Clock;
+        
+        BulkLoader(const BulkLoader&) = delete;
+        BulkLoader& operator=(const BulkLoader&) = delete;
+        
+    public:
+        
+        struct Options
+        {
+            Options() :
+            window( 10000 ),
+            bufferSize( 1 << 20 ),
+            timeout{ 3, 0 }
+            {}
+            
+            // commands sent to a node and not acknowledged yet
+            size_t window;
+            // encoded commands are written to node when its buffer grows over this size
+            size_t bufferSize;
+            // connect timeout
+            struct timeval timeout;
+        };
+        
+        struct NodeReport
+        {
+            NodeReport() : host(), commands( 0 ), errors( 0 ), bytes( 0 ), seconds( 0. ), firstError() {}
+            
+            string host;
+            uint64_t commands;
+            uint64_t errors;
+            uint64_t bytes;
+            double seconds;
+            // text of the first error reply
+            string firstError;
+            
+            double rate() const
+            {
+                return seconds > 0. ? double( commands ) / seconds : 0.;
+            }
+        };
+        
+        BulkLoader( typename Cluster::ptr_t cluster_p, const Options &options = Options() ) :
+        cluster_p_( cluster_p ),
+        options_( options ),
+        nodes_(),
+        pollfds_()
+        {
+            if( cluster_p == nullptr || options.window == 0 )
+                throw InvalidArgument(nullptr);
+        }
+        
+        ~BulkLoader()
+        {
+            for( typename std::map<string, Node*>::value_type &node : nodes_ )
+            {
+                redisFree( node.second->con );
+                delete node.second;
+            }
+        }
+        
+        void Command( const string &key, int argc, const char ** argv, const size_t *argvlen )
+        {
+            char *cmd = nullptr;
+            long long len = redisFormatCommandArgv( &cmd, argc, argv, argvlen );
+            if( len < 0 )
+                throw InvalidArgument(nullptr);
+            append( key, cmd, static_cast<size_t>( len ) );
+            free( cmd );
+        }
+        
+        void Command( const string &key, const char *format, ... )
+        {
+            va_list ap;
+            va_start( ap, format );
+            char *cmd = nullptr;
+            int len = redisvFormatCommand( &cmd, format, ap );
+            va_end( ap );
+            if( len < 0 )
+                throw InvalidArgument(nullptr);
+            append( key, cmd, static_cast<size_t>( len ) );
+            free( cmd );
+        }
+        
+        // command already encoded in redis protocol
+        void FormattedCommand( const string &key, const char *cmd, size_t len )
+        {
+            append( key, cmd, len );
+        }
+        
+        // writes everything left and waits for all replies
+        std::vector<NodeReport> finish()
+        {
+            for( typename std::map<string, Node*>::value_type &node : nodes_ )
+                node.second->flushing = true;
+            while( pump( true ) )
+            {
+            }
+            
+            std::vector<NodeReport> reports;
+            for( typename std::map<string, Node*>::value_type &node : nodes_ )
+            {
+                node.second->report.seconds = std::chrono::duration<double>( node.second->last - node.second->start ).count();
+                reports.push_back( node.second->report );
+            }
+            return reports;
+        }
+        
+    private:
+        
+        struct Node
+        {
+            Node( redisContext *con, const string &host ) :
+            con( con ),
+            out(),
+            written( 0 ),
+            pending( 0 ),
+            flushing( false ),
+            start( Clock::now() ),
+            last( start ),
+            report()
+            {
+                report.host = host;
+            }
+            
+            Node(const Node&) = delete;
+            Node& operator=(const Node&) = delete;
+            
+            redisContext *con;
+            // encoded commands, bytes before written are sent already
+            string out;
+            size_t written;
+            // commands not acknowledged yet
+            size_t pending;
+            // buffer is written even if it's small
+            bool flushing;
+            Clock::time_point start;
+            Clock::time_point last;
+            NodeReport report;
+        };
+        
+        Node& node( const string &key )
+        {
+            const string &host = cluster_p_->hosts( SlotHash::SlotByKey( key.data(), key.size() ) ).front();
+            typename std::map<string, Node*>::iterator found = nodes_.find( host );
+            if( found != nodes_.end() )
+                return *found->second;
+            
+            string::size_type colon = host.rfind( ':' );
+            redisContext *con = redisConnectWithTimeout( host.substr( 0, colon ).c_str(),
+                                                        std::stoi( host.substr( colon + 1 ) ), options_.timeout );
+            if( con == NULL || con->err != 0 )
+            {
+                if( con != NULL )
+                    redisFree( con );
+                throw ConnectionFailedException(nullptr);
+            }
+            // replies are read as they come, hiredis handles EAGAIN of non blocking socket
+            con->flags &= ~REDIS_BLOCK;
+            fcntl( con->fd, F_SETFL, fcntl( con->fd, F_GETFL ) | O_NONBLOCK );
+#if !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+            int on = 1;
+            setsockopt( con->fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof( on ) );
+#endif
+            
+            Node *node = new Node( con, host );
+            nodes_[host] = node;
+            return *node;
+        }
+        
+        void append( const string &key, const char *cmd, size_t len )
+        {
+            Node &target = node( key );
+            // node with full window must acknowledge something before it gets more
+            while( target.pending >= options_.window && target.con->err == 0 )
+                pump( false );
+            if( target.con->err != 0 )
+            {
+                ++target.report.commands;
+                ++target.report.errors;
+                return;
+            }
+            
+            target.out.append( cmd, len );
+            ++target.pending;
+            ++target.report.commands;
+            target.report.bytes += len;
+            
+            if( target.out.size() - target.written >= options_.bufferSize )
+                pump( false );
+        }
+        
+        // one round of waiting for sockets, returns false when nothing is left to do
+        bool pump( bool finishing )
+        {
+            pollfds_.clear();
+            std::vector<Node*> polled;
+            for( typename std::map<string, Node*>::value_type &entry : nodes_ )
+            {
+                Node &n = *entry.second;
+                if( n.con->err != 0 )
+                    continue;
+                bool writable = n.written < n.out.size() &&
+                    ( finishing || n.flushing || n.out.size() - n.written >= options_.bufferSize ||
+                      n.pending >= options_.window );
+                if( !writable && n.pending == 0 )
+                    continue;
+                struct pollfd fd = { n.con->fd, static_cast<short>( POLLIN | ( writable ? POLLOUT : 0 ) ), 0 };
+                pollfds_.push_back( fd );
+                polled.push_back( &n );
+            }
+            if( pollfds_.empty() )
+                return false;
+            
+            if( poll( pollfds_.data(), pollfds_.size(), -1 ) < 0 && errno != EINTR )
+                throw LogicError(nullptr, "poll failed");
+            
+            for( size_t i = 0; i < pollfds_.size(); ++i )
+            {
+                Node &n = *polled[i];
+                if( pollfds_[i].revents & POLLOUT )
+                    write( n );
+                if( pollfds_[i].revents & ( POLLIN | POLLERR | POLLHUP ) )
+                    read( n );
+            }
+            return true;
+        }
+        
+        // node which closed the connection fails with EPIPE instead of SIGPIPE killing the process
+        void write( Node &n )
+        {
+#ifdef MSG_NOSIGNAL
+            ssize_t done = ::send( n.con->fd, n.out.data() + n.written, n.out.size() - n.written, MSG_NOSIGNAL );
+#else
+            ssize_t done = ::send( n.con->fd, n.out.data() + n.written, n.out.size() - n.written, 0 );
+#endif
+            if( done < 0 )
+            {
+                if( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+                    fail( n, strerror( errno ) );
+                return;
+            }
+            n.written += done;
+            if( n.written == n.out.size() )
+            {
+                n.out.clear();
+                n.written = 0;
+            }
+        }
+        
+        void read( Node &n )
+        {
+            if( redisBufferRead( n.con ) != REDIS_OK )
+            {
+                fail( n, n.con->errstr );
+                return;
+            }
+            void *r = nullptr;
+            while( n.pending > 0 )
+            {
+                // protocol error leaves the stream out of sync, nothing more can be read
+                if( redisGetReplyFromReader( n.con, &r ) != REDIS_OK )
+                {
+                    fail( n, n.con->errstr );
+                    return;
+                }
+                if( r == nullptr )
+                    break;
+                redisReply *reply = static_cast<redisReply*>( r );
+                if( reply->type == REDIS_REPLY_ERROR )
+                {
+                    if( n.report.errors++ == 0 )
+                        n.report.firstError.assign( reply->str, reply->len );
+                }
+                freeReplyObject( reply );
+                --n.pending;
+                n.last = Clock::now();
+            }
+        }
+        
+        // commands not acknowledged by lost node are counted as errors
+        void fail( Node &n, const char *error )
+        {
+            if( n.report.errors == 0 )
+                n.report.firstError = error;
+            n.report.errors += n.pending;
+            n.pending = 0;
+            n.out.clear();
+            n.written = 0;
+            if( n.con->err == 0 )
+                n.con->err = REDIS_ERR_IO;
+        }
+        
+        typename Cluster::ptr_t cluster_p_;
+        Options options_;
+        std::map<string, Node*> nodes_;
+        std::vector<struct pollfd> pollfds_;
+    };
+}
+
+#endif /* defined(__libredisCluster__bulkloader__) */
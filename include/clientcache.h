@@ -0,0 +1,565 @@
+/*
+ * Copyright (c) 2015, Dmitrii Shinkevich <shinmail at gmail dot com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __libredisCluster__clientcache__
+#define __libredisCluster__clientcache__
+
+#include <atomic>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <sys/socket.h>
+
+#include "hirediscommand.h"
+
+extern "C"
+{
+#include <hiredis/hiredis.h>
+}
+
+namespace RedisCluster
+{
+    using std::string;
+    
+    // Bounded local cache of read replies in front of synchronous cluster, kept correct by
+    // server assisted invalidation (CLIENT TRACKING, redis 6+). Every node gets one more
+    // connection subscribed to __redis__:invalidate and read by its own thread, all command
+    // connections opened by ClientCache::connect redirect their invalidations to it. So a key
+    // is dropped from cache as soon as somebody changes it, even if the connection which read
+    // it stays idle in the container. Entries of a slot are dropped when the slot moves,
+    // because the new owner of the slot doesn't know what we have read before.
+    //
+    //     ClientCache<> cache( 64 << 20 );
+    //     Cluster<redisContext>::ptr_t cluster_p = cache.createCluster( "127.0.0.1", 7000 );
+    //     Reply reply = cache.AltCommand( cluster_p, "FOO", "GET %s", "FOO" );
+    //     ...
+    //     delete cluster_p;   // cluster must be deleted before cache
+    //
+    // Only read commands of one key may be sent through the cache, the key argument must be
+    // the key the command reads, not just a key of the same hash tag. If invalidation
+    // connection of some node is lost, then invalidations can't be trusted anymore, the whole
+    // cache is cleared and commands are passed to cluster without caching (see enabled()).
+    // Cached replies are shared between callers and must not be modified.
+    template < typename Cluster = Cluster<redisContext> >
+    class ClientCache
+    {
+        typedef typename Cluster::SlotIndex SlotIndex;
+        
+        ClientCache(const ClientCache&) = delete;
+        ClientCache& operator=(const ClientCache&) = delete;
+        
+        struct Entry
+        {
+            string command;
+            string key;
+            SlotIndex slot;
+            Reply reply;
+            size_t bytes;
+        };
+        
+        typedef std::list<Entry> Entries;
+        typedef std::unordered_map<string, typename Entries::iterator> ByCommand;
+        typedef std::unordered_multimap<string, typename Entries::iterator> ByKey;
+        
+        // reads of a key which are on the way, reply can't be cached if the key is
+        // invalidated before it comes
+        struct Pending
+        {
+            unsigned int readers;
+            bool invalidated;
+        };
+        
+        struct Listener
+        {
+            redisContext *con;
+            long long id;
+            std::thread thread;
+            // false after the thread has lost the connection
+            bool alive;
+        };
+        
+    public:
+        
+        struct Stats
+        {
+            uint64_t hits;
+            uint64_t misses;
+            uint64_t invalidations;
+            uint64_t evictions;
+            size_t entries;
+            size_t bytes;
+            
+            double hitRate() const
+            {
+                return hits + misses == 0 ? 0. : double( hits ) / double( hits + misses );
+            }
+        };
+        
+        // cache keeps at most maxBytes of replies (with bookkeeping), maxEntries limits
+        // number of cached commands if it's not 0
+        ClientCache( size_t maxBytes, size_t maxEntries = 0 ) :
+        maxBytes_( maxBytes ),
+        maxEntries_( maxEntries ),
+        entries_(),
+        byCommand_(),
+        byKey_(),
+        pending_(),
+        listeners_(),
+        lock_(),
+        listenersLock_(),
+        stats_(),
+        enabled_( true ),
+        running_( true )
+        {
+        }
+        
+        ~ClientCache()
+        {
+            std::map<string, Listener*> listeners;
+            {
+                std::lock_guard<std::mutex> locker( listenersLock_ );
+                running_ = false;
+                listeners.swap( listeners_ );
+            }
+            // blocked reads of listener threads are interrupted by shutting sockets down
+            for( typename std::map<string, Listener*>::value_type &listener : listeners )
+                shutdown( listener.second->con->fd, SHUT_RDWR );
+            for( typename std::map<string, Listener*>::value_type &listener : listeners )
+            {
+                listener.second->thread.join();
+                redisFree( listener.second->con );
+                delete listener.second;
+            }
+        }
+        
+        // cluster which connections are tracked by this cache
+        typename Cluster::ptr_t createCluster( const char* host, int port )
+        {
+            typename Cluster::ptr_t cluster_p = HiredisCommand<Cluster>::createCluster( host, port, this, connect );
+            cluster_p->setSlotMovedCb( slotMoved );
+            return cluster_p;
+        }
+        
+        // connect function for HiredisCommand::createCluster, data must be the cache. It's
+        // used for redirection connections as well, so they are tracked too
+        static redisContext* connect( const char* host, int port, void *data )
+        {
+            ClientCache *cache = static_cast<ClientCache*>( data );
+            long long id = cache->listener( host, port );
+            
+            struct timeval timeout = { 3, 0 };
+            redisContext *con = redisConnectWithTimeout( host, port, timeout );
+            if( con == NULL || con->err != 0 )
+                return con;
+            
+            // cache doesn't track anything after it was disabled, commands pass it uncached
+            if( !cache->enabled_ )
+                return con;
+            
+            redisReply *reply = nullptr;
+            if( id >= 0 )
+                reply = static_cast<redisReply*>( redisCommand( con, "CLIENT TRACKING on REDIRECT %lld", id ) );
+            // connection which can't be tracked must not be used, cache would be stale
+            if( con->err == 0 && ( reply == NULL || reply->type == REDIS_REPLY_ERROR ) )
+            {
+                con->err = REDIS_ERR_OTHER;
+                snprintf( con->errstr, sizeof( con->errstr ), "%s",
+                          reply != NULL ? reply->str : "invalidation connection failed" );
+            }
+            freeReply( *con, reply );
+            return con;
+        }
+        
+        // slot moved callback, installed by createCluster
+        static void slotMoved( void *data, SlotIndex slot )
+        {
+            static_cast<ClientCache*>( data )->flushSlot( slot );
+        }
+        
+        // read command of the key, reply is taken from cache if the same command was
+        // sent before and the key wasn't changed since then. Error replies aren't cached
+        Reply AltCommand( typename Cluster::ptr_t cluster_p,
+                          const string &key,
+                          int argc,
+                          const char ** argv,
+                          const size_t *argvlen )
+        {
+            char *cmd = nullptr;
+            int len = redisFormatCommandArgv( &cmd, argc, argv, argvlen );
+            if( len < 0 )
+                throw InvalidArgument(nullptr);
+            string command( cmd, len );
+            free( cmd );
+            
+            Reply reply;
+            if( lookup( command, reply ) )
+                return reply;
+            
+            begin( key );
+            try
+            {
+                reply = HiredisCommand<Cluster>::AltCommand( cluster_p, key, argc, argv, argvlen );
+            }
+            catch( ... )
+            {
+                end( key, command, Reply() );
+                throw;
+            }
+            end( key, command, reply );
+            return reply;
+        }
+        
+        Reply AltCommand( typename Cluster::ptr_t cluster_p,
+                          const string &key,
+                          const char *format, ...)
+        {
+            va_list ap;
+            va_start( ap, format );
+            try
+            {
+                Reply reply = AltCommand( cluster_p, key, format, ap );
+                va_end( ap );
+                return reply;
+            }
+            catch( ... )
+            {
+                va_end( ap );
+                throw;
+            }
+        }
+        
+        Reply AltCommand( typename Cluster::ptr_t cluster_p,
+                          const string &key,
+                          const char *format, va_list ap )
+        {
+            va_list copy;
+            va_copy( copy, ap );
+            char *cmd = nullptr;
+            int len = redisvFormatCommand( &cmd, format, copy );
+            va_end( copy );
+            if( len < 0 )
+                throw InvalidArgument(nullptr);
+            string command( cmd, len );
+            free( cmd );
+            
+            Reply reply;
+            if( lookup( command, reply ) )
+                return reply;
+            
+            begin( key );
+            try
+            {
+                reply = HiredisCommand<Cluster>::AltCommand( cluster_p, key, format, ap );
+            }
+            catch( ... )
+            {
+                end( key, command, Reply() );
+                throw;
+            }
+            end( key, command, reply );
+            return reply;
+        }
+        
+        // drops every cached reply of the key
+        void invalidate( const string &key )
+        {
+            std::lock_guard<std::mutex> locker( lock_ );
+            invalidateKey( key );
+        }
+        
+        // drops every cached reply of keys belonging to the slot
+        void flushSlot( SlotIndex slot )
+        {
+            std::lock_guard<std::mutex> locker( lock_ );
+            for( typename Entries::iterator it = entries_.begin(); it != entries_.end(); )
+            {
+                typename Entries::iterator next = std::next( it );
+                if( it->slot == slot )
+                    erase( it );
+                it = next;
+            }
+            for( typename std::unordered_map<string, Pending>::value_type &pending : pending_ )
+            {
+                if( SlotHash::SlotByKey( pending.first.c_str(), pending.first.length() ) == slot )
+                    pending.second.invalidated = true;
+            }
+        }
+        
+        void clear()
+        {
+            std::lock_guard<std::mutex> locker( lock_ );
+            clearAll();
+        }
+        
+        // false after invalidation connection of some node was lost
+        bool enabled() const
+        {
+            return enabled_;
+        }
+        
+        Stats stats() const
+        {
+            std::lock_guard<std::mutex> locker( lock_ );
+            Stats stats = stats_;
+            stats.entries = entries_.size();
+            return stats;
+        }
+        
+    private:
+        
+        // memory taken by cached reply and its bookkeeping
+        static size_t replySize( const redisReply &reply )
+        {
+            size_t size = sizeof( redisReply ) + ( reply.str != nullptr ? reply.len + 1 : 0 );
+            if( reply.element != nullptr )
+            {
+                size += reply.elements * sizeof( redisReply* );
+                for( size_t i = 0; i < reply.elements; ++i )
+                    size += replySize( *reply.element[i] );
+            }
+            return size;
+        }
+        
+        bool lookup( const string &command, Reply &reply )
+        {
+            std::lock_guard<std::mutex> locker( lock_ );
+            typename ByCommand::iterator found = byCommand_.find( command );
+            if( found == byCommand_.end() )
+            {
+                ++stats_.misses;
+                return false;
+            }
+            entries_.splice( entries_.begin(), entries_, found->second );
+            reply = found->second->reply;
+            ++stats_.hits;
+            return true;
+        }
+        
+        void begin( const string &key )
+        {
+            std::lock_guard<std::mutex> locker( lock_ );
+            Pending &pending = pending_[key];
+            ++pending.readers;
+        }
+        
+        // reply is cached if nothing has invalidated the key while it was on the way
+        void end( const string &key, const string &command, const Reply &reply )
+        {
+            std::lock_guard<std::mutex> locker( lock_ );
+            typename std::unordered_map<string, Pending>::iterator pending = pending_.find( key );
+            bool invalidated = pending->second.invalidated;
+            if( --pending->second.readers == 0 )
+                pending_.erase( pending );
+            
+            if( invalidated || !enabled_ || !reply || reply->type == REDIS_REPLY_ERROR )
+                return;
+            
+            typename ByCommand::iterator found = byCommand_.find( command );
+            if( found != byCommand_.end() )
+                erase( found->second );
+            
+            Entry entry = { command, key, SlotHash::SlotByKey( key.c_str(), key.length() ), reply,
+                replySize( *reply ) + 2 * command.length() + key.length() + sizeof( Entry ) };
+            if( entry.bytes > maxBytes_ )
+                return;
+            
+            entries_.push_front( entry );
+            byCommand_[command] = entries_.begin();
+            byKey_.insert( typename ByKey::value_type( key, entries_.begin() ) );
+            stats_.bytes += entry.bytes;
+            
+            while( stats_.bytes > maxBytes_ || ( maxEntries_ != 0 && entries_.size() > maxEntries_ ) )
+            {
+                erase( std::prev( entries_.end() ) );
+                ++stats_.evictions;
+            }
+        }
+        
+        void erase( typename Entries::iterator entry )
+        {
+            std::pair<typename ByKey::iterator, typename ByKey::iterator> range = byKey_.equal_range( entry->key );
+            for( typename ByKey::iterator it = range.first; it != range.second; ++it )
+            {
+                if( it->second == entry )
+                {
+                    byKey_.erase( it );
+                    break;
+                }
+            }
+            byCommand_.erase( entry->command );
+            stats_.bytes -= entry->bytes;
+            entries_.erase( entry );
+        }
+        
+        void invalidateKey( const string &key )
+        {
+            ++stats_.invalidations;
+            typename std::unordered_map<string, Pending>::iterator pending = pending_.find( key );
+            if( pending != pending_.end() )
+                pending->second.invalidated = true;
+            
+            std::pair<typename ByKey::iterator, typename ByKey::iterator> range = byKey_.equal_range( key );
+            while( range.first != range.second )
+            {
+                typename Entries::iterator entry = range.first->second;
+                ++range.first;
+                erase( entry );
+            }
+        }
+        
+        void clearAll()
+        {
+            entries_.clear();
+            byCommand_.clear();
+            byKey_.clear();
+            stats_.bytes = 0;
+            for( typename std::unordered_map<string, Pending>::value_type &pending : pending_ )
+                pending.second.invalidated = true;
+        }
+        
+        // id of the invalidation connection of the node, it's created on first call.
+        // Returns -1 if it can't be created or the cache is disabled
+        long long listener( const char* host, int port )
+        {
+            string name( string( host ) + ":" + std::to_string( port ) );
+            std::lock_guard<std::mutex> locker( listenersLock_ );
+            typename std::map<string, Listener*>::iterator found = listeners_.find( name );
+            if( found != listeners_.end() )
+            {
+                if( found->second->alive )
+                    return found->second->id;
+                // nothing is redirected to the id of a lost connection, the thread
+                // has already left listen() and only releases the lock
+                found->second->thread.join();
+                redisFree( found->second->con );
+                delete found->second;
+                listeners_.erase( found );
+            }
+            if( !enabled_ )
+                return -1;
+            
+            struct timeval timeout = { 3, 0 };
+            redisContext *con = redisConnectWithTimeout( host, port, timeout );
+            if( con == NULL || con->err != 0 )
+            {
+                if( con != NULL )
+                    redisFree( con );
+                return -1;
+            }
+            
+            long long id = -1;
+            redisReply *reply = static_cast<redisReply*>( redisCommand( con, "CLIENT ID" ) );
+            if( reply != NULL && reply->type == REDIS_REPLY_INTEGER )
+                id = reply->integer;
+            freeReplyObject( reply );
+            
+            if( id >= 0 )
+            {
+                reply = static_cast<redisReply*>( redisCommand( con, "SUBSCRIBE __redis__:invalidate" ) );
+                if( reply == NULL || reply->type != REDIS_REPLY_ARRAY )
+                    id = -1;
+                freeReplyObject( reply );
+            }
+            if( id < 0 )
+            {
+                redisFree( con );
+                return -1;
+            }
+            
+            // messages may not come for hours, reads must wait for them without timeout
+            struct timeval forever = { 0, 0 };
+            redisSetTimeout( con, forever );
+            
+            Listener *l = new Listener{ con, id, std::thread(), true };
+            l->thread = std::thread( &ClientCache::listen, this, l );
+            listeners_[name] = l;
+            return id;
+        }
+        
+        // thread of invalidation connection, message is ["message", "__redis__:invalidate", keys],
+        // keys are nil when the node was flushed
+        void listen( Listener *l )
+        {
+            redisContext *con = l->con;
+            redisReply *reply = nullptr;
+            while( redisGetReply( con, (void**)&reply ) == REDIS_OK )
+            {
+                if( reply->type == REDIS_REPLY_ARRAY && reply->elements == 3 )
+                {
+                    const redisReply *keys = reply->element[2];
+                    std::lock_guard<std::mutex> locker( lock_ );
+                    if( keys->type == REDIS_REPLY_ARRAY )
+                    {
+                        for( size_t i = 0; i < keys->elements; ++i )
+                            invalidateKey( string( keys->element[i]->str, keys->element[i]->len ) );
+                    }
+                    else
+                    {
+                        ++stats_.invalidations;
+                        clearAll();
+                    }
+                }
+                freeReplyObject( reply );
+                reply = nullptr;
+            }
+            
+            std::lock_guard<std::mutex> listenersLocker( listenersLock_ );
+            l->alive = false;
+            if( running_ )
+            {
+                // connections tracked by this node redirect to nowhere from now on
+                std::lock_guard<std::mutex> locker( lock_ );
+                enabled_ = false;
+                clearAll();
+            }
+        }
+        
+        size_t maxBytes_;
+        size_t maxEntries_;
+        Entries entries_;
+        ByCommand byCommand_;
+        ByKey byKey_;
+        std::unordered_map<string, Pending> pending_;
+        std::map<string, Listener*> listeners_;
+        mutable std::mutex lock_;
+        std::mutex listenersLock_;
+        Stats stats_;
+        // written by listener threads, read by command threads without the lock
+        std::atomic<bool> enabled_;
+        bool running_;
+    };
+}
+
+#endif /* defined(__libredisCluster__clientcache__) */
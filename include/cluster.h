@@ -30,6 +30,7 @@
 #define __libredisCluster__cluster__
 
 #include <map>
+#include <vector>
 
 extern "C"
 {
@@ -62,12 +63,15 @@ namespace RedisCluster
         typedef std::pair<SlotIndex, SlotIndex> SlotRange;
         typedef std::pair<SlotRange, redisConnection*> SlotConnection;
         typedef std::pair<Host, redisConnection*> HostConnection;
+        // "host:port" of the node serving slot range followed by its replicas
+        typedef std::vector<Host> Hosts;
         
         // definition of user connect and disconnect callbacks that can be user defined
         typedef redisConnection* (*pt2RedisConnectFunc) ( const char*, int, void* );
         typedef void (*pt2RedisFreeFunc) ( redisConnection* );
         // definition of user error handling function that can be user defined
         typedef void (*MovedCb) (void*, Cluster<redisConnection, ConnectionContainer> &);
+        typedef void (*SlotMovedCb) (void*, SlotIndex);
         typedef void (*DestructCb) (void*);
         // definition of raw cluster pointer
         typedef Cluster* ptr_t;
@@ -89,8 +93,10 @@ namespace RedisCluster
         destructCallback_(destructdb),
         destructData(destructdata),
         userMovedFn_(NULL),
+        slotMovedFn_(NULL),
         readytouse_( false ),
-        moved_( false )
+        moved_( false ),
+        hosts_()
         {
             if( connect == NULL || disconnect == NULL )
                 throw InvalidArgument(reply);
@@ -100,9 +106,10 @@ namespace RedisCluster
         
         ~Cluster()
         {
+            // connections are freed first, so their callbacks can still use user data
+            delete connections_;
             if(destructCallback_)
                 destructCallback_(destructData);
-            delete connections_;
         }
         
         // disconnect function applicable when we want to close all async connections from callback
@@ -117,16 +124,105 @@ namespace RedisCluster
         }
         // function gets a connection from container by slot number
         SlotConnection getConnection ( std::string key )
+        {
+            return getConnection( SlotHash::SlotByKey( key.c_str(), key.length() ) );
+        }
+        
+        SlotConnection getConnection ( SlotIndex slot )
         {
             if( !readytouse_ )
             {
                 throw NotInitializedException();
             }
             
-            int slot = SlotHash::SlotByKey( key.c_str(), key.length() );
             return connections_->getConnection( slot );
         }
         
+        // scoped connection lease, it takes a connection from container once and releases it
+        // in destructor, so a burst of commands or a pipeline to one slot (i.e. to one hash tag)
+        // costs a single getConnection/releaseConnection pair and keeps the same connection
+        // for all commands, so connection state (MULTI, WATCH, SELECT...) stays valid
+        class Lease
+        {
+            Lease(const Lease&) = delete;
+            Lease& operator=(const Lease&) = delete;
+            
+        public:
+            Lease( Cluster &cluster, SlotIndex slot ) :
+            cluster_( &cluster ),
+            slot_( slot ),
+            con_( cluster.getConnection( slot ) )
+            {
+            }
+            
+            Lease( Lease &&other ) :
+            cluster_( other.cluster_ ),
+            slot_( other.slot_ ),
+            con_( other.con_ )
+            {
+                other.cluster_ = nullptr;
+            }
+            
+            ~Lease()
+            {
+                release();
+            }
+            
+            // give connection back to container before the end of scope
+            void release()
+            {
+                if( cluster_ != nullptr )
+                {
+                    cluster_->releaseConnection( con_ );
+                    cluster_ = nullptr;
+                }
+            }
+            
+            // connection is broken or its state is unknown (i.e. after timeout), container
+            // frees it instead of giving it to somebody else
+            void discard()
+            {
+                if( cluster_ != nullptr )
+                {
+                    cluster_->discardConnection( con_ );
+                    cluster_ = nullptr;
+                }
+            }
+            
+            inline redisConnection* connection() const
+            {
+                return con_.second;
+            }
+            
+            inline SlotIndex slot() const
+            {
+                return slot_;
+            }
+            
+            inline Cluster& cluster() const
+            {
+                if( cluster_ == nullptr )
+                    throw LogicError(nullptr, "connection lease is already released");
+                return *cluster_;
+            }
+            
+        private:
+            Cluster *cluster_;
+            SlotIndex slot_;
+            SlotConnection con_;
+        };
+        
+        // lease a connection for the slot of the key
+        Lease lease( const std::string &key )
+        {
+            return Lease( *this, SlotHash::SlotByKey( key.c_str(), key.length() ) );
+        }
+        
+        Lease lease( SlotIndex slot )
+        {
+            return Lease( *this, slot );
+        }
+        
         // moved method set cluster to moved state
         // if cluster is in moved state, then you need to reinitialise it once a time
         // cluster can be used some time in moved state, but with processing redis cluster
@@ -140,6 +236,15 @@ namespace RedisCluster
                 userMovedFn_( connections_->data_, *this );
             }
         }
+        // same as moved(), MOVED reply of a command told that the slot has moved
+        inline void moved( SlotIndex slot )
+        {
+            if( slotMovedFn_ != nullptr )
+            {
+                slotMovedFn_( connections_->data_, slot );
+            }
+            moved();
+        }
         // can be used to identify that cluster mey need to be reinitialized in runtime
         // because there have been some redirections
         inline bool isMoved()
@@ -152,6 +257,19 @@ namespace RedisCluster
         {
             userMovedFn_ = fn;
         }
+        // set callback invoked with the slot number of every MOVED redirection, i.e. for
+        // dropping data cached for the slot (see ClientCache)
+        inline void setSlotMovedCb( SlotMovedCb fn )
+        {
+            slotMovedFn_ = fn;
+        }
+        // addresses of the node serving the slot and of its replicas from "CLUSTER SLOTS"
+        // reply, the node goes first. Replicas are not connected by cluster, they can be
+        // reached with createNewConnection (i.e. for reading after READONLY)
+        const Hosts& hosts( SlotIndex slot )
+        {
+            return DefaultContainer<redisConnection>::searchBySlots( slot, hosts_ )->second;
+        }
         // creates new connection when HiredisCommand or AsyncHiredisCommand needs a
         // connection for follow the redirection
         inline HostConnection createNewConnection( string host, string port )
@@ -177,13 +295,57 @@ namespace RedisCluster
             connections_->releaseConnection( conn );
         }
         
+        // frees connection which can't be reused (i.e. reply wasn't read because of timeout)
+        // instead of releasing it, container replaces it with a new one
+        void discardConnection( HostConnection conn )
+        {
+            connections_->discardConnection( conn );
+        }
+        
+        void discardConnection( SlotConnection conn )
+        {
+            connections_->discardConnection( conn );
+        }
+        
         // TODO: сделать удаление соединения извне
         void deleteConnection(const redisConnection* con) {
             connections_->deleteConnection(con);
         }
         
+        // replaces connection serving slots, i.e. after reconnection
+        bool replaceConnection(const redisConnection* con, redisConnection* replacement) {
+            return connections_->replaceConnection(con, replacement);
+        }
+        
+        // true if the reply on "CLUSTER SLOTS" can be parsed, so constructor won't throw
+        // (and free it) because of its format
+        static bool isSlotsReply( const redisReply *reply )
+        {
+            if( reply == NULL || reply->type != REDIS_REPLY_ARRAY )
+                return false;
+            for( size_t i = 0; i < reply->elements; i++ )
+            {
+                if( !isSlotRange( reply->element[i] ) )
+                    return false;
+            }
+            return true;
+        }
+        
     protected:
         
+        // element of "CLUSTER SLOTS" reply: first slot, last slot, master, replicas...
+        static bool isSlotRange( const redisReply *range )
+        {
+            return range->type == REDIS_REPLY_ARRAY &&
+                range->elements >= 3 &&
+                range->element[0]->type == REDIS_REPLY_INTEGER &&
+                range->element[1]->type == REDIS_REPLY_INTEGER &&
+                range->element[2]->type == REDIS_REPLY_ARRAY &&
+                range->element[2]->elements >= 2 &&
+                range->element[2]->element[0]->type == REDIS_REPLY_STRING &&
+                range->element[2]->element[1]->type == REDIS_REPLY_INTEGER;
+        }
+        
         void init( redisReply *reply )
         {
             if( reply->type == REDIS_REPLY_ARRAY )
@@ -191,14 +353,7 @@ namespace RedisCluster
                 size_t cnt = reply->elements;
                 for( size_t i = 0; i < cnt; i++ )
                 {
-                    if( reply->element[i]->type== REDIS_REPLY_ARRAY &&
-                       reply->element[i]->elements >= 3 &&
-                       reply->element[i]->element[0]->type == REDIS_REPLY_INTEGER &&
-                       reply->element[i]->element[1]->type == REDIS_REPLY_INTEGER &&
-                       reply->element[i]->element[2]->type == REDIS_REPLY_ARRAY &&
-                       reply->element[i]->element[2]->elements >= 2 &&
-                       reply->element[i]->element[2]->element[0]->type == REDIS_REPLY_STRING &&
-                       reply->element[i]->element[2]->element[1]->type == REDIS_REPLY_INTEGER)
+                    if( isSlotRange( reply->element[i] ) )
                     {
                         SlotRange slots = { reply->element[i]->element[0]->integer,
                             reply->element[i]->element[1]->integer };
@@ -206,6 +361,21 @@ namespace RedisCluster
                         connections_->insert(slots,
                                             reply->element[i]->element[2]->element[0]->str,
                                             (int)reply->element[i]->element[2]->element[1]->integer);
+                        
+                        // nodes after the third element are replicas, the ones with unknown
+                        // address (empty host) are skipped
+                        Hosts &hosts = hosts_[slots];
+                        for( size_t j = 2; j < reply->element[i]->elements; ++j )
+                        {
+                            const redisReply *node = reply->element[i]->element[j];
+                            if( node->type == REDIS_REPLY_ARRAY && node->elements >= 2 &&
+                               node->element[0]->type == REDIS_REPLY_STRING && ( j == 2 || node->element[0]->len > 0 ) &&
+                               node->element[1]->type == REDIS_REPLY_INTEGER )
+                            {
+                                hosts.push_back( string( node->element[0]->str, node->element[0]->len ) + ":" +
+                                                std::to_string( node->element[1]->integer ) );
+                            }
+                        }
                     }
                     else
                     {
@@ -224,8 +394,10 @@ namespace RedisCluster
         DestructCb destructCallback_ = nullptr;
         void* destructData = nullptr;
         volatile MovedCb userMovedFn_ = nullptr;
+        volatile SlotMovedCb slotMovedFn_ = nullptr;
         volatile bool readytouse_ = false;
         volatile bool moved_ = false;
+        std::map<SlotRange, Hosts, SlotComparator> hosts_;
     };
 }
 
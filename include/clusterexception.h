@@ -30,8 +30,14 @@
 #define __libredisCluster__clusterexception__
 
 #include <stdexcept>
+#include <string>
 #include <string.h>
 
+extern "C"
+{
+#include <hiredis/hiredis.h>
+}
+
 namespace RedisCluster {
     using std::string;
 
@@ -115,6 +121,30 @@ namespace RedisCluster {
         LogicError(redisReply *reply, string reason) : BadStateException(reply, reason) {}
     };
 
+    // exception meaning that command was rejected because limits of commands in flight
+    // and wait queue are exhausted, command can be sent again later
+    class OverloadedException : public ClusterException {
+    public:
+        OverloadedException() : ClusterException(nullptr, std::string("too many commands in flight")) {}
+    };
+
+    // exception meaning that command deadline is expired before the reply came
+    class TimeoutException : public ClusterException {
+    public:
+        TimeoutException() : ClusterException(nullptr, std::string("command timed out")) {}
+    };
+
+    // exception meaning that reply is not of the type requested through ReplyView,
+    // i.e. string is requested from array reply or integer doesn't fit the type
+    class ReplyTypeException : public ClusterException {
+    public:
+        int replyType;
+
+        ReplyTypeException(int replyType, const std::string &expected) : ClusterException(nullptr,
+            std::string("unexpected reply type ") + std::to_string(replyType) + ", expected " + expected),
+            replyType(replyType) {}
+    };
+
     // exception meaning that you had not properly passed arguments cluster or command invocation
     class InvalidArgument : public ClusterException {
     public:
@@ -0,0 +1,346 @@
+/*
+ * Copyright (c) 2015, Dmitrii Shinkevich <shinmail at gmail dot com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __libredisCluster__commandtemplate__
+#define __libredisCluster__commandtemplate__
+
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "clusterexception.h"
+
+namespace RedisCluster
+{
+    using std::string;
+    
+    // Command format parsed once for commands sent many times with different arguments.
+    // Arguments without placeholders are encoded in redis protocol right away, so every
+    // bind() only writes length prefixes and values of the changed arguments into the buffer
+    // reused from the previous call, there is no format parsing and no allocation once the
+    // buffer has grown to its size.
+    //
+    //     CommandTemplate hset( "HSET {%s}:x field %b" );
+    //     hset.bind( tag, CommandTemplate::Bytes( value, valueLen ) );
+    //     Reply reply = HiredisCommand<>::AltCommand( cluster_p, tag, hset );
+    //     AsyncHiredisCommand<>::Command( async_p, tag, hset.bind( tag2, value2 ), callback );
+    //
+    // Placeholders: %s and %b take a string (const char*, std::string or Bytes), unlike hiredis %b
+    // takes one Bytes argument instead of pointer and length. %d, %i, %u, %ld, %lu, %lld, %llu take
+    // an integer of any type (bool and characters aren't integers here), the value is written as
+    // it is whatever the length modifier says, %% is a percent sign. Arguments are split by spaces like in hiredis. Template
+    // isn't thread safe, every thread needs its own one.
+    class CommandTemplate
+    {
+    public:
+        
+        // binary argument
+        struct Bytes
+        {
+            Bytes( const void *data, size_t len ) : data( static_cast<const char*>( data ) ), len( len ) {}
+            
+            const char *data;
+            size_t len;
+        };
+        
+        // value of a placeholder
+        class Arg
+        {
+            friend class CommandTemplate;
+            
+            // integral types except bool and characters, which are mistakes more often than numbers
+            template <typename T>
+            struct IsNumber : std::integral_constant<bool,
+                std::is_integral<T>::value && !std::is_same<T, bool>::value && !std::is_same<T, char>::value &&
+                !std::is_same<T, signed char>::value && !std::is_same<T, unsigned char>::value &&
+                !std::is_same<T, wchar_t>::value && !std::is_same<T, char16_t>::value &&
+                !std::is_same<T, char32_t>::value> {};
+            
+            // numbers are kept as magnitude and sign, so unsigned values above LLONG_MAX stay positive
+            static inline unsigned long long magnitude( long long integer )
+            {
+                return integer < 0 ? 0ULL - static_cast<unsigned long long>( integer ) :
+                    static_cast<unsigned long long>( integer );
+            }
+            
+            static inline unsigned long long magnitude( unsigned long long integer )
+            {
+                return integer;
+            }
+            
+            static inline bool negative( long long integer )
+            {
+                return integer < 0;
+            }
+            
+            static inline bool negative( unsigned long long )
+            {
+                return false;
+            }
+            
+        public:
+            Arg( const char *str ) : str_( str ), len_( strlen( str ) ), magnitude_( 0 ), negative_( false ), isString_( true ) {}
+            Arg( const string &str ) : str_( str.data() ), len_( str.size() ), magnitude_( 0 ), negative_( false ), isString_( true ) {}
+            Arg( const Bytes &bytes ) : str_( bytes.data ), len_( bytes.len ), magnitude_( 0 ), negative_( false ), isString_( true ) {}
+            
+            template <typename T, typename = typename std::enable_if< IsNumber<T>::value >::type>
+            Arg( T integer ) :
+            str_( nullptr ),
+            len_( 0 ),
+            magnitude_( magnitude( static_cast<typename std::conditional< std::is_signed<T>::value,
+                                   long long, unsigned long long >::type>( integer ) ) ),
+            negative_( negative( static_cast<typename std::conditional< std::is_signed<T>::value,
+                                 long long, unsigned long long >::type>( integer ) ) ),
+            isString_( false )
+            {
+            }
+            
+        private:
+            const char *str_;
+            size_t len_;
+            unsigned long long magnitude_;
+            bool negative_;
+            bool isString_;
+        };
+        
+        explicit CommandTemplate( const char *format ) :
+        args_(),
+        placeholders_( 0 ),
+        buffer_()
+        {
+            parse( format );
+        }
+        
+        // fills placeholders in order, the result is valid till the next bind
+        template <typename... Args>
+        CommandTemplate& bind( const Args&... args )
+        {
+            const Arg values[] = { Arg( args )... };
+            fill( values, sizeof...( Args ) );
+            return *this;
+        }
+        
+        CommandTemplate& bind()
+        {
+            fill( nullptr, 0 );
+            return *this;
+        }
+        
+        // command encoded in redis protocol by the last bind
+        inline const char* data() const
+        {
+            return buffer_.data();
+        }
+        
+        inline size_t size() const
+        {
+            return buffer_.size();
+        }
+        
+    private:
+        
+        // literal text or placeholder of an argument
+        struct Piece
+        {
+            string text;
+            // -1 for literal text
+            int placeholder;
+            bool integer;
+        };
+        
+        // argument without placeholders is kept encoded, consecutive ones are merged
+        struct Argument
+        {
+            string encoded;
+            std::vector<Piece> pieces;
+        };
+        
+        void parse( const char *format )
+        {
+            std::vector< std::vector<Piece> > args;
+            const char *c = format;
+            while( *c != '\0' )
+            {
+                while( *c == ' ' )
+                    ++c;
+                if( *c == '\0' )
+                    break;
+                
+                std::vector<Piece> arg;
+                string text;
+                while( *c != '\0' && *c != ' ' )
+                {
+                    if( *c != '%' )
+                    {
+                        text += *c++;
+                        continue;
+                    }
+                    ++c;
+                    if( *c == '%' )
+                    {
+                        text += *c++;
+                        continue;
+                    }
+                    
+                    bool integer = false;
+                    if( *c == 's' || *c == 'b' )
+                    {
+                        ++c;
+                    }
+                    else
+                    {
+                        const char *spec = c;
+                        while( *c == 'l' )
+                            ++c;
+                        if( c - spec > 2 || ( *c != 'd' && *c != 'i' && *c != 'u' ) )
+                            throw InvalidArgument(nullptr);
+                        ++c;
+                        integer = true;
+                    }
+                    if( !text.empty() )
+                    {
+                        Piece literal = { text, -1, false };
+                        arg.push_back( literal );
+                        text.clear();
+                    }
+                    Piece placeholder = { string(), static_cast<int>( placeholders_++ ), integer };
+                    arg.push_back( placeholder );
+                }
+                if( !text.empty() )
+                {
+                    Piece literal = { text, -1, false };
+                    arg.push_back( literal );
+                }
+                args.push_back( arg );
+            }
+            
+            Argument head = { "*" + std::to_string( args.size() ) + "\r\n", std::vector<Piece>() };
+            args_.push_back( head );
+            for( const std::vector<Piece> &arg : args )
+            {
+                if( arg.size() == 1 && arg[0].placeholder < 0 )
+                {
+                    string encoded = "$" + std::to_string( arg[0].text.size() ) + "\r\n" + arg[0].text + "\r\n";
+                    if( args_.back().pieces.empty() )
+                    {
+                        args_.back().encoded += encoded;
+                    }
+                    else
+                    {
+                        Argument constant = { encoded, std::vector<Piece>() };
+                        args_.push_back( constant );
+                    }
+                }
+                else
+                {
+                    Argument variable = { string(), arg };
+                    args_.push_back( variable );
+                }
+            }
+        }
+        
+        static void appendNumber( string &buffer, unsigned long long number, bool negative )
+        {
+            char digits[24];
+            char *end = digits + sizeof( digits );
+            char *p = end;
+            do
+            {
+                *--p = static_cast<char>( '0' + number % 10 );
+                number /= 10;
+            }
+            while( number != 0 );
+            if( negative )
+                *--p = '-';
+            buffer.append( p, end - p );
+        }
+        
+        static size_t integerLength( const Arg &value )
+        {
+            unsigned long long number = value.magnitude_;
+            size_t len = value.negative_ ? 2 : 1;
+            while( number >= 10 )
+            {
+                number /= 10;
+                ++len;
+            }
+            return len;
+        }
+        
+        void fill( const Arg *values, size_t count )
+        {
+            if( count != placeholders_ )
+                throw InvalidArgument(nullptr);
+            
+            buffer_.clear();
+            for( const Argument &arg : args_ )
+            {
+                if( arg.pieces.empty() )
+                {
+                    buffer_ += arg.encoded;
+                    continue;
+                }
+                
+                size_t len = 0;
+                for( const Piece &piece : arg.pieces )
+                {
+                    if( piece.placeholder < 0 )
+                    {
+                        len += piece.text.size();
+                        continue;
+                    }
+                    const Arg &value = values[piece.placeholder];
+                    if( value.isString_ == piece.integer )
+                        throw InvalidArgument(nullptr);
+                    len += piece.integer ? integerLength( value ) : value.len_;
+                }
+                
+                buffer_ += '$';
+                appendNumber( buffer_, len, false );
+                buffer_ += "\r\n";
+                for( const Piece &piece : arg.pieces )
+                {
+                    if( piece.placeholder < 0 )
+                        buffer_ += piece.text;
+                    else if( piece.integer )
+                        appendNumber( buffer_, values[piece.placeholder].magnitude_, values[piece.placeholder].negative_ );
+                    else
+                        buffer_.append( values[piece.placeholder].str_, values[piece.placeholder].len_ );
+                }
+                buffer_ += "\r\n";
+            }
+        }
+        
+        std::vector<Argument> args_;
+        size_t placeholders_;
+        string buffer_;
+    };
+}
+
+#endif /* defined(__libredisCluster__commandtemplate__) */
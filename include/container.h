@@ -47,6 +47,7 @@ namespace RedisCluster {
         
         typedef std::map <SlotRange, redisConnection*, typename RCluster::SlotComparator> ClusterNodes;
         typedef std::map <Host, redisConnection*> RedirectConnections;
+        typedef std::map <SlotRange, std::pair<string, int>, typename RCluster::SlotComparator> Endpoints;
         
     public:
         
@@ -57,7 +58,8 @@ namespace RedisCluster {
         connect_(conn),
         disconnect_(disconn),
         connections_{},
-        nodes_{}
+        nodes_{},
+        endpoints_{}
         {
         }
         
@@ -84,6 +86,7 @@ namespace RedisCluster {
             }
             
             nodes_.insert( typename ClusterNodes::value_type(slots, conn) );
+            endpoints_.insert( typename Endpoints::value_type(slots, std::make_pair( string( host ), port )) );
         }
         
         inline
@@ -143,8 +146,36 @@ namespace RedisCluster {
         inline void releaseConnection( typename RCluster::SlotConnection ) {}
         inline void releaseConnection( typename RCluster::HostConnection ) {}
         
+        // connection in unknown state (i.e. timed out in the middle of a reply) is freed and
+        // the node is connected again. New connection can be broken too if the node is down,
+        // then the next command fails fast and discards it again
+        inline void discardConnection( typename RCluster::SlotConnection conn )
+        {
+            typename ClusterNodes::iterator node = nodes_.find( conn.first );
+            typename Endpoints::iterator endpoint = endpoints_.find( conn.first );
+            if( node == nodes_.end() || node->second != conn.second || endpoint == endpoints_.end() )
+                return;
+            
+            redisConnection* fresh = connect_( endpoint->second.first.c_str(), endpoint->second.second, data_ );
+            if( fresh == NULL )
+                return;
+            node->second = fresh;
+            if( disconnect_ != NULL )
+                disconnect_( conn.second );
+        }
+        
+        // redirection connections are created on demand, so it's just forgotten
+        inline void discardConnection( typename RCluster::HostConnection conn )
+        {
+            typename RedirectConnections::iterator found = connections_.find( conn.first );
+            if( found != connections_.end() && found->second == conn.second )
+                connections_.erase( found );
+            if( disconnect_ != NULL && conn.second != NULL )
+                disconnect_( conn.second );
+        }
+        
         template<typename Cons>
-        void deleteConnection(Cons connections, const redisConnection* con) {
+        void deleteConnection(Cons &connections, const redisConnection* con) {
             for (auto it = connections.begin(); it != connections.end();) {
                 if (it->second == con) {
                     it = connections.erase(it);
@@ -161,26 +192,43 @@ namespace RedisCluster {
             deleteConnection(nodes_, con);
         }
         
+        // puts replacement instead of connection serving slot ranges (i.e. reconnected one
+        // instead of lost one), returns false if connection doesn't serve any slots
+        bool replaceConnection(const redisConnection* con, redisConnection* replacement) {
+            bool replaced = false;
+            for (auto &node : nodes_) {
+                if (node.second == con) {
+                    node.second = replacement;
+                    replaced = true;
+                }
+            }
+            return replaced;
+        }
+        
         inline
         void disconnect()
         {
             disconnect<ClusterNodes>( nodes_ );
             disconnect<RedirectConnections>( connections_ );
+            endpoints_.clear();
         }
         
+        // connections are taken out of container before they are freed, because disconnect
+        // function can call deleteConnection right away
         template <typename T>
         inline void disconnect(T &cons)
         {
+            T disconnecting;
+            disconnecting.swap( cons );
             if( disconnect_ != NULL )
             {
-                typename T::iterator it(cons.begin()), end(cons.end());
+                typename T::iterator it(disconnecting.begin()), end(disconnecting.end());
                 while ( it != end )
                 {
                     disconnect_( it->second );
                     ++it;
                 }
             }
-            cons.clear();
         }
         
         void* data_;
@@ -189,6 +237,7 @@ namespace RedisCluster {
         typename RCluster::pt2RedisFreeFunc disconnect_;
         RedirectConnections connections_;
         ClusterNodes nodes_;
+        Endpoints endpoints_;
     };
     
 }
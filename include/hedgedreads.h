@@ -0,0 +1,393 @@
+/*
+ * Copyright (c) 2015, Dmitrii Shinkevich <shinmail at gmail dot com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __libredisCluster__hedgedreads__
+#define __libredisCluster__hedgedreads__
+
+#include <algorithm>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "adapters/adapter.h"  // for Adapter
+#include "asynchirediscommand.h"
+#include "timerwheel.h"
+
+extern "C"
+{
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+}
+
+namespace RedisCluster
+{
+    using std::string;
+    
+    // Hedged reads for asynchronous cluster. Read command is sent to the node serving the key
+    // as usual, if the node hasn't answered within its recent latency percentile, the same
+    // command is sent to one of the node replicas (after READONLY). The first reply wins and
+    // is passed to the callback, the late one is dropped. Error replies of replicas (i.e. MOVED
+    // from a replica which is not in sync yet) never win, the node reply is waited for then.
+    // Only idempotent reads may be sent this way, replica can return slightly older data.
+    //
+    //     HedgedReads<> hedged( adapter );
+    //     hedged.Command( cluster_p, "FOO", callback, "GET %s", "FOO" );
+    //
+    // It's not thread safe and is used from the event loop thread like the cluster. Object must
+    // live while it has commands in flight, adapter must support Adapter::runAfter.
+    template < typename Cluster = Cluster<redisAsyncContext> >
+    class HedgedReads
+    {
+        typedef AsyncHiredisCommand<Cluster> AsyncCommand;
+        typedef typename AsyncCommand::RedisCallback RedisCallback;
+        typedef std::chrono::steady_clock Clock;
+        
+        HedgedReads(const HedgedReads&) = delete;
+        HedgedReads& operator=(const HedgedReads&) = delete;
+        
+        // latency percentile is recomputed after this number of replies
+        static const uint64_t RecomputeEvery = 64;
+        
+    public:
+        
+        struct Options
+        {
+            Options() :
+            percentile( 0.99 ),
+            window( 1024 ),
+            minDelay{ 0, 1000 },
+            maxDelay{ 0, 100000 },
+            timerResolution{ 0, 1000 }
+            {}
+            
+            // request is hedged when it's slower than this part of recent requests to the node
+            double percentile;
+            // number of recent node replies the percentile is taken from
+            size_t window;
+            // bounds of hedging delay, maxDelay is used until the node has enough replies
+            struct timeval minDelay;
+            struct timeval maxDelay;
+            // precision of hedging timers
+            struct timeval timerResolution;
+        };
+        
+        struct NodeStats
+        {
+            // commands sent to the node
+            uint64_t requests;
+            // commands sent to its replicas
+            uint64_t hedges;
+            // hedged commands answered by replica first
+            uint64_t replicaWins;
+            // current hedging delay in microseconds
+            uint64_t delay;
+            
+            double hedgeRate() const
+            {
+                return requests == 0 ? 0. : double( hedges ) / double( requests );
+            }
+        };
+        
+        typedef std::unordered_map<string, NodeStats> Stats;
+        
+        HedgedReads( Adapter &adapter, const Options &options = Options() ) :
+        options_( options ),
+        wheel_( new TimerWheel( adapter, options.timerResolution ) ),
+        nodes_(),
+        scratch_(),
+        minDelay_( toUs( options.minDelay ) ),
+        maxDelay_( toUs( options.maxDelay ) )
+        {
+            if( options.window == 0 || options.percentile <= 0. || options.percentile > 1. )
+                throw InvalidArgument(nullptr);
+        }
+        
+        ~HedgedReads()
+        {
+            wheel_->destroy();
+        }
+        
+        void Command( typename Cluster::ptr_t cluster_p,
+                      const string &key,
+                      int argc,
+                      const char ** argv,
+                      const size_t *argvlen,
+                      const RedisCallback& redisCallback )
+        {
+            char *cmd = nullptr;
+            long long len = redisFormatCommandArgv( &cmd, argc, argv, argvlen );
+            if( len < 0 )
+                throw InvalidArgument(nullptr);
+            send( cluster_p, key, cmd, static_cast<int>( len ), redisCallback );
+        }
+        
+        void Command( typename Cluster::ptr_t cluster_p,
+                      const string &key,
+                      const RedisCallback& redisCallback,
+                      const char *format, ... )
+        {
+            va_list ap;
+            va_start( ap, format );
+            char *cmd = nullptr;
+            int len = redisvFormatCommand( &cmd, format, ap );
+            va_end( ap );
+            if( len < 0 )
+                throw InvalidArgument(nullptr);
+            send( cluster_p, key, cmd, len, redisCallback );
+        }
+        
+        // counters by "host:port" of the nodes serving keys
+        Stats stats() const
+        {
+            Stats stats;
+            for( const typename Nodes::value_type &node : nodes_ )
+            {
+                NodeStats &nodeStats = stats[node.first];
+                nodeStats = node.second.stats;
+                nodeStats.delay = node.second.delay;
+            }
+            return stats;
+        }
+        
+    private:
+        
+        // recent reply latencies of the node
+        struct Node
+        {
+            Node( size_t window, uint64_t initialDelay ) :
+            samples( window, 0 ),
+            count( 0 ),
+            delay( initialDelay ),
+            next( 0 ),
+            replica( 0 ),
+            stats()
+            {}
+            
+            std::vector<uint64_t> samples;
+            uint64_t count;
+            uint64_t delay;
+            size_t next;
+            size_t replica;
+            NodeStats stats;
+        };
+        
+        typedef std::unordered_map<string, Node> Nodes;
+        
+        struct Hedge
+        {
+            Hedge( HedgedReads *owner, typename Cluster::ptr_t cluster_p, Node &node, const string &replica,
+                   const char *cmd, int len, const RedisCallback &callback ) :
+            owner( owner ),
+            cluster_p( cluster_p ),
+            node( node ),
+            replica( replica ),
+            cmd( cmd, len ),
+            callback( callback ),
+            timer( onTimer, this ),
+            start( Clock::now() ),
+            outstanding( 0 ),
+            done( false )
+            {}
+            
+            Hedge(const Hedge&) = delete;
+            Hedge& operator=(const Hedge&) = delete;
+            
+            HedgedReads *owner;
+            typename Cluster::ptr_t cluster_p;
+            Node &node;
+            string replica;
+            string cmd;
+            RedisCallback callback;
+            TimerWheel::Timer timer;
+            Clock::time_point start;
+            int outstanding;
+            bool done;
+        };
+        
+        static uint64_t toUs( const struct timeval &tv )
+        {
+            return static_cast<uint64_t>( tv.tv_sec ) * 1000000 + tv.tv_usec;
+        }
+        
+        Node& node( const string &host )
+        {
+            typename Nodes::iterator found = nodes_.find( host );
+            if( found == nodes_.end() )
+                found = nodes_.insert( typename Nodes::value_type( host, Node( options_.window, maxDelay_ ) ) ).first;
+            return found->second;
+        }
+        
+        void send( typename Cluster::ptr_t cluster_p, const string &key, char *cmd, int len,
+                   const RedisCallback &redisCallback )
+        {
+            Hedge *hedge = nullptr;
+            try
+            {
+                const typename Cluster::Hosts &hosts = cluster_p->hosts( SlotHash::SlotByKey( key.data(), key.size() ) );
+                Node &primary = node( hosts.front() );
+                string replica;
+                // replicas take hedged requests in turn
+                if( hosts.size() > 1 )
+                    replica = hosts[ 1 + primary.replica++ % ( hosts.size() - 1 ) ];
+                
+                hedge = new Hedge( this, cluster_p, primary, replica, cmd, len, redisCallback );
+                ++primary.stats.requests;
+                // timer is set before sending, the callback can be invoked right away if node is down
+                if( !replica.empty() )
+                {
+                    struct timeval delay = { static_cast<long>( primary.delay / 1000000 ),
+                        static_cast<long>( primary.delay % 1000000 ) };
+                    wheel_->schedule( hedge->timer, delay );
+                }
+                hedge->outstanding = 1;
+            }
+            catch( ... )
+            {
+                free( cmd );
+                if( hedge != nullptr )
+                {
+                    wheel_->cancel( hedge->timer );
+                    delete hedge;
+                }
+                throw;
+            }
+            
+            try
+            {
+                AsyncCommand::FormattedCommand( cluster_p, key, cmd, len,
+                    [this, hedge]( const redisReply &reply ) { primaryReply( hedge, reply ); } );
+            }
+            catch( ... )
+            {
+                wheel_->cancel( hedge->timer );
+                delete hedge;
+                throw;
+            }
+        }
+        
+        void primaryReply( Hedge *hedge, const redisReply &reply )
+        {
+            sample( hedge->node, std::chrono::duration_cast<std::chrono::microseconds>(
+                Clock::now() - hedge->start ).count() );
+            --hedge->outstanding;
+            finish( hedge, reply );
+            release( hedge );
+        }
+        
+        static void replicaReply( redisAsyncContext *, void *r, void *data )
+        {
+            Hedge *hedge = static_cast<Hedge*>( data );
+            redisReply *reply = static_cast<redisReply*>( r );
+            --hedge->outstanding;
+            if( reply != nullptr && reply->type != REDIS_REPLY_ERROR && !hedge->done )
+            {
+                ++hedge->node.stats.replicaWins;
+                hedge->owner->finish( hedge, *reply );
+            }
+            hedge->owner->release( hedge );
+        }
+        
+        static void onTimer( void *data )
+        {
+            Hedge *hedge = static_cast<Hedge*>( data );
+            if( !hedge->done )
+                hedge->owner->sendHedge( hedge );
+            hedge->owner->release( hedge );
+        }
+        
+        // replica connection is taken like the one for redirections, READONLY is sent every
+        // time because the connection can be shared with redirected commands
+        void sendHedge( Hedge *hedge )
+        {
+            string::size_type colon = hedge->replica.rfind( ':' );
+            typename Cluster::HostConnection con = { "", NULL };
+            try
+            {
+                con = hedge->cluster_p->createNewConnection( hedge->replica.substr( 0, colon ),
+                                                            hedge->replica.substr( colon + 1 ) );
+            }
+            catch( const ClusterException & )
+            {
+                return;
+            }
+            if( con.second == NULL || con.second->err != 0 )
+                return;
+            
+            if( redisAsyncCommand( con.second, nullptr, nullptr, "READONLY" ) == REDIS_OK &&
+                redisAsyncFormattedCommand( con.second, replicaReply, hedge, hedge->cmd.data(), hedge->cmd.size() ) == REDIS_OK )
+            {
+                ++hedge->outstanding;
+                ++hedge->node.stats.hedges;
+            }
+        }
+        
+        void finish( Hedge *hedge, const redisReply &reply )
+        {
+            if( hedge->done )
+                return;
+            hedge->done = true;
+            wheel_->cancel( hedge->timer );
+            if( hedge->callback )
+                hedge->callback( reply );
+        }
+        
+        void release( Hedge *hedge )
+        {
+            if( hedge->outstanding == 0 && !hedge->timer.scheduled() )
+                delete hedge;
+        }
+        
+        // delay is the percentile of the window, it's recomputed from time to time
+        void sample( Node &node, uint64_t us )
+        {
+            node.samples[node.next] = us;
+            node.next = ( node.next + 1 ) % node.samples.size();
+            ++node.count;
+            if( node.count % RecomputeEvery != 0 )
+                return;
+            
+            size_t filled = std::min( static_cast<size_t>( node.count ), node.samples.size() );
+            scratch_.assign( node.samples.begin(), node.samples.begin() + filled );
+            size_t index = std::min( filled - 1, static_cast<size_t>( options_.percentile * filled ) );
+            std::nth_element( scratch_.begin(), scratch_.begin() + index, scratch_.end() );
+            node.delay = std::max( minDelay_, std::min( maxDelay_, scratch_[index] ) );
+        }
+        
+        Options options_;
+        TimerWheel *wheel_;
+        Nodes nodes_;
+        std::vector<uint64_t> scratch_;
+        uint64_t minDelay_;
+        uint64_t maxDelay_;
+    };
+}
+
+#endif /* defined(__libredisCluster__hedgedreads__) */
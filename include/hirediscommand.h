@@ -29,10 +29,21 @@
 #ifndef __libredisCluster__command__
 #define __libredisCluster__command__
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <vector>
+#include <sys/uio.h>
 #include "cluster.h"
+#include "commandtemplate.h"
 #include "hiredisprocess.h"
-#include <memory>
+#include "reply.h"
+#include "replyarena.h"
+#include "replyview.h"
 
 extern "C"
 {
@@ -43,7 +54,6 @@ namespace RedisCluster
 {
     using std::string;
 
-    typedef std::shared_ptr<redisReply> Reply;
     template < typename Cluster = Cluster<redisContext> >
     class HiredisCommand
     {
@@ -51,14 +61,32 @@ namespace RedisCluster
         enum CommandType
         {
             SDS,
-            FORMATTED_STRING
+            FORMATTED_STRING,
+            // protocol headers are formatted, large arguments are written from caller memory
+            SCATTER,
+            // buffer of CommandTemplate, it's not owned
+            BORROWED
         };
         
         HiredisCommand(const HiredisCommand&) = delete;
         HiredisCommand& operator=(const HiredisCommand&) = delete;
         
+        // deleter of Reply, replies outlive their connections
+        struct ReplyDeleter
+        {
+            ReplyArena::FreeFn freeObject;
+            
+            void operator()( redisReply *reply ) const
+            {
+                freeObject( reply );
+            }
+        };
+        
     public:
         
+        // arguments of ScatterCommand at least this long are not copied
+        static const size_t ScatterThreshold = 16384;
+        
         static typename Cluster::ptr_t createCluster(const char* host,
                                                           int port,
                                                           void* data = NULL,
@@ -83,17 +111,51 @@ namespace RedisCluster
             return cluster;
         }
         
+        // releases replies built by default hiredis functions, Reply returned by AltCommand
+        // has the deleter of the connection it was read from (see ReplyArena)
         static void deleteReply (redisReply *reply) {
             freeReplyObject(reply);
         }
         
+        // features of connections opened by connectWith
+        enum ConnectFeature
+        {
+            // every reply is built in one arena (see ReplyArena), raw replies returned
+            // by Command must be released with ReplyArena::release() then
+            REPLY_ARENA = 1,
+            // connection sends HELLO 3 and speaks RESP3: maps, sets, doubles, booleans come
+            // with their own reply types (hiredis 1.0+ and redis 6+). Push messages are
+            // handled by hiredis default push handler
+            RESP3 = 2
+        };
+        
+        // connect function for createCluster, i.e. connectWith< REPLY_ARENA | RESP3 >,
+        // it's used for redirection connections as well
+        template <int Features>
+        static Connection* connectWith( const char* host, int port, void *data )
+        {
+            Connection *con = connectFunction( host, port, data );
+            if( con == NULL || con->err != 0 )
+                return con;
+            if( Features & REPLY_ARENA )
+                ReplyArena::install( *con );
+            if( Features & RESP3 )
+                hello( con );
+            return con;
+        }
+        
+        static Connection* arenaConnectFunction( const char* host, int port, void *data )
+        {
+            return connectWith<REPLY_ARENA>( host, port, data );
+        }
+        
         static inline Reply AltCommand( typename Cluster::ptr_t cluster_p,
                                     string key,
                                     int argc,
                                     const char ** argv,
                                     const size_t *argvlen )
         {
-            return Reply(HiredisCommand( cluster_p, key, argc, argv, argvlen ).process(), deleteReply);
+            return HiredisCommand( cluster_p, key, argc, argv, argvlen ).processReply();
         }
         
         static inline Reply AltCommand( typename Cluster::ptr_t cluster_p,
@@ -102,7 +164,7 @@ namespace RedisCluster
         {
             va_list ap;
             va_start( ap, format );
-            return Reply(HiredisCommand( cluster_p, key, format, ap ).process(), deleteReply);
+            return HiredisCommand( cluster_p, key, format, ap ).processReply();
             va_end(ap);
         }
         
@@ -110,9 +172,10 @@ namespace RedisCluster
                                     string key,
                                     const char *format, va_list ap)
         {
-            return Reply(HiredisCommand( cluster_p, key, format, ap ).process(), deleteReply);
+            return HiredisCommand( cluster_p, key, format, ap ).processReply();
         }
         
+        // raw reply of arena connection is released with ReplyArena::release(), not freeReplyObject()
         static inline void* Command( typename Cluster::ptr_t cluster_p,
                                    string key,
                                    int argc,
@@ -122,6 +185,7 @@ namespace RedisCluster
             return HiredisCommand( cluster_p, key, argc, argv, argvlen ).process();
         }
         
+        // raw reply of arena connection is released with ReplyArena::release(), not freeReplyObject()
         static inline void* Command( typename Cluster::ptr_t cluster_p,
                                    string key,
                                    const char *format, ...)
@@ -132,6 +196,7 @@ namespace RedisCluster
             va_end(ap);
         }
         
+        // raw reply of arena connection is released with ReplyArena::release(), not freeReplyObject()
         static inline void* Command( typename Cluster::ptr_t cluster_p,
                                     string key,
                                     const char *format, va_list ap)
@@ -139,6 +204,383 @@ namespace RedisCluster
             return HiredisCommand( cluster_p, key, format, ap ).process();
         }
         
+        // sends command already formatted in redis protocol, cmd must be allocated
+        // with malloc (i.e. by redisFormatCommand) and is owned by command since now
+        // raw reply of arena connection is released with ReplyArena::release(), not freeReplyObject()
+        static inline void* FormattedCommand( typename Cluster::ptr_t cluster_p,
+                                            string key,
+                                            char *cmd,
+                                            int len )
+        {
+            if( cluster_p == NULL )
+            {
+                free( cmd );
+                throw InvalidArgument(nullptr);
+            }
+            return HiredisCommand( cluster_p, key, cmd, len ).process();
+        }
+        
+        static inline Reply AltFormattedCommand( typename Cluster::ptr_t cluster_p,
+                                            string key,
+                                            char *cmd,
+                                            int len )
+        {
+            if( cluster_p == NULL )
+            {
+                free( cmd );
+                throw InvalidArgument(nullptr);
+            }
+            return HiredisCommand( cluster_p, key, cmd, len ).processReply();
+        }
+        
+        // command prepared by CommandTemplate::bind, template buffer is sent as it is
+        // raw reply of arena connection is released with ReplyArena::release(), not freeReplyObject()
+        static inline void* Command( typename Cluster::ptr_t cluster_p,
+                                   string key,
+                                   const CommandTemplate &command )
+        {
+            return HiredisCommand( cluster_p, key, command ).process();
+        }
+        
+        static inline Reply AltCommand( typename Cluster::ptr_t cluster_p,
+                                    string key,
+                                    const CommandTemplate &command )
+        {
+            return HiredisCommand( cluster_p, key, command ).processReply();
+        }
+        
+        // command with large arguments (i.e. blobs of several megabytes), which are written
+        // straight from caller memory with writev instead of being copied into command buffer
+        // and then into connection buffer. Only protocol headers and arguments shorter than
+        // ScatterThreshold are formatted. Arguments must stay alive until the call returns.
+        // Connections with TLS can't be written directly, they get a formatted copy
+        // raw reply of arena connection is released with ReplyArena::release(), not freeReplyObject()
+        static inline void* ScatterCommand( typename Cluster::ptr_t cluster_p,
+                                          string key,
+                                          int argc,
+                                          const char ** argv,
+                                          const size_t *argvlen )
+        {
+            return HiredisCommand( cluster_p, key, argc, argv, argvlen, SCATTER ).process();
+        }
+        
+        static inline Reply AltScatterCommand( typename Cluster::ptr_t cluster_p,
+                                          string key,
+                                          int argc,
+                                          const char ** argv,
+                                          const size_t *argvlen )
+        {
+            return HiredisCommand( cluster_p, key, argc, argv, argvlen, SCATTER ).processReply();
+        }
+        
+        // commands with deadline, timeout is the budget for the whole call including
+        // redirections. When it's exhausted TimeoutException is thrown and the connection
+        // with unread reply is discarded instead of being returned to the container
+        static inline Reply AltCommand( typename Cluster::ptr_t cluster_p,
+                                    string key,
+                                    const struct timeval &timeout,
+                                    int argc,
+                                    const char ** argv,
+                                    const size_t *argvlen )
+        {
+            HiredisCommand command( cluster_p, key, argc, argv, argvlen );
+            command.setDeadline( timeout );
+            return command.processReply();
+        }
+        
+        static inline Reply AltCommand( typename Cluster::ptr_t cluster_p,
+                                    string key,
+                                    const struct timeval &timeout,
+                                    const char *format, ...)
+        {
+            va_list ap;
+            va_start( ap, format );
+            HiredisCommand command( cluster_p, key, format, ap );
+            va_end( ap );
+            command.setDeadline( timeout );
+            return command.processReply();
+        }
+        
+        // raw reply of arena connection is released with ReplyArena::release(), not freeReplyObject()
+        static inline void* Command( typename Cluster::ptr_t cluster_p,
+                                   string key,
+                                   const struct timeval &timeout,
+                                   int argc,
+                                   const char ** argv,
+                                   const size_t *argvlen )
+        {
+            HiredisCommand command( cluster_p, key, argc, argv, argvlen );
+            command.setDeadline( timeout );
+            return command.process();
+        }
+        
+        // raw reply of arena connection is released with ReplyArena::release(), not freeReplyObject()
+        static inline void* Command( typename Cluster::ptr_t cluster_p,
+                                   string key,
+                                   const struct timeval &timeout,
+                                   const char *format, ...)
+        {
+            va_list ap;
+            va_start( ap, format );
+            HiredisCommand command( cluster_p, key, format, ap );
+            va_end( ap );
+            command.setDeadline( timeout );
+            return command.process();
+        }
+        
+        static inline Reply AltCommand( typename Cluster::ptr_t cluster_p,
+                                    string key,
+                                    const struct timeval &timeout,
+                                    const char *format, va_list ap)
+        {
+            HiredisCommand command( cluster_p, key, format, ap );
+            command.setDeadline( timeout );
+            return command.processReply();
+        }
+        
+        // raw reply of arena connection is released with ReplyArena::release(), not freeReplyObject()
+        static inline void* Command( typename Cluster::ptr_t cluster_p,
+                                    string key,
+                                    const struct timeval &timeout,
+                                    const char *format, va_list ap)
+        {
+            HiredisCommand command( cluster_p, key, format, ap );
+            command.setDeadline( timeout );
+            return command.process();
+        }
+        
+        // raw reply of arena connection is released with ReplyArena::release(), not freeReplyObject()
+        static inline void* FormattedCommand( typename Cluster::ptr_t cluster_p,
+                                            string key,
+                                            const struct timeval &timeout,
+                                            char *cmd,
+                                            int len )
+        {
+            if( cluster_p == NULL )
+            {
+                free( cmd );
+                throw InvalidArgument(nullptr);
+            }
+            HiredisCommand command( cluster_p, key, cmd, len );
+            command.setDeadline( timeout );
+            return command.process();
+        }
+        
+        static inline Reply AltFormattedCommand( typename Cluster::ptr_t cluster_p,
+                                            string key,
+                                            const struct timeval &timeout,
+                                            char *cmd,
+                                            int len )
+        {
+            if( cluster_p == NULL )
+            {
+                free( cmd );
+                throw InvalidArgument(nullptr);
+            }
+            HiredisCommand command( cluster_p, key, cmd, len );
+            command.setDeadline( timeout );
+            return command.processReply();
+        }
+        
+        // raw reply of arena connection is released with ReplyArena::release(), not freeReplyObject()
+        static inline void* Command( typename Cluster::ptr_t cluster_p,
+                                   string key,
+                                   const struct timeval &timeout,
+                                   const CommandTemplate &command )
+        {
+            HiredisCommand templated( cluster_p, key, command );
+            templated.setDeadline( timeout );
+            return templated.process();
+        }
+        
+        static inline Reply AltCommand( typename Cluster::ptr_t cluster_p,
+                                    string key,
+                                    const struct timeval &timeout,
+                                    const CommandTemplate &command )
+        {
+            HiredisCommand templated( cluster_p, key, command );
+            templated.setDeadline( timeout );
+            return templated.processReply();
+        }
+        
+        // raw reply of arena connection is released with ReplyArena::release(), not freeReplyObject()
+        static inline void* ScatterCommand( typename Cluster::ptr_t cluster_p,
+                                          string key,
+                                          const struct timeval &timeout,
+                                          int argc,
+                                          const char ** argv,
+                                          const size_t *argvlen )
+        {
+            HiredisCommand command( cluster_p, key, argc, argv, argvlen, SCATTER );
+            command.setDeadline( timeout );
+            return command.process();
+        }
+        
+        static inline Reply AltScatterCommand( typename Cluster::ptr_t cluster_p,
+                                          string key,
+                                          const struct timeval &timeout,
+                                          int argc,
+                                          const char ** argv,
+                                          const size_t *argvlen )
+        {
+            HiredisCommand command( cluster_p, key, argc, argv, argvlen, SCATTER );
+            command.setDeadline( timeout );
+            return command.processReply();
+        }
+        
+        // commands sent through the connection leased with Cluster::lease(), use them
+        // for bursts of commands to one slot to avoid container round trip per command
+        static inline Reply AltCommand( typename Cluster::Lease &lease,
+                                    int argc,
+                                    const char ** argv,
+                                    const size_t *argvlen )
+        {
+            return HiredisCommand( &lease.cluster(), string(), argc, argv, argvlen ).processReply( lease );
+        }
+        
+        static inline Reply AltCommand( typename Cluster::Lease &lease,
+                                    const char *format, ...)
+        {
+            va_list ap;
+            va_start( ap, format );
+            HiredisCommand command( &lease.cluster(), string(), format, ap );
+            va_end( ap );
+            return command.processReply( lease );
+        }
+        
+        // raw reply of arena connection is released with ReplyArena::release(), not freeReplyObject()
+        static inline void* Command( typename Cluster::Lease &lease,
+                                   int argc,
+                                   const char ** argv,
+                                   const size_t *argvlen )
+        {
+            return HiredisCommand( &lease.cluster(), string(), argc, argv, argvlen ).process( lease );
+        }
+        
+        // raw reply of arena connection is released with ReplyArena::release(), not freeReplyObject()
+        static inline void* Command( typename Cluster::Lease &lease,
+                                   const char *format, ...)
+        {
+            va_list ap;
+            va_start( ap, format );
+            HiredisCommand command( &lease.cluster(), string(), format, ap );
+            va_end( ap );
+            return command.process( lease );
+        }
+        
+        // raw reply of arena connection is released with ReplyArena::release(), not freeReplyObject()
+        static inline void* Command( typename Cluster::Lease &lease,
+                                   const char *format, va_list ap)
+        {
+            return HiredisCommand( &lease.cluster(), string(), format, ap ).process( lease );
+        }
+        
+        static inline Reply AltCommand( typename Cluster::Lease &lease,
+                                    const char *format, va_list ap)
+        {
+            return HiredisCommand( &lease.cluster(), string(), format, ap ).processReply( lease );
+        }
+        
+        static inline Reply AltCommand( typename Cluster::Lease &lease,
+                                    const CommandTemplate &command )
+        {
+            return HiredisCommand( &lease.cluster(), string(), command ).processReply( lease );
+        }
+        
+        // raw reply of arena connection is released with ReplyArena::release(), not freeReplyObject()
+        static inline void* Command( typename Cluster::Lease &lease,
+                                   const CommandTemplate &command )
+        {
+            return HiredisCommand( &lease.cluster(), string(), command ).process( lease );
+        }
+        
+        // leased connection that timed out is discarded, lease is released after that
+        static inline Reply AltCommand( typename Cluster::Lease &lease,
+                                    const struct timeval &timeout,
+                                    int argc,
+                                    const char ** argv,
+                                    const size_t *argvlen )
+        {
+            HiredisCommand command( &lease.cluster(), string(), argc, argv, argvlen );
+            command.setDeadline( timeout );
+            return command.processReply( lease );
+        }
+        
+        static inline Reply AltCommand( typename Cluster::Lease &lease,
+                                    const struct timeval &timeout,
+                                    const char *format, ...)
+        {
+            va_list ap;
+            va_start( ap, format );
+            HiredisCommand command( &lease.cluster(), string(), format, ap );
+            va_end( ap );
+            command.setDeadline( timeout );
+            return command.processReply( lease );
+        }
+        
+        // raw reply of arena connection is released with ReplyArena::release(), not freeReplyObject()
+        static inline void* Command( typename Cluster::Lease &lease,
+                                   const struct timeval &timeout,
+                                   int argc,
+                                   const char ** argv,
+                                   const size_t *argvlen )
+        {
+            HiredisCommand command( &lease.cluster(), string(), argc, argv, argvlen );
+            command.setDeadline( timeout );
+            return command.process( lease );
+        }
+        
+        // raw reply of arena connection is released with ReplyArena::release(), not freeReplyObject()
+        static inline void* Command( typename Cluster::Lease &lease,
+                                   const struct timeval &timeout,
+                                   const char *format, ...)
+        {
+            va_list ap;
+            va_start( ap, format );
+            HiredisCommand command( &lease.cluster(), string(), format, ap );
+            va_end( ap );
+            command.setDeadline( timeout );
+            return command.process( lease );
+        }
+        
+        static inline Reply AltCommand( typename Cluster::Lease &lease,
+                                    const struct timeval &timeout,
+                                    const char *format, va_list ap)
+        {
+            HiredisCommand command( &lease.cluster(), string(), format, ap );
+            command.setDeadline( timeout );
+            return command.processReply( lease );
+        }
+        
+        // raw reply of arena connection is released with ReplyArena::release(), not freeReplyObject()
+        static inline void* Command( typename Cluster::Lease &lease,
+                                   const struct timeval &timeout,
+                                   const char *format, va_list ap)
+        {
+            HiredisCommand command( &lease.cluster(), string(), format, ap );
+            command.setDeadline( timeout );
+            return command.process( lease );
+        }
+        
+        static inline Reply AltCommand( typename Cluster::Lease &lease,
+                                    const struct timeval &timeout,
+                                    const CommandTemplate &command )
+        {
+            HiredisCommand templated( &lease.cluster(), string(), command );
+            templated.setDeadline( timeout );
+            return templated.processReply( lease );
+        }
+        
+        // raw reply of arena connection is released with ReplyArena::release(), not freeReplyObject()
+        static inline void* Command( typename Cluster::Lease &lease,
+                                   const struct timeval &timeout,
+                                   const CommandTemplate &command )
+        {
+            HiredisCommand templated( &lease.cluster(), string(), command );
+            templated.setDeadline( timeout );
+            return templated.process( lease );
+        }
+        
     protected:
         
         HiredisCommand( typename Cluster::ptr_t cluster_p,
@@ -150,7 +592,13 @@ namespace RedisCluster
         key_( key ),
         cmd_{},
         len_{},
-        type_( SDS )
+        type_( SDS ),
+        hasDeadline_( false ),
+        deadline_(),
+        previousTimeout_(),
+        headers_(),
+        iov_(),
+        freeObject_( freeReplyObject )
         {
             if( cluster_p == NULL )
                 throw InvalidArgument(nullptr);
@@ -165,7 +613,13 @@ namespace RedisCluster
         key_( key ),
         cmd_{},
         len_{},
-        type_( FORMATTED_STRING )
+        type_( FORMATTED_STRING ),
+        hasDeadline_( false ),
+        deadline_(),
+        previousTimeout_(),
+        headers_(),
+        iov_(),
+        freeObject_( freeReplyObject )
         {
             if( cluster_p == NULL )
                 throw InvalidArgument(nullptr);
@@ -173,56 +627,342 @@ namespace RedisCluster
             len_ = redisvFormatCommand(&cmd_, format, ap);
         }
         
+        HiredisCommand( typename Cluster::ptr_t cluster_p,
+                       string key,
+                       int argc,
+                       const char ** argv,
+                       const size_t *argvlen,
+                       CommandType ) :
+        cluster_p_( cluster_p ),
+        key_( key ),
+        cmd_( nullptr ),
+        len_( 0 ),
+        type_( SCATTER ),
+        hasDeadline_( false ),
+        deadline_(),
+        previousTimeout_(),
+        headers_(),
+        iov_(),
+        freeObject_( freeReplyObject )
+        {
+            if( cluster_p == NULL )
+                throw InvalidArgument(nullptr);
+            
+            // positions in headers_ where large arguments are written
+            std::vector< std::pair<size_t, int> > cuts;
+            headers_ += "*" + std::to_string( argc ) + "\r\n";
+            for( int i = 0; i < argc; ++i )
+            {
+                size_t len = argvlen != NULL ? argvlen[i] : strlen( argv[i] );
+                headers_ += "$" + std::to_string( len ) + "\r\n";
+                if( len >= ScatterThreshold )
+                    cuts.push_back( std::make_pair( headers_.size(), i ) );
+                else
+                    headers_.append( argv[i], len );
+                headers_ += "\r\n";
+            }
+            
+            size_t begin = 0;
+            for( const std::pair<size_t, int> &cut : cuts )
+            {
+                struct iovec header = { const_cast<char*>( headers_.data() ) + begin, cut.first - begin };
+                struct iovec arg = { const_cast<char*>( argv[cut.second] ),
+                    argvlen != NULL ? argvlen[cut.second] : strlen( argv[cut.second] ) };
+                iov_.push_back( header );
+                iov_.push_back( arg );
+                begin = cut.first;
+            }
+            struct iovec tail = { const_cast<char*>( headers_.data() ) + begin, headers_.size() - begin };
+            iov_.push_back( tail );
+        }
+        
+        HiredisCommand( typename Cluster::ptr_t cluster_p,
+                       string key,
+                       const CommandTemplate &command ) :
+        cluster_p_( cluster_p ),
+        key_( key ),
+        cmd_( const_cast<char*>( command.data() ) ),
+        len_( static_cast<int>( command.size() ) ),
+        type_( BORROWED ),
+        hasDeadline_( false ),
+        deadline_(),
+        previousTimeout_(),
+        headers_(),
+        iov_(),
+        freeObject_( freeReplyObject )
+        {
+            if( cluster_p == NULL )
+                throw InvalidArgument(nullptr);
+        }
+        
+        HiredisCommand( typename Cluster::ptr_t cluster_p,
+                       string key,
+                       char *cmd, int len ) :
+        cluster_p_( cluster_p ),
+        key_( key ),
+        cmd_( cmd ),
+        len_( len ),
+        type_( FORMATTED_STRING ),
+        hasDeadline_( false ),
+        deadline_(),
+        previousTimeout_(),
+        headers_(),
+        iov_(),
+        freeObject_( freeReplyObject )
+        {
+        }
+        
         ~HiredisCommand()
         {
             if( type_ == SDS )
             {
                 sdsfree( (sds)cmd_ );
             }
-            else
+            else if( type_ != BORROWED )
             {
                 free( cmd_ );
             }
         }
         
+        void setDeadline( const struct timeval &timeout )
+        {
+            hasDeadline_ = true;
+            deadline_ = std::chrono::steady_clock::now() +
+                std::chrono::seconds( timeout.tv_sec ) + std::chrono::microseconds( timeout.tv_usec );
+        }
+        
+        // socket timeout is set to what is left from the budget before every round trip,
+        // so redirections share the deadline of the call. Nothing is sent if it's exhausted
+        void applyDeadline( Connection *con )
+        {
+            if( !hasDeadline_ )
+                return;
+            
+            long long left = std::chrono::duration_cast<std::chrono::microseconds>(
+                deadline_ - std::chrono::steady_clock::now() ).count();
+            if( left <= 0 )
+                throw TimeoutException();
+            
+            previousTimeout_.tv_sec = 0;
+            previousTimeout_.tv_usec = 0;
+#if defined(HIREDIS_MAJOR) && HIREDIS_MAJOR >= 1
+            if( con->command_timeout != NULL )
+                previousTimeout_ = *con->command_timeout;
+#endif
+            struct timeval tv;
+            tv.tv_sec = static_cast<long>( left / 1000000 );
+            tv.tv_usec = static_cast<long>( left % 1000000 );
+            redisSetTimeout( con, tv );
+        }
+        
+        // connection goes back to container with the timeout it had before
+        void resetDeadline( Connection *con )
+        {
+            if( hasDeadline_ && con->err == 0 )
+                redisSetTimeout( con, previousTimeout_ );
+        }
+        
+        // hiredis reports read timeout as I/O error, so the deadline is checked as well
+        bool timedOut( Connection *con ) const
+        {
+            if( !hasDeadline_ )
+                return false;
+#ifdef REDIS_ERR_TIMEOUT
+            if( con->err == REDIS_ERR_TIMEOUT )
+                return true;
+#endif
+            return ( con->err == REDIS_ERR_IO && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) ||
+                std::chrono::steady_clock::now() >= deadline_;
+        }
+        
         redisReply* processHiredisCommand( Connection *con ) {
-            redisReply* reply;
-            redisAppendFormattedCommand( con, cmd_, len_ );
+            redisReply* reply = nullptr;
+            applyDeadline( con );
+            freeObject_ = ReplyArena::freeFunction( *con );
+            if( type_ == SCATTER )
+                writeScatter( con );
+            else
+                redisAppendFormattedCommand( con, cmd_, len_ );
             redisGetReply( con, (void**)&reply );
+            resetDeadline( con );
             return reply;
         }
         
+        // connection buffer is flushed first, then pieces are written until all of them are out,
+        // failed write leaves the connection with error like hiredis does
+        void writeScatter( Connection *con )
+        {
+#if defined(HIREDIS_MAJOR) && HIREDIS_MAJOR >= 1
+            if( con->privctx != NULL )
+            {
+                string copy;
+                for( const struct iovec &piece : iov_ )
+                    copy.append( static_cast<const char*>( piece.iov_base ), piece.iov_len );
+                redisAppendFormattedCommand( con, copy.data(), copy.size() );
+                return;
+            }
+#endif
+            int done = 0;
+            while( !done )
+            {
+                if( redisBufferWrite( con, &done ) != REDIS_OK )
+                    return;
+            }
+            
+#ifdef IOV_MAX
+            const size_t maxIov = IOV_MAX;
+#else
+            const size_t maxIov = 1024;
+#endif
+            std::vector<struct iovec> iov( iov_ );
+            size_t first = 0;
+            while( first < iov.size() )
+            {
+                ssize_t written = writev( con->fd, &iov[first], static_cast<int>( std::min( iov.size() - first, maxIov ) ) );
+                if( written < 0 )
+                {
+                    if( errno == EINTR )
+                        continue;
+                    int error = errno;
+                    con->err = REDIS_ERR_IO;
+                    snprintf( con->errstr, sizeof( con->errstr ), "%s", strerror( error ) );
+                    errno = error;
+                    return;
+                }
+                while( written > 0 )
+                {
+                    size_t len = iov[first].iov_len;
+                    if( static_cast<size_t>( written ) >= len )
+                    {
+                        written -= len;
+                        ++first;
+                    }
+                    else
+                    {
+                        iov[first].iov_base = static_cast<char*>( iov[first].iov_base ) + written;
+                        iov[first].iov_len -= written;
+                        written = 0;
+                    }
+                }
+            }
+        }
+        
         redisReply* asking( Connection *con  ) {
-            return static_cast<redisReply*>( redisCommand( con, "ASKING" ) );
+            applyDeadline( con );
+            freeObject_ = ReplyArena::freeFunction( *con );
+            redisReply* reply = static_cast<redisReply*>( redisCommand( con, "ASKING" ) );
+            resetDeadline( con );
+            return reply;
+        }
+        
+        // reply is released by the functions of the connection it was read from
+        inline void release( redisReply *reply )
+        {
+            freeObject_( reply );
+        }
+        
+        // exceptions free replies with freeReplyObject, so arena replies are released here
+        void checkCritical( redisReply *reply, bool errorcritical, const string &error = "" )
+        {
+            try
+            {
+                HiredisProcess::checkCritical( reply, errorcritical, false, error );
+            }
+            catch( ... )
+            {
+                release( reply );
+                throw;
+            }
+        }
+        
+        Reply processReply()
+        {
+            redisReply *reply = process();
+            return Reply( reply, ReplyDeleter{ freeObject_ } );
+        }
+        
+        Reply processReply( typename Cluster::Lease &lease )
+        {
+            redisReply *reply = process( lease );
+            return Reply( reply, ReplyDeleter{ freeObject_ } );
+        }
+        
+        // connection with error has unread replies or is closed, it's discarded and
+        // container replaces it. Healthy connection is given back for reuse
+        template <typename Con>
+        void giveBack( Con &con, redisReply *reply )
+        {
+            if( con.second->err == 0 )
+            {
+                cluster_p_->releaseConnection( con );
+                return;
+            }
+            
+            bool timeout = timedOut( con.second );
+            if( reply != nullptr )
+                release( reply );
+            cluster_p_->discardConnection( con );
+            if( timeout )
+                throw TimeoutException();
+            throw DisconnectedException();
         }
         
         redisReply* process()
         {
             redisReply *reply = nullptr;
             typename Cluster::SlotConnection con = cluster_p_->getConnection( key_ );
+            
+            try
+            {
+                reply = processHiredisCommand( con.second );
+            }
+            catch( const TimeoutException & )
+            {
+                // budget was spent before anything was sent, connection is fine
+                cluster_p_->releaseConnection( con );
+                throw;
+            }
+            giveBack( con, reply );
+            checkCritical( reply, false );
+            
+            return processRedirect( reply );
+        }
+        
+        // same as process, but connection is already taken from container and
+        // would be released by the lease owner
+        redisReply* process( typename Cluster::Lease &lease )
+        {
+            redisReply *reply = processHiredisCommand( lease.connection() );
+            if( lease.connection()->err != 0 )
+            {
+                bool timeout = timedOut( lease.connection() );
+                if( reply != nullptr )
+                    release( reply );
+                lease.discard();
+                if( timeout )
+                    throw TimeoutException();
+                throw DisconnectedException();
+            }
+            checkCritical( reply, false );
+            
+            return processRedirect( reply );
+        }
+        
+        redisReply* processRedirect( redisReply *reply )
+        {
             typename Cluster::HostConnection hcon = { "", NULL };
             string host, port;
-
-            reply = processHiredisCommand( con.second );
-            HiredisProcess::checkCritical(reply, false, true, std::string(), con.second);
-            cluster_p_->releaseConnection( con );
+            typename Cluster::SlotIndex slot = 0;
 
             HiredisProcess::processState state = HiredisProcess::processResult( reply, host, port);
             
             switch ( state ) {
                 case HiredisProcess::ASK:
-                    freeReplyObject( reply );
+                    release( reply );
                     hcon = cluster_p_->createNewConnection( host, port );
                     
                     if (hcon.second != NULL && hcon.second->err == 0) {
-                        reply = asking( hcon.second );
-                        HiredisProcess::checkCritical(reply, true, "asking error");
-                    
-                        freeReplyObject( reply );
-                        reply = processHiredisCommand(hcon.second);
-                        HiredisProcess::checkCritical(reply, false);
-                    
-                        cluster_p_->releaseConnection( hcon );
+                        reply = redirect( hcon, true );
                     }
                     else if( hcon.second == NULL )
                         throw LogicError(nullptr, "Can't connect while resolving asking state");
@@ -232,30 +972,81 @@ namespace RedisCluster
                     }
                     break;
                 case HiredisProcess::MOVED:
-                    freeReplyObject( reply );
+                    slot = HiredisProcess::parseslot( reply );
+                    release( reply );
                     hcon = cluster_p_->createNewConnection( host, port );
                     if( hcon.second != NULL && hcon.second->err == 0 ) {
-                        reply = processHiredisCommand( hcon.second );
-                        cluster_p_->moved();
+                        reply = redirect( hcon, false );
+                        cluster_p_->moved( slot );
                     }
                     else if( hcon.second == NULL )
                         throw LogicError(nullptr, "Can't connect while resolving asking state");
                     else
                         throw LogicError(nullptr, hcon.second->errstr );
-                    cluster_p_->releaseConnection( hcon );
                     
                     break;
                 case HiredisProcess::READY:
                     break;
                 default:
-                    throw LogicError(reply, "error in state processing" );
+                    release( reply );
+                    throw LogicError(nullptr, "error in state processing" );
             }
             return reply;
         }
         
+        // sends command to the node given by redirection within the rest of the budget
+        redisReply* redirect( typename Cluster::HostConnection &hcon, bool ask )
+        {
+            redisReply *reply = nullptr;
+            try
+            {
+                if( ask )
+                {
+                    reply = asking( hcon.second );
+                    if( hcon.second->err == 0 )
+                    {
+                        checkCritical( reply, true, "asking error" );
+                        release( reply );
+                        reply = processHiredisCommand( hcon.second );
+                    }
+                }
+                else
+                {
+                    reply = processHiredisCommand( hcon.second );
+                }
+            }
+            catch( const TimeoutException & )
+            {
+                cluster_p_->releaseConnection( hcon );
+                throw;
+            }
+            giveBack( hcon, reply );
+            if( ask )
+                checkCritical( reply, false );
+            return reply;
+        }
+        
+        // connecting is limited too, unreachable node must not block the caller forever
         static Connection* connectFunction( const char* host, int port, void * )
         {
-            return redisConnect( host, port);
+            struct timeval timeout = { 3, 0 };
+            return redisConnectWithTimeout( host, port, timeout );
+        }
+        
+        // refused HELLO leaves the connection with error, so it's not used
+        static void hello( Connection *con )
+        {
+            redisReply *reply = static_cast<redisReply*>( redisCommand( con, "HELLO 3" ) );
+            if( reply == NULL || reply->type == REDIS_REPLY_ERROR )
+            {
+                if( con->err == 0 )
+                {
+                    con->err = REDIS_ERR_OTHER;
+                    snprintf( con->errstr, sizeof( con->errstr ), "%s",
+                              reply != NULL ? reply->str : "HELLO 3 failed" );
+                }
+            }
+            freeReply( *con, reply );
         }
         
         static void freeFunction( Connection* con )
@@ -268,6 +1059,14 @@ namespace RedisCluster
         char *cmd_;
         int len_;
         CommandType type_;
+        bool hasDeadline_;
+        std::chrono::steady_clock::time_point deadline_;
+        struct timeval previousTimeout_;
+        // formatted parts of SCATTER command and pieces to write
+        string headers_;
+        std::vector<struct iovec> iov_;
+        // frees replies of the connection used last
+        ReplyArena::FreeFn freeObject_;
     };
 }
 
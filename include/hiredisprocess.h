@@ -29,6 +29,8 @@
 #ifndef __libredisCluster__hiredisprocess__
 #define __libredisCluster__hiredisprocess__
 
+#include <cstdlib>
+#include <cstring>
 #include <string>
 #include "cluster.h"
 
@@ -69,6 +71,15 @@ namespace RedisCluster
             }
         }
         
+        // slot number from "MOVED 3999 127.0.0.1:6381" error
+        static unsigned int parseslot( const redisReply *reply )
+        {
+            const char *slot = strchr( reply->str, ' ' );
+            if( slot == nullptr )
+                throw LogicError(nullptr, "error while parsing slot in redis redirection reply");
+            return static_cast<unsigned int>( strtoul( slot + 1, nullptr, 10 ) );
+        }
+        
         static processState processResult( redisReply* reply, string &result_host, string &result_port )
         {
             processState state = READY;
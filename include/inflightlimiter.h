@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2015, Dmitrii Shinkevich <shinmail at gmail dot com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __libredisCluster__inflightlimiter__
+#define __libredisCluster__inflightlimiter__
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <string>
+
+namespace RedisCluster
+{
+    // Limits of asynchronous commands waiting for reply, globally and per node. Nodes are
+    // identified by "host:port", so the limit of a node holds across its reconnections.
+    // Command over the limit waits in bounded queue and is sent when some reply comes, if the
+    // queue is full as well command is rejected with OverloadedException. Every node has its
+    // own FIFO of waiting commands, nodes with room are kept ordered by their oldest command,
+    // so a reply resumes only commands which can be sent now and waiting commands of a slow
+    // node don't delay the others. Limiter is owned by user, passed to one cluster with
+    // AsyncHiredisCommand::Options and must outlive the cluster and its event loop. It's not
+    // thread safe and is used from event loop thread only, counters can be read there for
+    // monitoring. Zero limit means no limit.
+    class InFlightLimiter
+    {
+        InFlightLimiter(const InFlightLimiter&) = delete;
+        InFlightLimiter& operator=(const InFlightLimiter&) = delete;
+        
+    public:
+        // waiting command is resumed with cancel = false when there is room for its node, if it
+        // doesn't fit anyway (i.e. its slot is moved to another node) it must be enqueued again.
+        // With cancel = true command must be finished
+        typedef void (*ResumeFn)( void *data, bool cancel );
+        
+    private:
+        struct Waiting
+        {
+            void *data;
+            ResumeFn resume;
+            // position in the common FIFO order
+            uint64_t order;
+        };
+        
+        struct Node
+        {
+            Node() : inFlight( 0 ), waiting(), ready( false ), readyOrder( 0 ) {}
+            
+            size_t inFlight;
+            std::list<Waiting> waiting;
+            // node has room and waiting commands, it's in ready_ under readyOrder
+            bool ready;
+            uint64_t readyOrder;
+        };
+        
+        typedef std::map<std::string, Node> Nodes;
+        
+    public:
+        // place of a command in the wait queue, it's used to take the command out
+        class Ticket
+        {
+            friend class InFlightLimiter;
+            
+        public:
+            Ticket() : node_(), waiting_() {}
+            
+        private:
+            Nodes::iterator node_;
+            std::list<Waiting>::iterator waiting_;
+        };
+        
+        InFlightLimiter( size_t maxInFlight, size_t maxInFlightPerNode, size_t maxQueued ) :
+        maxInFlight_( maxInFlight ),
+        maxInFlightPerNode_( maxInFlightPerNode ),
+        maxQueued_( maxQueued ),
+        inFlight_( 0 ),
+        queued_( 0 ),
+        rejected_( 0 ),
+        order_( 0 ),
+        nodes_(),
+        ready_(),
+        draining_( false )
+        {
+        }
+        
+        ~InFlightLimiter()
+        {
+            cancel();
+        }
+        
+        // takes a place for command sent to the node
+        bool acquire( const std::string &host )
+        {
+            if( maxInFlight_ != 0 && inFlight_ >= maxInFlight_ )
+                return false;
+            Nodes::iterator node = nodes_.insert( Nodes::value_type( host, Node() ) ).first;
+            if( !hasRoom( node->second ) )
+                return false;
+            ++node->second.inFlight;
+            ++inFlight_;
+            update( node );
+            return true;
+        }
+        
+        // frees the place when reply comes, waiting commands are resumed if drain is true
+        void release( const std::string &host, bool drain = true )
+        {
+            Nodes::iterator node = nodes_.find( host );
+            if( node != nodes_.end() && node->second.inFlight > 0 )
+            {
+                --node->second.inFlight;
+                --inFlight_;
+                update( node );
+            }
+            if( drain )
+                this->drain();
+        }
+        
+        // puts command for the node to the wait queue, false means that the queue is full
+        bool enqueue( const std::string &host, void *data, ResumeFn resume, Ticket &ticket )
+        {
+            if( queued_ >= maxQueued_ )
+            {
+                ++rejected_;
+                return false;
+            }
+            Nodes::iterator node = nodes_.insert( Nodes::value_type( host, Node() ) ).first;
+            node->second.waiting.push_back( Waiting{ data, resume, order_++ } );
+            ticket.node_ = node;
+            ticket.waiting_ = --node->second.waiting.end();
+            ++queued_;
+            update( node );
+            return true;
+        }
+        
+        // takes waiting command out of the queue without resuming it
+        void remove( const Ticket &ticket )
+        {
+            ticket.node_->second.waiting.erase( ticket.waiting_ );
+            --queued_;
+            update( ticket.node_ );
+        }
+        
+        // resumes the oldest waiting commands of nodes with room while there is global room
+        void drain()
+        {
+            if( draining_ )
+                return;
+            draining_ = true;
+            while( !ready_.empty() && ( maxInFlight_ == 0 || inFlight_ < maxInFlight_ ) )
+            {
+                Nodes::iterator node = ready_.begin()->second;
+                Waiting waiting = node->second.waiting.front();
+                node->second.waiting.pop_front();
+                --queued_;
+                update( node );
+                waiting.resume( waiting.data, false );
+            }
+            draining_ = false;
+        }
+        
+        // for Adapter::runLater
+        static void drainLater( void *data )
+        {
+            static_cast<InFlightLimiter*>( data )->drain();
+        }
+        
+        // finishes all waiting commands in FIFO order
+        void cancel()
+        {
+            std::map<uint64_t, Waiting> waiting;
+            for( Nodes::iterator node = nodes_.begin(); node != nodes_.end(); )
+            {
+                for( const Waiting &w : node->second.waiting )
+                    waiting.insert( std::make_pair( w.order, w ) );
+                node->second.waiting.clear();
+                node->second.ready = false;
+                if( node->second.inFlight == 0 )
+                    node = nodes_.erase( node );
+                else
+                    ++node;
+            }
+            ready_.clear();
+            queued_ = 0;
+            for( const std::map<uint64_t, Waiting>::value_type &w : waiting )
+                w.second.resume( w.second.data, true );
+        }
+        
+        // number of commands waiting for reply
+        inline size_t inFlight() const
+        {
+            return inFlight_;
+        }
+        
+        // number of commands waiting for reply from the node
+        inline size_t inFlight( const std::string &host ) const
+        {
+            Nodes::const_iterator node = nodes_.find( host );
+            return node != nodes_.end() ? node->second.inFlight : 0;
+        }
+        
+        // depth of the wait queue
+        inline size_t queued() const
+        {
+            return queued_;
+        }
+        
+        // number of commands waiting for room of the node
+        inline size_t queued( const std::string &host ) const
+        {
+            Nodes::const_iterator node = nodes_.find( host );
+            return node != nodes_.end() ? node->second.waiting.size() : 0;
+        }
+        
+        // number of commands rejected with OverloadedException
+        inline size_t rejected() const
+        {
+            return rejected_;
+        }
+        
+    private:
+        inline bool hasRoom( const Node &node ) const
+        {
+            return maxInFlightPerNode_ == 0 || node.inFlight < maxInFlightPerNode_;
+        }
+        
+        // keeps the node in ready_ under its oldest command while it has room,
+        // node with nothing in flight and nothing waiting is removed
+        void update( Nodes::iterator node )
+        {
+            Node &n = node->second;
+            if( n.ready && ( n.waiting.empty() || !hasRoom( n ) || n.readyOrder != n.waiting.front().order ) )
+            {
+                ready_.erase( n.readyOrder );
+                n.ready = false;
+            }
+            if( !n.ready && !n.waiting.empty() && hasRoom( n ) )
+            {
+                n.readyOrder = n.waiting.front().order;
+                ready_.insert( std::make_pair( n.readyOrder, node ) );
+                n.ready = true;
+            }
+            else if( n.waiting.empty() && n.inFlight == 0 )
+            {
+                nodes_.erase( node );
+            }
+        }
+        
+        size_t maxInFlight_;
+        size_t maxInFlightPerNode_;
+        size_t maxQueued_;
+        size_t inFlight_;
+        size_t queued_;
+        size_t rejected_;
+        uint64_t order_;
+        Nodes nodes_;
+        // nodes with room by the order of their oldest waiting command
+        std::map<uint64_t, Nodes::iterator> ready_;
+        bool draining_;
+    };
+}
+
+#endif /* defined(__libredisCluster__inflightlimiter__) */
@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) 2015, Dmitrii Shinkevich <shinmail at gmail dot com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __libredisCluster__inlinefunction__
+#define __libredisCluster__inlinefunction__
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace RedisCluster
+{
+    template <typename Signature, size_t Capacity = 48>
+    class InlineFunction;
+
+    // Copyable function wrapper like std::function, but callables up to Capacity bytes
+    // (i.e. lambdas with a few captures) are stored inside the object without heap
+    // allocation. Bigger callables are allocated on heap. It's constructible and assignable
+    // from std::function, empty std::function makes empty InlineFunction.
+    template <typename R, typename... Args, size_t Capacity>
+    class InlineFunction<R (Args...), Capacity>
+    {
+        struct Ops
+        {
+            R (*invoke)( const void *storage, Args... args );
+            void (*copy)( void *to, const void *from );
+            // moves callable and destroys the source
+            void (*move)( void *to, void *from );
+            void (*destroy)( void *storage );
+        };
+
+        template <typename F, bool Inline>
+        struct Holder;
+
+        // callable is placed in storage
+        template <typename F>
+        struct Holder<F, true>
+        {
+            static R invoke( const void *storage, Args... args )
+            {
+                return (*const_cast<F*>( static_cast<const F*>( storage ) ))( std::forward<Args>(args)... );
+            }
+            static void copy( void *to, const void *from )
+            {
+                new (to) F( *static_cast<const F*>( from ) );
+            }
+            static void move( void *to, void *from )
+            {
+                new (to) F( std::move( *static_cast<F*>( from ) ) );
+                static_cast<F*>( from )->~F();
+            }
+            static void destroy( void *storage )
+            {
+                static_cast<F*>( storage )->~F();
+            }
+        };
+
+        // pointer to callable is placed in storage
+        template <typename F>
+        struct Holder<F, false>
+        {
+            static R invoke( const void *storage, Args... args )
+            {
+                return (**static_cast<F* const*>( storage ))( std::forward<Args>(args)... );
+            }
+            static void copy( void *to, const void *from )
+            {
+                new (to) F*( new F( **static_cast<F* const*>( from ) ) );
+            }
+            static void move( void *to, void *from )
+            {
+                new (to) F*( *static_cast<F**>( from ) );
+            }
+            static void destroy( void *storage )
+            {
+                delete *static_cast<F**>( storage );
+            }
+        };
+
+        // moves of the wrapper are noexcept, so callables which may throw when
+        // moved are kept on heap, where moving is a pointer copy
+        template <typename F>
+        struct Stored
+        {
+            static const bool isInline = sizeof(F) <= Capacity &&
+                std::alignment_of<F>::value <= std::alignment_of<std::max_align_t>::value &&
+                std::is_nothrow_move_constructible<F>::value;
+            typedef Holder<F, isInline> type;
+        };
+
+        template <typename F>
+        static const Ops* ops()
+        {
+            typedef typename Stored<F>::type H;
+            static const Ops ops = { H::invoke, H::copy, H::move, H::destroy };
+            return &ops;
+        }
+
+        // callables testable for emptiness (function pointers, std::function and other
+        // wrappers with explicit operator bool) can be empty, functions can't
+        template <typename F>
+        struct Testable
+        {
+            static const bool value = std::is_constructible<bool, const F&>::value && !std::is_function<F>::value;
+        };
+
+        template <typename F>
+        static bool isEmpty( const F& f, typename std::enable_if<Testable<F>::value>::type* = nullptr )
+        {
+            return !static_cast<bool>( f );
+        }
+        template <typename F>
+        static bool isEmpty( const F&, typename std::enable_if<!Testable<F>::value>::type* = nullptr )
+        {
+            return false;
+        }
+
+        template <typename Decayed, typename F>
+        void construct( F&& f, std::true_type )
+        {
+            new (&storage_) Decayed( std::forward<F>(f) );
+        }
+
+        template <typename Decayed, typename F>
+        void construct( F&& f, std::false_type )
+        {
+            new (&storage_) Decayed*( new Decayed( std::forward<F>(f) ) );
+        }
+
+    public:
+        InlineFunction() : ops_( nullptr ), storage_() {}
+
+        InlineFunction( std::nullptr_t ) : ops_( nullptr ), storage_() {}
+
+        // like std::function, only callables take part in overload resolution
+        template <typename F, typename = typename std::enable_if<
+            !std::is_same<typename std::decay<F>::type, InlineFunction>::value>::type,
+            typename = decltype( std::declval<typename std::decay<F>::type&>()( std::declval<Args>()... ) )>
+        InlineFunction( F&& f ) : ops_( nullptr ), storage_()
+        {
+            typedef typename std::decay<F>::type Decayed;
+            if( isEmpty( f ) )
+                return;
+            construct<Decayed>( std::forward<F>(f), std::integral_constant<bool, Stored<Decayed>::isInline>() );
+            ops_ = ops<Decayed>();
+        }
+
+        InlineFunction( const InlineFunction &other ) : ops_( other.ops_ ), storage_()
+        {
+            if( ops_ )
+                ops_->copy( &storage_, &other.storage_ );
+        }
+
+        InlineFunction( InlineFunction &&other ) noexcept : ops_( other.ops_ ), storage_()
+        {
+            if( ops_ )
+            {
+                ops_->move( &storage_, &other.storage_ );
+                other.ops_ = nullptr;
+            }
+        }
+
+        InlineFunction& operator=( const InlineFunction &other )
+        {
+            if( this != &other )
+            {
+                reset();
+                if( other.ops_ )
+                    other.ops_->copy( &storage_, &other.storage_ );
+                ops_ = other.ops_;
+            }
+            return *this;
+        }
+
+        InlineFunction& operator=( InlineFunction &&other ) noexcept
+        {
+            if( this != &other )
+            {
+                reset();
+                if( other.ops_ )
+                {
+                    other.ops_->move( &storage_, &other.storage_ );
+                    ops_ = other.ops_;
+                    other.ops_ = nullptr;
+                }
+            }
+            return *this;
+        }
+
+        InlineFunction& operator=( std::nullptr_t )
+        {
+            reset();
+            return *this;
+        }
+
+        // i.e. std::function or lambda
+        template <typename F, typename = typename std::enable_if<
+            !std::is_same<typename std::decay<F>::type, InlineFunction>::value>::type,
+            typename = decltype( std::declval<typename std::decay<F>::type&>()( std::declval<Args>()... ) )>
+        InlineFunction& operator=( F&& f )
+        {
+            return *this = InlineFunction( std::forward<F>(f) );
+        }
+
+        ~InlineFunction()
+        {
+            reset();
+        }
+
+        void reset()
+        {
+            if( ops_ )
+            {
+                ops_->destroy( &storage_ );
+                ops_ = nullptr;
+            }
+        }
+
+        explicit operator bool() const
+        {
+            return ops_ != nullptr;
+        }
+
+        R operator()( Args... args ) const
+        {
+            return ops_->invoke( &storage_, std::forward<Args>(args)... );
+        }
+
+    private:
+        const Ops *ops_;
+        typename std::aligned_storage<Capacity, std::alignment_of<std::max_align_t>::value>::type storage_;
+    };
+}
+
+#endif /* defined(__libredisCluster__inlinefunction__) */
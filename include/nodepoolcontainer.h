@@ -0,0 +1,320 @@
+/*
+ * Copyright (c) 2015, Dmitrii Shinkevich <shinmail at gmail dot com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __libredisCluster__nodepoolcontainer__
+#define __libredisCluster__nodepoolcontainer__
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "cluster.h"
+
+namespace RedisCluster {
+
+    template<typename redisConnection, typename ConnectionContainer>
+    class Cluster;
+    
+    // Container keeping PoolSize connections to every cluster node. getConnection returns
+    // the connection with the fewest pending replies and counts it as pending until
+    // releaseConnection is called, asynchronous commands release it when the reply comes.
+    // So one large reply doesn't block small requests sent behind it. It's not thread safe,
+    // usage for asynchronous cluster:
+    //
+    //     typedef Cluster< redisAsyncContext, NodePoolContainer<redisAsyncContext, 4> > PooledCluster;
+    //     PooledCluster::ptr_t cluster_p = AsyncHiredisCommand<PooledCluster>::createCluster( ... );
+    template<typename redisConnection, unsigned int PoolSize = 4>
+    class NodePoolContainer
+    {
+        static_assert( PoolSize > 0, "at least one connection per node is required" );
+        
+        typedef Cluster<redisConnection, NodePoolContainer> RCluster;
+        typedef typename RCluster::SlotRange SlotRange;
+        typedef typename RCluster::Host Host;
+        
+        struct Entry
+        {
+            redisConnection *con;
+            unsigned int pending;
+        };
+        
+        typedef std::vector<Entry> Node;
+        typedef std::map <SlotRange, Node*, typename RCluster::SlotComparator> ClusterNodes;
+        typedef std::map <Host, Node*> NodesByHost;
+        typedef std::map <Host, redisConnection*> RedirectConnections;
+        
+    public:
+        
+        NodePoolContainer( typename RCluster::pt2RedisConnectFunc conn,
+                          typename RCluster::pt2RedisFreeFunc disconn,
+                          void* userData ) :
+        data_( userData ),
+        connect_(conn),
+        disconnect_(disconn),
+        connections_{},
+        nodes_{},
+        hosts_{}
+        {
+        }
+        
+        ~NodePoolContainer()
+        {
+            disconnect();
+        }
+        
+        NodePoolContainer( const NodePoolContainer& ) = delete;
+        NodePoolContainer& operator=( const NodePoolContainer& ) = delete;
+        
+        // slot ranges served by the same node share its connections
+        inline
+        void insert( typename RCluster::SlotRange slots, const char* host, int port )
+        {
+            Host key( string( host ) + ":" + std::to_string( port ) );
+            typename NodesByHost::iterator found = hosts_.find( key );
+            Node *node = nullptr;
+            if( found != hosts_.end() )
+            {
+                node = found->second;
+            }
+            else
+            {
+                node = new Node();
+                hosts_.insert( typename NodesByHost::value_type( key, node ) );
+                node->reserve( PoolSize );
+                for( unsigned int i = 0; i < PoolSize; ++i )
+                {
+                    redisConnection* conn = connect_( host, port, data_ );
+                    if( conn == NULL || conn->err )
+                    {
+                        throw ConnectionFailedException(nullptr);
+                    }
+                    node->push_back( Entry{ conn, 0 } );
+                }
+            }
+            nodes_.insert( typename ClusterNodes::value_type( slots, node ) );
+        }
+        
+        // connections for redirections are not pooled
+        inline
+        typename RCluster::HostConnection insert( string host, string port )
+        {
+            string key( host + ":" + port );
+            typename RedirectConnections::iterator found = connections_.find( key );
+            if( found != connections_.end() )
+            {
+                return typename RCluster::HostConnection( key, found->second );
+            }
+            
+            typename RCluster::HostConnection conn( key, connect_( host.c_str(), std::stoi(port), data_ ) );
+            if( conn.second != NULL && conn.second->err == 0 )
+            {
+                connections_.insert( conn );
+            }
+            return conn;
+        }
+        
+        inline
+        typename RCluster::SlotConnection getConnection( typename RCluster::SlotIndex index )
+        {
+            typename ClusterNodes::iterator node = DefaultContainer<redisConnection>::searchBySlots( index, nodes_ );
+            Entry *best = &node->second->front();
+            for( Entry &entry : *node->second )
+            {
+                // connections with error (i.e. placeholders of lost connections) are the last choice
+                if( ( best->con->err != 0 && entry.con->err == 0 ) ||
+                    ( ( best->con->err != 0 ) == ( entry.con->err != 0 ) && entry.pending < best->pending ) )
+                    best = &entry;
+            }
+            ++best->pending;
+            return typename RCluster::SlotConnection( node->first, best->con );
+        }
+        
+        inline void releaseConnection( typename RCluster::SlotConnection conn )
+        {
+            typename ClusterNodes::iterator node = nodes_.find( conn.first );
+            if( node == nodes_.end() )
+                return;
+            for( Entry &entry : *node->second )
+            {
+                if( entry.con == conn.second )
+                {
+                    if( entry.pending > 0 )
+                        --entry.pending;
+                    return;
+                }
+            }
+        }
+        
+        inline void releaseConnection( typename RCluster::HostConnection ) {}
+        
+        // number of replies pending on connections of the node serving the slot
+        unsigned int pending( typename RCluster::SlotIndex index )
+        {
+            typename ClusterNodes::iterator node = DefaultContainer<redisConnection>::searchBySlots( index, nodes_ );
+            unsigned int total = 0;
+            for( const Entry &entry : *node->second )
+                total += entry.pending;
+            return total;
+        }
+        
+        // connection in unknown state (i.e. timed out in the middle of a reply) is freed and
+        // its place in the pool is taken by a new connection to the same node
+        inline void discardConnection( typename RCluster::SlotConnection conn )
+        {
+            for( typename NodesByHost::value_type &host : hosts_ )
+            {
+                for( Entry &entry : *host.second )
+                {
+                    if( entry.con != conn.second )
+                        continue;
+                    
+                    string::size_type colon = host.first.rfind( ':' );
+                    redisConnection* fresh = connect_( host.first.substr( 0, colon ).c_str(),
+                                                       std::stoi( host.first.substr( colon + 1 ) ), data_ );
+                    if( fresh == NULL )
+                        return;
+                    entry.con = fresh;
+                    entry.pending = 0;
+                    if( disconnect_ != NULL )
+                        disconnect_( conn.second );
+                    return;
+                }
+            }
+        }
+        
+        inline void discardConnection( typename RCluster::HostConnection conn )
+        {
+            typename RedirectConnections::iterator found = connections_.find( conn.first );
+            if( found != connections_.end() && found->second == conn.second )
+                connections_.erase( found );
+            if( disconnect_ != NULL && conn.second != NULL )
+                disconnect_( conn.second );
+        }
+        
+        // node losing its last connection stops serving its slots
+        void deleteConnection( const redisConnection* con )
+        {
+            for( typename RedirectConnections::iterator it = connections_.begin(); it != connections_.end(); )
+            {
+                if( it->second == con )
+                    it = connections_.erase( it );
+                else
+                    ++it;
+            }
+            for( typename NodesByHost::iterator it = hosts_.begin(); it != hosts_.end(); )
+            {
+                Node *node = it->second;
+                for( typename Node::iterator entry = node->begin(); entry != node->end(); )
+                {
+                    if( entry->con == con )
+                        entry = node->erase( entry );
+                    else
+                        ++entry;
+                }
+                if( node->empty() )
+                {
+                    eraseNode( node );
+                    it = hosts_.erase( it );
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+        }
+        
+        // puts replacement instead of pooled connection, returns false if it's not pooled
+        bool replaceConnection( const redisConnection* con, redisConnection* replacement )
+        {
+            bool replaced = false;
+            for( typename NodesByHost::value_type &host : hosts_ )
+            {
+                for( Entry &entry : *host.second )
+                {
+                    if( entry.con == con )
+                    {
+                        entry.con = replacement;
+                        entry.pending = 0;
+                        replaced = true;
+                    }
+                }
+            }
+            return replaced;
+        }
+        
+        // connections are taken out of container before they are freed, because disconnect
+        // function can call deleteConnection right away
+        inline
+        void disconnect()
+        {
+            RedirectConnections connections;
+            NodesByHost hosts;
+            connections.swap( connections_ );
+            hosts.swap( hosts_ );
+            nodes_.clear();
+            
+            for( typename RedirectConnections::value_type &conn : connections )
+            {
+                if( disconnect_ != NULL )
+                    disconnect_( conn.second );
+            }
+            for( typename NodesByHost::value_type &host : hosts )
+            {
+                if( disconnect_ != NULL )
+                {
+                    for( Entry &entry : *host.second )
+                        disconnect_( entry.con );
+                }
+                delete host.second;
+            }
+        }
+        
+        void* data_;
+    private:
+        void eraseNode( Node *node )
+        {
+            for( typename ClusterNodes::iterator it = nodes_.begin(); it != nodes_.end(); )
+            {
+                if( it->second == node )
+                    it = nodes_.erase( it );
+                else
+                    ++it;
+            }
+            delete node;
+        }
+        
+        typename RCluster::pt2RedisConnectFunc connect_;
+        typename RCluster::pt2RedisFreeFunc disconnect_;
+        RedirectConnections connections_;
+        ClusterNodes nodes_;
+        NodesByHost hosts_;
+    };
+    
+}
+
+#endif /* defined(__libredisCluster__nodepoolcontainer__) */
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2015, Dmitrii Shinkevich <shinmail at gmail dot com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __libredisCluster__reply__
+#define __libredisCluster__reply__
+
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+
+extern "C"
+{
+#include <hiredis/hiredis.h>
+}
+
+namespace RedisCluster
+{
+    typedef std::shared_ptr<redisReply> Reply;
+
+    // Deep copy of redis reply placed in one memory block. Async callbacks receive
+    // replies owned by hiredis, that are freed right after the callback returns,
+    // so replies must be copied to be used later.
+    class ReplyCopy
+    {
+        static inline size_t align( size_t size )
+        {
+            const size_t a = sizeof(void*);
+            return ( size + a - 1 ) & ~( a - 1 );
+        }
+
+        static size_t blockSize( const redisReply &reply )
+        {
+            size_t size = align( sizeof(redisReply) );
+            if( reply.str != nullptr )
+                size += align( reply.len + 1 );
+            if( reply.element != nullptr )
+            {
+                size += align( reply.elements * sizeof(redisReply*) );
+                for( size_t i = 0; i < reply.elements; ++i )
+                    size += blockSize( *reply.element[i] );
+            }
+            return size;
+        }
+
+        static redisReply* place( const redisReply &reply, char *&cursor )
+        {
+            redisReply *copy = reinterpret_cast<redisReply*>( cursor );
+            cursor += align( sizeof(redisReply) );
+            *copy = reply;
+            if( reply.str != nullptr )
+            {
+                copy->str = cursor;
+                memcpy( copy->str, reply.str, reply.len );
+                copy->str[reply.len] = '\0';
+                cursor += align( reply.len + 1 );
+            }
+            if( reply.element != nullptr )
+            {
+                copy->element = reinterpret_cast<redisReply**>( cursor );
+                cursor += align( reply.elements * sizeof(redisReply*) );
+                for( size_t i = 0; i < reply.elements; ++i )
+                    copy->element[i] = place( *reply.element[i], cursor );
+            }
+            return copy;
+        }
+
+    public:
+        // copy is released by free()
+        static redisReply* copy( const redisReply &reply )
+        {
+            char *block = static_cast<char*>( malloc( blockSize( reply ) ) );
+            if( block == nullptr )
+                throw std::bad_alloc();
+            return place( reply, block );
+        }
+
+        static void release( redisReply *reply )
+        {
+            free( reply );
+        }
+    };
+
+    inline Reply copyReply( const redisReply &reply )
+    {
+        return Reply( ReplyCopy::copy( reply ), ReplyCopy::release );
+    }
+    
+    // error reply made by library itself, text must outlive the reply
+    inline redisReply makeErrorReply( const char *text )
+    {
+        redisReply reply;
+        memset( &reply, 0, sizeof(reply) );
+        reply.type = REDIS_REPLY_ERROR;
+        reply.str = const_cast<char*>( text );
+        reply.len = strlen( text );
+        return reply;
+    }
+}
+
+#endif /* defined(__libredisCluster__reply__) */
@@ -0,0 +1,322 @@
+/*
+ * Copyright (c) 2015, Dmitrii Shinkevich <shinmail at gmail dot com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef __libredisCluster__replyarena__
+#define __libredisCluster__replyarena__
+
+#include <cstdlib>
+#include <cstring>
+
+extern "C"
+{
+#include <hiredis/hiredis.h>
+}
+
+namespace RedisCluster
+{
+    // Reply object functions for hiredis reader placing the whole reply tree (nodes,
+    // strings and element arrays) into a bump arena: a chain of blocks, the first of them
+    // starts with the root node. Large replies (HGETALL, LRANGE...) cost a few allocations
+    // instead of two per element and are released with one walk over the blocks.
+    //
+    // Arena is installed per connection with install(), from then on the reader of the
+    // connection owns the way its replies are freed (see freeFunction). Asynchronous replies
+    // are freed by hiredis through the reader, so nothing else changes. Synchronous Reply
+    // gets the deleter of the connection it was read from. Raw replies returned by
+    // HiredisCommand::Command on arena connections must be released with release(), never
+    // with freeReplyObject().
+    class ReplyArena
+    {
+        struct Block
+        {
+            Block *next;
+            // block where allocation goes on, valid in the first block only
+            Block *tail;
+            char *cursor;
+            char *limit;
+        };
+
+        static const size_t FirstBlockSize = 512;
+        static const size_t MaxBlockSize = 64 * 1024;
+
+        static inline size_t align( size_t size )
+        {
+            const size_t a = sizeof(void*);
+            return ( size + a - 1 ) & ~( a - 1 );
+        }
+
+        static Block* newBlock( size_t size )
+        {
+            char *memory = static_cast<char*>( malloc( size ) );
+            if( memory == nullptr )
+                return nullptr;
+            Block *block = reinterpret_cast<Block*>( memory );
+            block->next = nullptr;
+            block->tail = block;
+            block->cursor = memory + align( sizeof(Block) );
+            block->limit = memory + size;
+            return block;
+        }
+
+        static inline Block* blockOf( const redisReply *root )
+        {
+            return reinterpret_cast<Block*>( reinterpret_cast<char*>( const_cast<redisReply*>( root ) ) -
+                                             align( sizeof(Block) ) );
+        }
+
+        static void* allocate( Block *first, size_t size )
+        {
+            size = align( size );
+            Block *block = first->tail;
+            if( block->cursor + size > block->limit )
+            {
+                // blocks grow with the reply, so huge replies need a few of them
+                size_t blockSize = static_cast<size_t>( block->limit - reinterpret_cast<char*>( block ) ) * 2;
+                if( blockSize > MaxBlockSize )
+                    blockSize = MaxBlockSize;
+                if( blockSize < size + align( sizeof(Block) ) )
+                    blockSize = size + align( sizeof(Block) );
+                Block *next = newBlock( blockSize );
+                if( next == nullptr )
+                    return nullptr;
+                block->next = next;
+                first->tail = next;
+                block = next;
+            }
+            void *memory = block->cursor;
+            block->cursor += size;
+            return memory;
+        }
+
+        static inline bool stringType( int type )
+        {
+            return type == REDIS_REPLY_STRING || type == REDIS_REPLY_STATUS || type == REDIS_REPLY_ERROR
+#ifdef REDIS_REPLY_DOUBLE
+                || type == REDIS_REPLY_DOUBLE || type == REDIS_REPLY_BIGNUM || type == REDIS_REPLY_VERB
+#endif
+                ;
+        }
+
+        // new node of the reply linked to its parent, extra bytes follow the node
+        static redisReply* createNode( const redisReadTask *task, size_t extra, char **tail )
+        {
+            redisReply *reply = nullptr;
+            if( task->parent == nullptr )
+            {
+                Block *first = newBlock( align( sizeof(Block) ) + align( sizeof(redisReply) ) + align( extra ) >
+                                         FirstBlockSize ?
+                                         align( sizeof(Block) ) + align( sizeof(redisReply) ) + align( extra ) :
+                                         FirstBlockSize );
+                if( first == nullptr )
+                    return nullptr;
+                reply = static_cast<redisReply*>( allocate( first, sizeof(redisReply) ) );
+                memset( reply, 0, sizeof(redisReply) );
+                reply->type = task->type;
+            }
+            else
+            {
+                const redisReadTask *root = task;
+                while( root->parent != nullptr )
+                    root = root->parent;
+                reply = static_cast<redisReply*>( allocate( blockOf( static_cast<redisReply*>( root->obj ) ),
+                                                            sizeof(redisReply) ) );
+                if( reply == nullptr )
+                    return nullptr;
+                memset( reply, 0, sizeof(redisReply) );
+                reply->type = task->type;
+                redisReply *parent = static_cast<redisReply*>( task->parent->obj );
+                parent->element[task->idx] = reply;
+            }
+
+            *tail = nullptr;
+            if( extra > 0 )
+            {
+                *tail = static_cast<char*>( allocate( blockOf( rootOf( task, reply ) ), extra ) );
+                if( *tail == nullptr )
+                {
+                    if( task->parent == nullptr )
+                        release( reply );
+                    return nullptr;
+                }
+            }
+            return reply;
+        }
+
+        static redisReply* rootOf( const redisReadTask *task, redisReply *reply )
+        {
+            if( task->parent == nullptr )
+                return reply;
+            while( task->parent != nullptr )
+                task = task->parent;
+            return static_cast<redisReply*>( task->obj );
+        }
+
+        static void* createString( const redisReadTask *task, char *str, size_t len )
+        {
+            char *buffer = nullptr;
+            redisReply *reply = createNode( task, len + 1, &buffer );
+            if( reply == nullptr )
+                return nullptr;
+#ifdef REDIS_REPLY_VERB
+            // verbatim string starts with its three letters type and colon
+            if( task->type == REDIS_REPLY_VERB && len >= 4 )
+            {
+                memcpy( reply->vtype, str, 3 );
+                reply->vtype[3] = '\0';
+                str += 4;
+                len -= 4;
+            }
+#endif
+            memcpy( buffer, str, len );
+            buffer[len] = '\0';
+            reply->str = buffer;
+            reply->len = len;
+            return reply;
+        }
+
+#if defined(HIREDIS_MAJOR) && HIREDIS_MAJOR >= 1
+        static void* createArray( const redisReadTask *task, size_t elements )
+#else
+        static void* createArray( const redisReadTask *task, int elements )
+#endif
+        {
+            char *buffer = nullptr;
+            size_t size = static_cast<size_t>( elements ) * sizeof(redisReply*);
+            redisReply *reply = createNode( task, size, &buffer );
+            if( reply == nullptr )
+                return nullptr;
+            if( elements > 0 )
+            {
+                memset( buffer, 0, size );
+                reply->element = reinterpret_cast<redisReply**>( buffer );
+            }
+            reply->elements = elements;
+            return reply;
+        }
+
+        static void* createInteger( const redisReadTask *task, long long value )
+        {
+            char *buffer = nullptr;
+            redisReply *reply = createNode( task, 0, &buffer );
+            if( reply != nullptr )
+                reply->integer = value;
+            return reply;
+        }
+
+        static void* createNil( const redisReadTask *task )
+        {
+            char *buffer = nullptr;
+            return createNode( task, 0, &buffer );
+        }
+
+#if defined(HIREDIS_MAJOR) && HIREDIS_MAJOR >= 1
+        static void* createDouble( const redisReadTask *task, double value, char *str, size_t len )
+        {
+            redisReply *reply = static_cast<redisReply*>( createString( task, str, len ) );
+            if( reply != nullptr )
+                reply->dval = value;
+            return reply;
+        }
+
+        static void* createBool( const redisReadTask *task, int value )
+        {
+            char *buffer = nullptr;
+            redisReply *reply = createNode( task, 0, &buffer );
+            if( reply != nullptr )
+                reply->integer = value != 0;
+            return reply;
+        }
+#endif
+
+        static void freeObject( void *reply )
+        {
+            release( static_cast<redisReply*>( reply ) );
+        }
+
+    public:
+        typedef void (*FreeFn)( void *reply );
+        
+        static redisReplyObjectFunctions* functions()
+        {
+#if defined(HIREDIS_MAJOR) && HIREDIS_MAJOR >= 1
+            static redisReplyObjectFunctions fn = {
+                createString, createArray, createInteger, createDouble, createNil, createBool, freeObject
+            };
+#else
+            static redisReplyObjectFunctions fn = {
+                createString, createArray, createInteger, createNil, freeObject
+            };
+#endif
+            return &fn;
+        }
+
+        // replies read by the connection are built in arenas from now on
+        static void install( redisContext &con )
+        {
+            if( con.reader != nullptr )
+                con.reader->fn = functions();
+        }
+
+        static bool installed( const redisContext &con )
+        {
+            return con.reader != nullptr && con.reader->fn == functions();
+        }
+
+        // function releasing replies read by the connection: release() for arena
+        // connections, freeReplyObject() for default hiredis ones
+        static FreeFn freeFunction( const redisContext &con )
+        {
+            if( con.reader != nullptr && con.reader->fn != nullptr && con.reader->fn->freeObject != nullptr )
+                return con.reader->fn->freeObject;
+            return freeReplyObject;
+        }
+
+        // frees all blocks of the reply, reply must be the root
+        static void release( redisReply *reply )
+        {
+            if( reply == nullptr )
+                return;
+            Block *block = blockOf( reply );
+            while( block != nullptr )
+            {
+                Block *next = block->next;
+                free( block );
+                block = next;
+            }
+        }
+    };
+
+    // releases reply read by the connection, whether it's built in arena or not
+    inline void freeReply( const redisContext &con, void *reply )
+    {
+        ReplyArena::freeFunction( con )( reply );
+    }
+}
+
+#endif /* defined(__libredisCluster__replyarena__) */
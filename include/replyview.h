@@ -0,0 +1,378 @@
+/*
+ * Copyright (c) 2015, Dmitrii Shinkevich <shinmail at gmail dot com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef __libredisCluster__replyview__
+#define __libredisCluster__replyview__
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+
+extern "C"
+{
+#include <hiredis/hiredis.h>
+}
+
+#include "clusterexception.h"
+#include "reply.h"
+
+namespace RedisCluster
+{
+    // non-owning reference to a string inside of redis reply, it's valid while the reply is
+    class StringView
+    {
+    public:
+        StringView() : data_( nullptr ), size_( 0 ) {}
+        StringView( const char *data, size_t size ) : data_( data ), size_( size ) {}
+
+        inline const char* data() const { return data_; }
+        inline size_t size() const { return size_; }
+        inline bool empty() const { return size_ == 0; }
+        inline const char* begin() const { return data_; }
+        inline const char* end() const { return data_ + size_; }
+        inline char operator[]( size_t i ) const { return data_[i]; }
+
+        // the only copy, when it's really needed
+        inline std::string str() const { return std::string( data_, size_ ); }
+
+        inline bool operator==( const StringView &other ) const
+        {
+            return size_ == other.size_ && ( size_ == 0 || memcmp( data_, other.data_, size_ ) == 0 );
+        }
+        inline bool operator!=( const StringView &other ) const { return !( *this == other ); }
+        inline bool operator==( const char *other ) const { return *this == StringView( other, strlen( other ) ); }
+        inline bool operator==( const std::string &other ) const { return *this == StringView( other.data(), other.size() ); }
+
+#if __cplusplus >= 201703L
+        inline operator std::string_view() const { return std::string_view( data_, size_ ); }
+#endif
+
+    private:
+        const char *data_;
+        size_t size_;
+    };
+
+    // Typed non-owning view of redis reply. Strings are accessed in place, integers are
+    // converted with range checks and arrays are iterated without copies. Type mismatch
+    // throws ReplyTypeException. The view is valid while the reply is: in async callback
+    // it's until the callback returns, for synchronous commands while Reply is kept.
+    //
+    //     Reply reply = HiredisCommand<>::AltCommand( cluster_p, "FOO", "HGETALL %s", "FOO" );
+    //     std::map<std::string, long long> counters;
+    //     ReplyView( reply ).pairsTo( counters );
+    //
+    // Asynchronous callback can take the view straight away:
+    //
+    //     AsyncHiredisCommand<>::Command( cluster_p, "FOO", []( ReplyView view ) { ... }, "GET %s", "FOO" );
+    class ReplyView
+    {
+    public:
+        class Iterator
+        {
+        public:
+            typedef std::random_access_iterator_tag iterator_category;
+            typedef ReplyView value_type;
+            typedef ptrdiff_t difference_type;
+            typedef void pointer;
+            typedef ReplyView reference;
+
+            explicit Iterator( redisReply **element = nullptr ) : element_( element ) {}
+
+            inline ReplyView operator*() const { return ReplyView( *element_ ); }
+            inline ReplyView operator[]( ptrdiff_t n ) const { return ReplyView( element_[n] ); }
+            inline Iterator& operator++() { ++element_; return *this; }
+            inline Iterator operator++( int ) { Iterator it( *this ); ++element_; return it; }
+            inline Iterator& operator--() { --element_; return *this; }
+            inline Iterator operator--( int ) { Iterator it( *this ); --element_; return it; }
+            inline Iterator& operator+=( ptrdiff_t n ) { element_ += n; return *this; }
+            inline Iterator& operator-=( ptrdiff_t n ) { element_ -= n; return *this; }
+            inline Iterator operator+( ptrdiff_t n ) const { return Iterator( element_ + n ); }
+            inline Iterator operator-( ptrdiff_t n ) const { return Iterator( element_ - n ); }
+            friend inline Iterator operator+( ptrdiff_t n, const Iterator &it ) { return it + n; }
+            inline ptrdiff_t operator-( const Iterator &other ) const { return element_ - other.element_; }
+            inline bool operator==( const Iterator &other ) const { return element_ == other.element_; }
+            inline bool operator!=( const Iterator &other ) const { return element_ != other.element_; }
+            inline bool operator<( const Iterator &other ) const { return element_ < other.element_; }
+            inline bool operator>( const Iterator &other ) const { return element_ > other.element_; }
+            inline bool operator<=( const Iterator &other ) const { return element_ <= other.element_; }
+            inline bool operator>=( const Iterator &other ) const { return element_ >= other.element_; }
+
+        private:
+            redisReply **element_;
+        };
+
+        ReplyView( const redisReply &reply ) : reply_( &reply ) {}
+        ReplyView( const redisReply *reply ) : reply_( reply )
+        {
+            if( reply == nullptr )
+                throw InvalidArgument(nullptr);
+        }
+        ReplyView( const Reply &reply ) : reply_( reply.get() )
+        {
+            if( reply_ == nullptr )
+                throw InvalidArgument(nullptr);
+        }
+
+        inline int type() const { return reply_->type; }
+        inline const redisReply& reply() const { return *reply_; }
+
+        inline bool isNil() const { return reply_->type == REDIS_REPLY_NIL; }
+        inline bool isError() const { return reply_->type == REDIS_REPLY_ERROR; }
+        inline bool isStatus() const { return reply_->type == REDIS_REPLY_STATUS; }
+        inline bool isInteger() const { return reply_->type == REDIS_REPLY_INTEGER; }
+        inline bool isString() const { return reply_->type == REDIS_REPLY_STRING; }
+        inline bool isArray() const
+        {
+            return reply_->type == REDIS_REPLY_ARRAY
+#ifdef REDIS_REPLY_MAP
+                || reply_->type == REDIS_REPLY_MAP || reply_->type == REDIS_REPLY_SET
+                || reply_->type == REDIS_REPLY_PUSH
+#endif
+                ;
+        }
+
+#ifdef REDIS_REPLY_MAP
+        // RESP3 types, maps and sets are arrays too (map elements are keys and values in turn)
+        inline bool isMap() const { return reply_->type == REDIS_REPLY_MAP; }
+        inline bool isSet() const { return reply_->type == REDIS_REPLY_SET; }
+        inline bool isPush() const { return reply_->type == REDIS_REPLY_PUSH; }
+        inline bool isDouble() const { return reply_->type == REDIS_REPLY_DOUBLE; }
+        inline bool isBool() const { return reply_->type == REDIS_REPLY_BOOL; }
+
+        bool boolean() const
+        {
+            if( reply_->type == REDIS_REPLY_BOOL || reply_->type == REDIS_REPLY_INTEGER )
+                return reply_->integer != 0;
+            throw ReplyTypeException( reply_->type, "boolean" );
+        }
+#endif
+
+        // RESP3 double, integer or string holding a number (RESP2 ZSCORE, INCRBYFLOAT)
+        double real() const
+        {
+#ifdef REDIS_REPLY_DOUBLE
+            if( reply_->type == REDIS_REPLY_DOUBLE )
+                return reply_->dval;
+#endif
+            if( reply_->type == REDIS_REPLY_INTEGER )
+                return static_cast<double>( reply_->integer );
+            if( reply_->type == REDIS_REPLY_STRING || reply_->type == REDIS_REPLY_STATUS )
+            {
+                char buffer[64];
+                if( reply_->len > 0 && reply_->len < sizeof( buffer ) )
+                {
+                    memcpy( buffer, reply_->str, reply_->len );
+                    buffer[reply_->len] = '\0';
+                    char *end = nullptr;
+                    errno = 0;
+                    double value = strtod( buffer, &end );
+                    if( errno == 0 && end == buffer + reply_->len )
+                        return value;
+                }
+            }
+            throw ReplyTypeException( reply_->type, "double" );
+        }
+
+        // text of string, status, error (and RESP3 verbatim, double and big number) replies
+        StringView str() const
+        {
+            if( reply_->str == nullptr || isArray() )
+                throw ReplyTypeException( reply_->type, "string" );
+            return StringView( reply_->str, reply_->len );
+        }
+
+        // text of error reply, throws if reply is not an error
+        StringView error() const
+        {
+            if( !isError() )
+                throw ReplyTypeException( reply_->type, "error" );
+            return StringView( reply_->str, reply_->len );
+        }
+
+        // integer reply or string holding a decimal number, converted to T with range check
+        template <typename T = long long>
+        T integer() const
+        {
+            static_assert( std::is_integral<T>::value, "integral type is required" );
+            if( reply_->type == REDIS_REPLY_INTEGER
+#ifdef REDIS_REPLY_BOOL
+               || reply_->type == REDIS_REPLY_BOOL
+#endif
+               )
+                return narrow<T>( reply_->integer );
+            if( reply_->type == REDIS_REPLY_STRING || reply_->type == REDIS_REPLY_STATUS )
+                return parse<T>( reply_->str, reply_->len );
+            throw ReplyTypeException( reply_->type, "integer" );
+        }
+
+        // number of elements of array reply, nil array has no elements
+        size_t size() const
+        {
+            if( isNil() )
+                return 0;
+            if( !isArray() )
+                throw ReplyTypeException( reply_->type, "array" );
+            return reply_->elements;
+        }
+
+        ReplyView operator[]( size_t i ) const
+        {
+            if( i >= size() )
+                throw ReplyTypeException( reply_->type, "array with more elements" );
+            return ReplyView( *reply_->element[i] );
+        }
+
+        inline Iterator begin() const { return Iterator( size() ? reply_->element : nullptr ); }
+        inline Iterator end() const { return begin() + static_cast<ptrdiff_t>( size() ); }
+
+        // value of the reply converted to the type: StringView, std::string, integral types,
+        // double or ReplyView itself
+        template <typename T>
+        T as() const
+        {
+            return Converter<T>::convert( *this );
+        }
+
+        // appends elements of array reply converted to the value type of container
+        // (vector, list, deque, set...), i.e. for MGET, LRANGE, SMEMBERS
+        template <typename Container>
+        void appendTo( Container &out ) const
+        {
+            for( Iterator it = begin(), last = end(); it != last; ++it )
+                out.insert( out.end(), ( *it ).as<typename Container::value_type>() );
+        }
+
+        // inserts key and value pairs of flat array (HGETALL, CONFIG GET) or RESP3 map
+        // reply converted to the key and mapped types of container
+        template <typename Map>
+        void pairsTo( Map &out ) const
+        {
+            size_t count = size();
+            if( count % 2 != 0 )
+                throw ReplyTypeException( reply_->type, "array of pairs" );
+            for( size_t i = 0; i < count; i += 2 )
+            {
+                out.insert( out.end(), typename Map::value_type(
+                    ReplyView( *reply_->element[i] ).as<typename Map::key_type>(),
+                    ReplyView( *reply_->element[i + 1] ).as<typename Map::mapped_type>() ) );
+            }
+        }
+
+    private:
+        template <typename T, typename Enable = void>
+        struct Converter
+        {
+            static T convert( const ReplyView &view ) { return view.integer<T>(); }
+        };
+
+        template <typename T, typename From>
+        static T narrow( From value )
+        {
+            if( ( std::is_unsigned<T>::value && value < 0 ) ||
+                ( value > 0 && static_cast<unsigned long long>( value ) >
+                  static_cast<unsigned long long>( std::numeric_limits<T>::max() ) ) ||
+                ( !std::is_unsigned<T>::value && value < 0 &&
+                  static_cast<long long>( value ) < static_cast<long long>( std::numeric_limits<T>::min() ) ) )
+                throw ReplyTypeException( REDIS_REPLY_INTEGER, "integer in range" );
+            return static_cast<T>( value );
+        }
+
+        // whole string must be a number, unlike atoi
+        template <typename T>
+        static T parse( const char *str, size_t len )
+        {
+            char buffer[32];
+            if( len == 0 || len >= sizeof( buffer ) )
+                throw ReplyTypeException( REDIS_REPLY_STRING, "integer" );
+            memcpy( buffer, str, len );
+            buffer[len] = '\0';
+
+            char *end = nullptr;
+            errno = 0;
+            if( std::is_unsigned<T>::value )
+            {
+                if( buffer[0] == '-' )
+                    throw ReplyTypeException( REDIS_REPLY_STRING, "integer in range" );
+                unsigned long long value = strtoull( buffer, &end, 10 );
+                if( errno != 0 || end != buffer + len )
+                    throw ReplyTypeException( REDIS_REPLY_STRING, "integer" );
+                return narrow<T>( value );
+            }
+            long long value = strtoll( buffer, &end, 10 );
+            if( errno != 0 || end != buffer + len )
+                throw ReplyTypeException( REDIS_REPLY_STRING, "integer" );
+            return narrow<T>( value );
+        }
+
+        const redisReply *reply_;
+    };
+
+    template <>
+    struct ReplyView::Converter<StringView>
+    {
+        static StringView convert( const ReplyView &view ) { return view.str(); }
+    };
+
+    template <>
+    struct ReplyView::Converter<std::string>
+    {
+        static std::string convert( const ReplyView &view ) { return view.str().str(); }
+    };
+
+    template <>
+    struct ReplyView::Converter<double>
+    {
+        static double convert( const ReplyView &view ) { return view.real(); }
+    };
+
+    template <>
+    struct ReplyView::Converter<ReplyView>
+    {
+        static ReplyView convert( const ReplyView &view ) { return view; }
+    };
+
+#if __cplusplus >= 201703L
+    template <>
+    struct ReplyView::Converter<std::string_view>
+    {
+        static std::string_view convert( const ReplyView &view ) { return view.str(); }
+    };
+#endif
+}
+
+#endif /* defined(__libredisCluster__replyview__) */
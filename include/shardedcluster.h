@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2015, Dmitrii Shinkevich <shinmail at gmail dot com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __libredisCluster__shardedcluster__
+#define __libredisCluster__shardedcluster__
+
+#include <atomic>
+#include <cstdarg>
+#include <future>
+#include <vector>
+
+#include "adapters/adapter.h"  // for Adapter
+#include "asyncdispatcher.h"
+#include "asynchirediscommand.h"
+#include "slothash.h"
+
+namespace RedisCluster
+{
+    // Asynchronous cluster spread over several event loops, usually one loop per core each
+    // running in its own thread. Every loop (shard) has its own cluster object with its own
+    // connections to every node, all of them built from one "CLUSTER SLOTS" reply. Routing
+    // table is not shared between shards: each cluster updates its slots on MOVED from its
+    // own loop thread, a shared one would need a lock on every command. Commands can be
+    // submitted from any thread and are routed to a shard either by key slot (commands for
+    // one key keep their order) or by submitting thread (each thread sticks to one loop).
+    //
+    // Sharded cluster must be created before the loops are started and destroyed after they
+    // are finished. Call disconnect() from any thread to close connections of all shards.
+    template < typename Cluster = Cluster<redisAsyncContext> >
+    class ShardedAsyncCluster
+    {
+        typedef AsyncHiredisCommand<Cluster> AsyncCommand;
+
+        ShardedAsyncCluster(const ShardedAsyncCluster&) = delete;
+        ShardedAsyncCluster& operator=(const ShardedAsyncCluster&) = delete;
+
+        struct Shard
+        {
+            Shard(const Shard&) = delete;
+            Shard& operator=(const Shard&) = delete;
+
+            Shard( typename Cluster::ptr_t cluster_p, Adapter &adapter ) :
+            cluster_p( cluster_p ),
+            adapter( adapter ),
+            dispatcher( cluster_p, adapter )
+            {
+            }
+
+            ~Shard()
+            {
+                delete cluster_p;
+            }
+
+            typename Cluster::ptr_t cluster_p;
+            Adapter &adapter;
+            AsyncDispatcher<Cluster> dispatcher;
+        };
+
+    public:
+        enum Routing
+        {
+            // shard is chosen by key slot, commands for the same key keep their order
+            BY_SLOT,
+            // every submitting thread sticks to one shard
+            BY_THREAD
+        };
+
+        typedef typename AsyncDispatcher<Cluster>::Completion Completion;
+
+        // adapters of the event loops, one shard is created per adapter
+        ShardedAsyncCluster( const char *host,
+                            int port,
+                            const std::vector<Adapter*> &adapters,
+                            Routing routing = BY_SLOT,
+                            const typename AsyncCommand::Options &options = typename AsyncCommand::Options(),
+                            const struct timeval &timeout = { 3, 0 } ) :
+        shards_(),
+        routing_( routing )
+        {
+            if( adapters.empty() )
+                throw InvalidArgument(nullptr);
+
+            redisContext *con = redisConnectWithTimeout( host, port, timeout );
+            if( con == NULL || con->err )
+                throw ConnectionFailedException(nullptr);
+
+            redisReply *reply = static_cast<redisReply*>( redisCommand( con, Cluster::CmdInit() ) );
+            redisFree( con );
+            HiredisProcess::checkCritical( reply, true );
+            try
+            {
+                shards_.reserve( adapters.size() );
+                for( Adapter *adapter : adapters )
+                {
+                    typename Cluster::ptr_t cluster_p = AsyncCommand::createCluster( reply, *adapter, options );
+                    try
+                    {
+                        shards_.push_back( new Shard( cluster_p, *adapter ) );
+                    }
+                    catch( ... )
+                    {
+                        delete cluster_p;
+                        throw;
+                    }
+                }
+            }
+            catch( ... )
+            {
+                // createCluster never frees the reply, it's ours in every case
+                freeReplyObject( reply );
+                clear();
+                throw;
+            }
+            freeReplyObject( reply );
+        }
+
+        ~ShardedAsyncCluster()
+        {
+            clear();
+        }
+
+        inline size_t size() const
+        {
+            return shards_.size();
+        }
+
+        // cluster of the shard, must be used only from the thread of its event loop
+        inline typename Cluster::ptr_t cluster( size_t index ) const
+        {
+            return shards_.at( index )->cluster_p;
+        }
+
+        // thread safe dispatcher of the shard chosen for the key
+        inline AsyncDispatcher<Cluster>& dispatcher( const string &key )
+        {
+            return shards_[ route( key ) ]->dispatcher;
+        }
+
+        // user error handler for commands of all shards, is called in shard loop thread
+        void setUserErrorCb( typename AsyncCommand::userErrorCallbackFn *userErrorCb )
+        {
+            for( Shard *shard : shards_ )
+                shard->dispatcher.setUserErrorCb( userErrorCb );
+        }
+
+        // thread safe submission, completion is invoked in the loop thread of the shard
+        void Command( const string &key, const Completion &completion, const char *format, ... )
+        {
+            va_list ap;
+            va_start( ap, format );
+            try
+            {
+                dispatcher( key ).Command( key, completion, format, ap );
+            }
+            catch( ... )
+            {
+                va_end( ap );
+                throw;
+            }
+            va_end( ap );
+        }
+
+        void Command( const string &key, const Completion &completion,
+                     int argc, const char ** argv, const size_t *argvlen )
+        {
+            dispatcher( key ).Command( key, completion, argc, argv, argvlen );
+        }
+
+        std::future<Reply> Command( const string &key, const char *format, ... )
+        {
+            va_list ap;
+            va_start( ap, format );
+            std::future<Reply> future;
+            try
+            {
+                future = dispatcher( key ).Command( key, format, ap );
+            }
+            catch( ... )
+            {
+                va_end( ap );
+                throw;
+            }
+            va_end( ap );
+            return future;
+        }
+
+        std::future<Reply> Command( const string &key, int argc, const char ** argv, const size_t *argvlen )
+        {
+            return dispatcher( key ).Command( key, argc, argv, argvlen );
+        }
+
+        // thread safe, closes connections of every shard in its own loop thread
+        // so the loops can finish
+        void disconnect()
+        {
+            for( Shard *shard : shards_ )
+            {
+                if( shard->adapter.post( disconnectShard, shard->cluster_p ) != REDIS_OK )
+                    throw LogicError(nullptr, "adapter doesn't support posting from other threads");
+            }
+        }
+
+    private:
+        size_t route( const string &key ) const
+        {
+            if( routing_ == BY_THREAD )
+            {
+                static std::atomic<unsigned int> threads( 0 );
+                static thread_local unsigned int thread = threads.fetch_add( 1, std::memory_order_relaxed );
+                return thread % shards_.size();
+            }
+            return SlotHash::SlotByKey( key.c_str(), key.length() ) % shards_.size();
+        }
+
+        static void disconnectShard( void *data )
+        {
+            static_cast<typename Cluster::ptr_t>( data )->disconnect();
+        }
+
+        void clear()
+        {
+            for( Shard *shard : shards_ )
+                delete shard;
+            shards_.clear();
+        }
+
+        std::vector<Shard*> shards_;
+        Routing routing_;
+    };
+}
+
+#endif /* defined(__libredisCluster__shardedcluster__) */
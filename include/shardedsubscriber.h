@@ -0,0 +1,656 @@
+/*
+ * Copyright (c) 2015, Dmitrii Shinkevich <shinmail at gmail dot com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef __libredisCluster__shardedsubscriber__
+#define __libredisCluster__shardedsubscriber__
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "adapters/adapter.h"  // for Adapter
+#include "asynchirediscommand.h"
+#include "inlinefunction.h"
+
+extern "C"
+{
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+}
+
+namespace RedisCluster
+{
+    using std::string;
+    
+    // Sharded Pub/Sub (Redis 7 SSUBSCRIBE) for asynchronous cluster. Channels are routed by
+    // their slot like keys, every node serving subscribed channels gets one dedicated connection
+    // of the subscriber, cluster connections are never switched to subscribed mode. Messages go
+    // straight from hiredis to the channel callback, nothing is allocated per message.
+    //
+    // Subscriptions follow topology changes: when the node drops a channel (its slot migrated),
+    // answers with an error (i.e. MOVED) or the connection is lost (failover), slot map is
+    // fetched again with CLUSTER SLOTS through the cluster and channels are subscribed on their
+    // new nodes. Subscription not confirmed within two retry intervals is sent again. Messages
+    // published while a channel is moving are lost, as Pub/Sub doesn't keep them.
+    //
+    //     ShardedSubscriber<> subscriber( cluster_p, adapter );
+    //     subscriber.subscribe( "orders:{eu}", []( const ShardedSubscriber<>::Message &message )
+    //     {
+    //         cout << string( message.data, message.len ) << endl;
+    //     } );
+    //     AsyncHiredisCommand<>::Command( cluster_p, "orders:{eu}", callback, "SPUBLISH %s %s", "orders:{eu}", "1" );
+    //
+    // It's not thread safe and is used from the event loop thread like the cluster, it must not
+    // be destroyed from its callbacks. Adapter must support Adapter::runAfter, hiredis must be
+    // 1.1 or newer (it knows SSUBSCRIBE since then).
+    template < typename Cluster = Cluster<redisAsyncContext> >
+    class ShardedSubscriber
+    {
+        typedef AsyncHiredisCommand<Cluster> AsyncCommand;
+        typedef typename Cluster::SlotIndex SlotIndex;
+        typedef typename Cluster::SlotRange SlotRange;
+        typedef std::map<SlotRange, string, typename Cluster::SlotComparator> SlotOwners;
+        
+        ShardedSubscriber(const ShardedSubscriber&) = delete;
+        ShardedSubscriber& operator=(const ShardedSubscriber&) = delete;
+        
+    public:
+        
+        // channel and payload point to the reply owned by hiredis, they are valid while the
+        // callback runs
+        struct Message
+        {
+            const char *channel;
+            size_t channelLen;
+            const char *data;
+            size_t len;
+        };
+        
+        typedef InlineFunction<void (const Message& message)> MessageCallback;
+        
+        struct Options
+        {
+            Options() :
+            retryInterval{ 0, 500000 }
+            {}
+            
+            // period of resubscribing channels which lost their node
+            struct timeval retryInterval;
+        };
+        
+        struct Stats
+        {
+            uint64_t messages;
+            // channels subscribed again after topology change or lost connection
+            uint64_t resubscribes;
+            // slot map updates
+            uint64_t refreshes;
+            // lost node connections
+            uint64_t disconnects;
+            // error replies to SSUBSCRIBE
+            uint64_t errors;
+            // subscribed channels, the ones waiting for node included
+            size_t channels;
+            // nodes connected
+            size_t nodes;
+        };
+        
+    private:
+        
+        struct Node
+        {
+            ShardedSubscriber *owner;
+            string address;
+            redisAsyncContext *con;
+        };
+        
+        struct Subscription
+        {
+            Subscription( ShardedSubscriber *owner, const string &channel, const MessageCallback &callback ) :
+            owner( owner ),
+            channel( channel ),
+            slot( SlotHash::SlotByKey( channel.c_str(), channel.length() ) ),
+            callback( callback ),
+            node( nullptr ),
+            confirmed( false ),
+            removed( false ),
+            age( 0 ),
+            cons()
+            {}
+            
+            Subscription( const Subscription& ) = delete;
+            Subscription& operator=( const Subscription& ) = delete;
+            
+            ShardedSubscriber *owner;
+            string channel;
+            SlotIndex slot;
+            MessageCallback callback;
+            // node the channel is subscribed on, nullptr while it waits for (re)subscription
+            Node *node;
+            bool confirmed;
+            // unsubscribed, kept until hiredis forgets it
+            bool removed;
+            // retry ticks passed without confirmation
+            unsigned age;
+            // connections which can invoke the callback with this subscription, hiredis
+            // keeps it until SUNSUBSCRIBE reply or disconnection
+            std::vector<const redisAsyncContext*> cons;
+        };
+        
+        // retry timer and CLUSTER SLOTS callback outlive subscriber, they are detached then
+        struct Tick
+        {
+            ShardedSubscriber *owner;
+        };
+        
+        struct Refresh
+        {
+            ShardedSubscriber *owner;
+        };
+        
+        typedef std::map<string, Subscription*> Subscriptions;
+        typedef std::map<string, Node*> Nodes;
+        
+    public:
+        
+        ShardedSubscriber( typename Cluster::ptr_t cluster_p, Adapter &adapter, const Options &options = Options() ) :
+        cluster_p_( cluster_p ),
+        adapter_( adapter ),
+        options_( options ),
+        subscriptions_(),
+        nodes_(),
+        owners_(),
+        tick_( nullptr ),
+        refresh_( nullptr ),
+        refreshCount_( 0 ),
+        closing_( false ),
+        stats_()
+        {
+#if !defined(HIREDIS_MAJOR) || HIREDIS_MAJOR < 1 || ( HIREDIS_MAJOR == 1 && HIREDIS_MINOR < 1 )
+            throw LogicError(nullptr, "sharded Pub/Sub requires hiredis 1.1 or newer");
+#endif
+            if( cluster_p_ == nullptr )
+                throw InvalidArgument(nullptr);
+            tick_ = new Tick{ this };
+            if( adapter_.runAfter( options_.retryInterval, onTick, tick_ ) != REDIS_OK )
+            {
+                delete tick_;
+                tick_ = nullptr;
+                throw LogicError(nullptr, "adapter doesn't support runAfter");
+            }
+        }
+        
+        // connections are freed right away, hiredis runs callbacks with null replies then
+        ~ShardedSubscriber()
+        {
+            closing_ = true;
+            if( tick_ != nullptr )
+                tick_->owner = nullptr;
+            if( refresh_ != nullptr )
+                refresh_->owner = nullptr;
+            for( typename Nodes::value_type &node : nodes_ )
+            {
+                if( node.second->con != nullptr )
+                    redisAsyncFree( node.second->con );
+                delete node.second;
+            }
+            for( typename Subscriptions::value_type &subscription : subscriptions_ )
+                delete subscription.second;
+        }
+        
+        // subscribes the channel or replaces callback of subscribed one
+        void subscribe( const string &channel, const MessageCallback &callback )
+        {
+            typename Subscriptions::iterator found = subscriptions_.find( channel );
+            if( found != subscriptions_.end() )
+            {
+                // unsubscribed channel which is still known to hiredis is taken back, its
+                // SUNSUBSCRIBE reply makes it subscribed again
+                found->second->callback = callback;
+                found->second->removed = false;
+                return;
+            }
+            
+            Subscription *subscription = new Subscription( this, channel, callback );
+            subscriptions_.insert( typename Subscriptions::value_type( channel, subscription ) );
+            send( subscription );
+        }
+        
+        void unsubscribe( const string &channel )
+        {
+            typename Subscriptions::iterator found = subscriptions_.find( channel );
+            if( found == subscriptions_.end() || found->second->removed )
+                return;
+            
+            Subscription *subscription = found->second;
+            subscription->removed = true;
+            subscription->callback = nullptr;
+            if( subscription->node != nullptr &&
+                redisAsyncCommand( subscription->node->con, nullptr, nullptr, "SUNSUBSCRIBE %b",
+                                   channel.data(), channel.size() ) != REDIS_OK )
+            {
+                subscription->node = nullptr;
+            }
+            release( subscription );
+        }
+        
+        Stats stats() const
+        {
+            Stats stats = stats_;
+            for( const typename Subscriptions::value_type &subscription : subscriptions_ )
+            {
+                if( !subscription.second->removed )
+                    ++stats.channels;
+            }
+            for( const typename Nodes::value_type &node : nodes_ )
+            {
+                if( node.second->con != nullptr )
+                    ++stats.nodes;
+            }
+            return stats;
+        }
+        
+    private:
+        
+        // address of the node serving the slot, slot map of cluster is used until the
+        // subscriber fetches its own one
+        string ownerOf( SlotIndex slot )
+        {
+            if( !owners_.empty() )
+            {
+                try
+                {
+                    return DefaultContainer<redisAsyncContext>::searchBySlots( slot, owners_ )->second;
+                }
+                catch( const NodeSearchException & )
+                {
+                }
+            }
+            return cluster_p_->hosts( slot ).front();
+        }
+        
+        Node* connect( const string &address )
+        {
+            Node *&node = nodes_[address];
+            if( node == nullptr )
+                node = new Node{ this, address, nullptr };
+            if( node->con != nullptr )
+                return node;
+            
+            string::size_type colon = address.rfind( ':' );
+            redisAsyncContext *con = redisAsyncConnect( address.substr( 0, colon ).c_str(),
+                                                        std::stoi( address.substr( colon + 1 ) ) );
+            if( con == nullptr )
+                return nullptr;
+            if( con->err != 0 || adapter_.attachContext( *con ) != REDIS_OK )
+            {
+                redisAsyncFree( con );
+                return nullptr;
+            }
+            con->data = static_cast<void*>( node );
+            redisAsyncSetConnectCallback( con, connectCb );
+            redisAsyncSetDisconnectCallback( con, disconnectCb );
+            node->con = con;
+            return node;
+        }
+        
+        // sends SSUBSCRIBE to the node serving the channel, channel waits for the next retry
+        // if the node can't be reached
+        void send( Subscription *subscription )
+        {
+            Node *node = nullptr;
+            try
+            {
+                node = connect( ownerOf( subscription->slot ) );
+            }
+            catch( const ClusterException & )
+            {
+            }
+            catch( const std::logic_error & )
+            {
+                // malformed address
+            }
+            if( node == nullptr )
+                return;
+            
+            if( redisAsyncCommand( node->con, onReply, subscription, "SSUBSCRIBE %b",
+                                   subscription->channel.data(), subscription->channel.size() ) != REDIS_OK )
+                return;
+            
+            subscription->node = node;
+            subscription->confirmed = false;
+            subscription->age = 0;
+            if( std::find( subscription->cons.begin(), subscription->cons.end(), node->con ) == subscription->cons.end() )
+                subscription->cons.push_back( node->con );
+        }
+        
+        // subscription goes to its current owner, SUNSUBSCRIBE is sent to the old node
+        void resubscribe( Subscription *subscription )
+        {
+            Node *node = subscription->node;
+            if( node != nullptr )
+            {
+                redisAsyncCommand( node->con, nullptr, nullptr, "SUNSUBSCRIBE %b",
+                                   subscription->channel.data(), subscription->channel.size() );
+                subscription->node = nullptr;
+            }
+            ++stats_.resubscribes;
+            send( subscription );
+        }
+        
+        // channels waiting for node and the ones served by wrong node are subscribed again
+        void rebalance()
+        {
+            for( typename Subscriptions::value_type &entry : subscriptions_ )
+            {
+                Subscription *subscription = entry.second;
+                if( subscription->removed )
+                    continue;
+                if( subscription->node == nullptr )
+                {
+                    ++stats_.resubscribes;
+                    send( subscription );
+                    continue;
+                }
+                try
+                {
+                    if( subscription->node->address != ownerOf( subscription->slot ) )
+                        resubscribe( subscription );
+                }
+                catch( const ClusterException & )
+                {
+                }
+            }
+        }
+        
+        // channel lost its node, slot map is fetched again before it's subscribed
+        void detach( Subscription *subscription )
+        {
+            subscription->node = nullptr;
+            subscription->confirmed = false;
+            refresh();
+        }
+        
+        // CLUSTER SLOTS is sent through cluster connections, subscribed ones can't run it. Key
+        // is taken from different channel every time, so the request doesn't stick to a dead node
+        void refresh()
+        {
+            if( refresh_ != nullptr || subscriptions_.empty() )
+                return;
+            
+            typename Subscriptions::iterator it = subscriptions_.begin();
+            std::advance( it, refreshCount_++ % subscriptions_.size() );
+            Refresh *refresh = new Refresh{ this };
+            refresh_ = refresh;
+            try
+            {
+                AsyncCommand::Command( cluster_p_, it->first, [refresh]( const redisReply &reply )
+                {
+                    ShardedSubscriber *owner = refresh->owner;
+                    delete refresh;
+                    if( owner != nullptr )
+                    {
+                        owner->refresh_ = nullptr;
+                        owner->refreshed( reply );
+                    }
+                }, "CLUSTER SLOTS" );
+            }
+            catch( const ClusterException & )
+            {
+                // callback isn't invoked if command isn't sent
+                if( refresh_ == refresh )
+                {
+                    refresh_ = nullptr;
+                    delete refresh;
+                }
+            }
+        }
+        
+        void refreshed( const redisReply &reply )
+        {
+            if( reply.type != REDIS_REPLY_ARRAY )
+                return;
+            
+            SlotOwners owners;
+            for( size_t i = 0; i < reply.elements; ++i )
+            {
+                const redisReply *range = reply.element[i];
+                if( range->type == REDIS_REPLY_ARRAY && range->elements >= 3 &&
+                   range->element[0]->type == REDIS_REPLY_INTEGER &&
+                   range->element[1]->type == REDIS_REPLY_INTEGER &&
+                   range->element[2]->type == REDIS_REPLY_ARRAY && range->element[2]->elements >= 2 &&
+                   range->element[2]->element[0]->type == REDIS_REPLY_STRING &&
+                   range->element[2]->element[1]->type == REDIS_REPLY_INTEGER )
+                {
+                    SlotRange slots( static_cast<SlotIndex>( range->element[0]->integer ),
+                                     static_cast<SlotIndex>( range->element[1]->integer ) );
+                    owners[slots] = string( range->element[2]->element[0]->str, range->element[2]->element[0]->len ) +
+                        ":" + std::to_string( range->element[2]->element[1]->integer );
+                }
+            }
+            if( owners.empty() )
+                return;
+            owners_.swap( owners );
+            ++stats_.refreshes;
+            rebalance();
+        }
+        
+        // unsubscribed channel is deleted when no connection can invoke its callback
+        void release( Subscription *subscription )
+        {
+            if( !subscription->removed || !subscription->cons.empty() )
+                return;
+            if( subscription->node == nullptr )
+            {
+                subscriptions_.erase( subscription->channel );
+                delete subscription;
+            }
+        }
+        
+        void forget( Subscription *subscription, const redisAsyncContext *con )
+        {
+            subscription->cons.erase( std::remove( subscription->cons.begin(), subscription->cons.end(), con ),
+                                      subscription->cons.end() );
+        }
+        
+        // node connection is gone (or failed to connect), hiredis has run its callbacks already
+        void lost( Node *node, const redisAsyncContext *con )
+        {
+            if( node->con != con )
+                return;
+            node->con = nullptr;
+            ++stats_.disconnects;
+            
+            std::vector<Subscription*> released;
+            bool detached = false;
+            for( typename Subscriptions::value_type &entry : subscriptions_ )
+            {
+                Subscription *subscription = entry.second;
+                forget( subscription, con );
+                if( subscription->node == node )
+                {
+                    subscription->node = nullptr;
+                    subscription->confirmed = false;
+                    detached = detached || !subscription->removed;
+                }
+                if( subscription->removed )
+                    released.push_back( subscription );
+            }
+            for( Subscription *subscription : released )
+                release( subscription );
+            if( detached )
+                refresh();
+        }
+        
+        static inline bool is( const redisReply *reply, const char *kind )
+        {
+            size_t len = strlen( kind );
+            return reply->type == REDIS_REPLY_STRING && reply->len == len && memcmp( reply->str, kind, len ) == 0;
+        }
+        
+        static void onReply( redisAsyncContext *con, void *r, void *data )
+        {
+            Subscription *subscription = static_cast<Subscription*>( data );
+            ShardedSubscriber *owner = subscription->owner;
+            redisReply *reply = static_cast<redisReply*>( r );
+            if( reply == nullptr || owner->closing_ )
+                return;
+            
+            // messages of the channel from the node it was moved from are dropped
+            bool current = subscription->node != nullptr && subscription->node->con == con;
+            if( reply->type == REDIS_REPLY_ERROR )
+            {
+                ++owner->stats_.errors;
+                if( current )
+                    owner->detach( subscription );
+                return;
+            }
+            
+            bool array = reply->type == REDIS_REPLY_ARRAY;
+#ifdef REDIS_REPLY_PUSH
+            array = array || reply->type == REDIS_REPLY_PUSH;
+#endif
+            if( !array || reply->elements < 3 )
+                return;
+            
+            const redisReply *kind = reply->element[0];
+            if( is( kind, "smessage" ) )
+            {
+                if( !current || subscription->removed || !subscription->callback )
+                    return;
+                const redisReply *channel = reply->element[1];
+                const redisReply *payload = reply->element[2];
+                Message message = { channel->str, channel->len, payload->str, payload->len };
+                ++owner->stats_.messages;
+                subscription->callback( message );
+            }
+            else if( is( kind, "ssubscribe" ) )
+            {
+                if( current )
+                    subscription->confirmed = true;
+            }
+            else if( is( kind, "sunsubscribe" ) )
+            {
+                // hiredis forgets the channel after this reply
+                owner->forget( subscription, con );
+                if( !current )
+                    return;
+                if( subscription->removed )
+                {
+                    subscription->node = nullptr;
+                    owner->release( subscription );
+                }
+                else
+                {
+                    // node dropped the channel by itself (slot migrated) or it was taken back
+                    // after unsubscribe
+                    owner->detach( subscription );
+                }
+            }
+        }
+        
+        static void connectCb( const struct redisAsyncContext *ac, int status )
+        {
+            Node *node = static_cast<Node*>( ac->data );
+            // hiredis frees context that failed to connect without disconnect callback
+            if( status != REDIS_OK && !node->owner->closing_ )
+                node->owner->lost( node, ac );
+        }
+        
+        static void disconnectCb( const struct redisAsyncContext *ac, int )
+        {
+            Node *node = static_cast<Node*>( ac->data );
+            if( !node->owner->closing_ )
+                node->owner->lost( node, ac );
+        }
+        
+        static void onTick( void *data )
+        {
+            Tick *tick = static_cast<Tick*>( data );
+            ShardedSubscriber *owner = tick->owner;
+            if( owner == nullptr )
+            {
+                delete tick;
+                return;
+            }
+            owner->retry();
+            if( owner->adapter_.runAfter( owner->options_.retryInterval, onTick, tick ) != REDIS_OK )
+            {
+                owner->tick_ = nullptr;
+                delete tick;
+            }
+        }
+        
+        // channels without node and the ones not confirmed for two ticks are subscribed again
+        // after slot map refresh, slot map can't be fetched while the cluster is down, they
+        // are sent by the map known then
+        void retry()
+        {
+            bool waiting = false;
+            for( typename Subscriptions::value_type &entry : subscriptions_ )
+            {
+                Subscription *subscription = entry.second;
+                if( subscription->removed )
+                    continue;
+                if( subscription->node != nullptr && !subscription->confirmed && ++subscription->age > 2 )
+                    subscription->node = nullptr;
+                waiting = waiting || subscription->node == nullptr;
+            }
+            if( !waiting )
+                return;
+            if( refresh_ != nullptr )
+            {
+                // previous CLUSTER SLOTS didn't make it
+                rebalance();
+                return;
+            }
+            refresh();
+            // refresh couldn't be sent
+            if( refresh_ == nullptr )
+                rebalance();
+        }
+        
+        typename Cluster::ptr_t cluster_p_;
+        Adapter &adapter_;
+        Options options_;
+        Subscriptions subscriptions_;
+        Nodes nodes_;
+        SlotOwners owners_;
+        Tick *tick_;
+        Refresh *refresh_;
+        size_t refreshCount_;
+        bool closing_;
+        Stats stats_;
+    };
+}
+
+#endif /* defined(__libredisCluster__shardedsubscriber__) */
@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2015, Dmitrii Shinkevich <shinmail at gmail dot com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __libredisCluster__singleflight__
+#define __libredisCluster__singleflight__
+
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "asynchirediscommand.h"
+#include "hirediscommand.h"
+
+namespace RedisCluster
+{
+    using std::string;
+    
+    // Request coalescing for synchronous cluster. Identical read commands sent by several
+    // threads at the same time share one request: the first thread sends it, the others
+    // wait for its reply (or its exception) instead of sending the same command again.
+    // Commands are identical if they are formatted to the same bytes. Only read commands
+    // may be sent this way, the reply is shared between threads and must not be modified.
+    //
+    //     SingleFlight<> flight;
+    //     Reply reply = flight.AltCommand( cluster_p, "FOO", "GET %s", "FOO" );
+    template < typename Cluster = Cluster<redisContext> >
+    class SingleFlight
+    {
+        SingleFlight(const SingleFlight&) = delete;
+        SingleFlight& operator=(const SingleFlight&) = delete;
+        
+        struct Flight
+        {
+            Flight() : done(), finished( false ), reply(), error() {}
+            
+            std::condition_variable done;
+            bool finished;
+            Reply reply;
+            std::exception_ptr error;
+        };
+        
+    public:
+        
+        struct Stats
+        {
+            // commands sent to cluster
+            uint64_t requests;
+            // commands which got reply of another one
+            uint64_t shared;
+        };
+        
+        SingleFlight() :
+        flights_(),
+        lock_(),
+        stats_()
+        {
+        }
+        
+        Reply AltCommand( typename Cluster::ptr_t cluster_p,
+                          const string &key,
+                          int argc,
+                          const char ** argv,
+                          const size_t *argvlen )
+        {
+            char *cmd = nullptr;
+            long long len = redisFormatCommandArgv( &cmd, argc, argv, argvlen );
+            if( len < 0 )
+                throw InvalidArgument(nullptr);
+            return run( cluster_p, key, cmd, static_cast<int>( len ) );
+        }
+        
+        Reply AltCommand( typename Cluster::ptr_t cluster_p,
+                          const string &key,
+                          const char *format, ...)
+        {
+            va_list ap;
+            va_start( ap, format );
+            char *cmd = nullptr;
+            int len = redisvFormatCommand( &cmd, format, ap );
+            va_end( ap );
+            if( len < 0 )
+                throw InvalidArgument(nullptr);
+            return run( cluster_p, key, cmd, len );
+        }
+        
+        Stats stats() const
+        {
+            std::lock_guard<std::mutex> locker( lock_ );
+            return stats_;
+        }
+        
+    private:
+        
+        Reply run( typename Cluster::ptr_t cluster_p, const string &key, char *cmd, int len )
+        {
+            string command( cmd, len );
+            std::unique_lock<std::mutex> locker( lock_ );
+            
+            typename std::unordered_map<string, std::shared_ptr<Flight> >::iterator found = flights_.find( command );
+            if( found != flights_.end() )
+            {
+                free( cmd );
+                std::shared_ptr<Flight> flight = found->second;
+                ++stats_.shared;
+                while( !flight->finished )
+                    flight->done.wait( locker );
+                if( flight->error )
+                    std::rethrow_exception( flight->error );
+                return flight->reply;
+            }
+            
+            std::shared_ptr<Flight> flight = std::make_shared<Flight>();
+            flights_[command] = flight;
+            ++stats_.requests;
+            locker.unlock();
+            
+            Reply reply;
+            std::exception_ptr error;
+            try
+            {
+                reply = HiredisCommand<Cluster>::AltFormattedCommand( cluster_p, key, cmd, len );
+            }
+            catch( ... )
+            {
+                error = std::current_exception();
+            }
+            
+            locker.lock();
+            flights_.erase( command );
+            flight->finished = true;
+            flight->reply = reply;
+            flight->error = error;
+            locker.unlock();
+            flight->done.notify_all();
+            
+            if( error )
+                std::rethrow_exception( error );
+            return reply;
+        }
+        
+        std::unordered_map<string, std::shared_ptr<Flight> > flights_;
+        mutable std::mutex lock_;
+        Stats stats_;
+    };
+    
+    // Request coalescing for asynchronous cluster, it's not thread safe and is used from the
+    // event loop thread like the cluster. Identical read command sent while the same one is
+    // waiting for reply isn't sent, its callback is queued and gets the same reply (errors,
+    // redirections and timeouts included). Object must live while it has commands in flight.
+    //
+    //     AsyncSingleFlight<> flight;
+    //     flight.Command( cluster_p, "FOO", callback, "GET %s", "FOO" );
+    template < typename Cluster = Cluster<redisAsyncContext> >
+    class AsyncSingleFlight
+    {
+        typedef AsyncHiredisCommand<Cluster> AsyncCommand;
+        typedef typename AsyncCommand::RedisCallback RedisCallback;
+        
+        AsyncSingleFlight(const AsyncSingleFlight&) = delete;
+        AsyncSingleFlight& operator=(const AsyncSingleFlight&) = delete;
+        
+        struct Flight
+        {
+            string command;
+            std::vector<RedisCallback> waiters;
+        };
+        
+        typedef std::unordered_map<string, Flight*> Flights;
+        
+    public:
+        
+        typedef typename SingleFlight<>::Stats Stats;
+        
+        AsyncSingleFlight() :
+        flights_(),
+        stats_()
+        {
+        }
+        
+        ~AsyncSingleFlight()
+        {
+            for( typename Flights::value_type &flight : flights_ )
+                delete flight.second;
+        }
+        
+        // returns false if the command has joined the same command in flight
+        bool Command( typename Cluster::ptr_t cluster_p,
+                      const string &key,
+                      int argc,
+                      const char ** argv,
+                      const size_t *argvlen,
+                      const RedisCallback& redisCallback )
+        {
+            char *cmd = nullptr;
+            long long len = redisFormatCommandArgv( &cmd, argc, argv, argvlen );
+            if( len < 0 )
+                throw InvalidArgument(nullptr);
+            return run( cluster_p, key, cmd, static_cast<int>( len ), redisCallback );
+        }
+        
+        bool Command( typename Cluster::ptr_t cluster_p,
+                      const string &key,
+                      const RedisCallback& redisCallback,
+                      const char *format, ... )
+        {
+            va_list ap;
+            va_start( ap, format );
+            char *cmd = nullptr;
+            int len = redisvFormatCommand( &cmd, format, ap );
+            va_end( ap );
+            if( len < 0 )
+                throw InvalidArgument(nullptr);
+            return run( cluster_p, key, cmd, len, redisCallback );
+        }
+        
+        // number of distinct commands waiting for reply
+        size_t inFlight() const
+        {
+            return flights_.size();
+        }
+        
+        Stats stats() const
+        {
+            return stats_;
+        }
+        
+    private:
+        
+        bool run( typename Cluster::ptr_t cluster_p, const string &key, char *cmd, int len,
+                  const RedisCallback& redisCallback )
+        {
+            string command( cmd, len );
+            typename Flights::iterator found = flights_.find( command );
+            if( found != flights_.end() )
+            {
+                free( cmd );
+                found->second->waiters.push_back( redisCallback );
+                ++stats_.shared;
+                return false;
+            }
+            
+            Flight *flight = new Flight{ command, std::vector<RedisCallback>( 1, redisCallback ) };
+            flights_.insert( typename Flights::value_type( command, flight ) );
+            try
+            {
+                // callback can be invoked right away (i.e. node is down), flight isn't used after sending
+                AsyncCommand::FormattedCommand( cluster_p, key, cmd, len,
+                    [this, flight]( const redisReply &reply ) { finish( flight, reply ); } );
+            }
+            catch( ... )
+            {
+                flights_.erase( command );
+                delete flight;
+                throw;
+            }
+            ++stats_.requests;
+            return true;
+        }
+        
+        // flight is removed before callbacks are run, so they can send the same command again
+        void finish( Flight *flight, const redisReply &reply )
+        {
+            std::unique_ptr<Flight> finished( flight );
+            flights_.erase( flight->command );
+            for( const RedisCallback &waiter : flight->waiters )
+            {
+                if( waiter )
+                    waiter( reply );
+            }
+        }
+        
+        Flights flights_;
+        Stats stats_;
+    };
+}
+
+#endif /* defined(__libredisCluster__singleflight__) */
@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2015, Dmitrii Shinkevich <shinmail at gmail dot com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __libredisCluster__slabpool__
+#define __libredisCluster__slabpool__
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+namespace RedisCluster
+{
+    // Thread local pool of memory blocks with power of two size classes (64 to 4096 bytes).
+    // Freed blocks are kept in per class free lists and reused, so objects that are created
+    // and deleted all the time in the event loop thread (async commands) don't hit malloc
+    // in steady state. Blocks can be freed from any thread, they just go to the free list
+    // of that thread. Bigger blocks are served by malloc directly.
+    class SlabPool
+    {
+        enum
+        {
+            MIN_SHIFT = 6,
+            CLASSES = 7,
+            // maximum count of cached blocks per size class
+            MAX_CACHED = 4096
+        };
+
+        struct FreeBlock
+        {
+            FreeBlock *next;
+        };
+
+        struct Cache
+        {
+            Cache() : heads_(), counts_() {}
+
+            Cache( const Cache& ) = delete;
+            Cache& operator=( const Cache& ) = delete;
+
+            ~Cache()
+            {
+                for( int i = 0; i < CLASSES; ++i )
+                {
+                    while( heads_[i] != nullptr )
+                    {
+                        FreeBlock *block = heads_[i];
+                        heads_[i] = block->next;
+                        std::free( block );
+                    }
+                }
+            }
+
+            FreeBlock *heads_[CLASSES];
+            size_t counts_[CLASSES];
+        };
+
+        static Cache& cache()
+        {
+            static thread_local Cache cache;
+            return cache;
+        }
+
+        // returns size class index or -1 if block is too big to be pooled
+        static inline int sizeClass( size_t size )
+        {
+            int cls = 0;
+            size_t blockSize = size_t(1) << MIN_SHIFT;
+            while( blockSize < size )
+            {
+                blockSize <<= 1;
+                if( ++cls == CLASSES )
+                    return -1;
+            }
+            return cls;
+        }
+
+    public:
+
+        static void* allocate( size_t size )
+        {
+            int cls = sizeClass( size );
+            if( cls < 0 )
+                return mallocOrThrow( size );
+
+            Cache &c = cache();
+            FreeBlock *block = c.heads_[cls];
+            if( block != nullptr )
+            {
+                c.heads_[cls] = block->next;
+                --c.counts_[cls];
+                return block;
+            }
+            return mallocOrThrow( size_t(1) << ( MIN_SHIFT + cls ) );
+        }
+
+        // size must be the same as was passed to allocate
+        static void deallocate( void *p, size_t size )
+        {
+            if( p == nullptr )
+                return;
+
+            int cls = sizeClass( size );
+            Cache &c = cache();
+            if( cls < 0 || c.counts_[cls] >= MAX_CACHED )
+            {
+                std::free( p );
+                return;
+            }
+            FreeBlock *block = static_cast<FreeBlock*>( p );
+            block->next = c.heads_[cls];
+            c.heads_[cls] = block;
+            ++c.counts_[cls];
+        }
+
+    private:
+        static void* mallocOrThrow( size_t size )
+        {
+            void *p = std::malloc( size );
+            if( p == nullptr )
+                throw std::bad_alloc();
+            return p;
+        }
+    };
+}
+
+#endif /* defined(__libredisCluster__slabpool__) */
@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2015, Dmitrii Shinkevich <shinmail at gmail dot com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __libredisCluster__timerwheel__
+#define __libredisCluster__timerwheel__
+
+#include <chrono>
+#include <cstdint>
+
+#include "adapters/adapter.h"  // for Adapter
+#include "clusterexception.h"
+
+namespace RedisCluster
+{
+    // Hierarchical timer wheel driven by event loop through Adapter::runAfter. Timers are
+    // intrusive nodes, so scheduling and cancelling cost O(1) without allocations. Expiration
+    // precision is one tick, the loop is woken up every tick only while some timer is scheduled.
+    // It's not thread safe and is used from event loop thread only.
+    class TimerWheel
+    {
+        TimerWheel(const TimerWheel&) = delete;
+        TimerWheel& operator=(const TimerWheel&) = delete;
+        
+        static const unsigned int BITS = 6;
+        static const unsigned int SLOTS = 1 << BITS;
+        static const unsigned int LEVELS = 4;
+        
+    public:
+        typedef void (*ExpireFn)( void *data );
+        
+        class Timer
+        {
+            friend class TimerWheel;
+            
+            Timer(const Timer&) = delete;
+            Timer& operator=(const Timer&) = delete;
+            
+        public:
+            Timer( ExpireFn fn, void *data ) : prev_( nullptr ), next_( nullptr ), expires_( 0 ), fn_( fn ), data_( data ) {}
+            
+            inline bool scheduled() const
+            {
+                return next_ != nullptr;
+            }
+            
+        private:
+            // list head of wheel slot
+            Timer() : prev_( nullptr ), next_( nullptr ), expires_( 0 ), fn_( nullptr ), data_( nullptr ) {}
+            
+            Timer *prev_;
+            Timer *next_;
+            uint64_t expires_;
+            ExpireFn fn_;
+            void *data_;
+        };
+        
+        TimerWheel( Adapter &adapter, const struct timeval &resolution ) :
+        adapter_( adapter ),
+        resolution_( resolution ),
+        tickUs_( static_cast<uint64_t>( resolution.tv_sec ) * 1000000 + resolution.tv_usec ),
+        current_( 0 ),
+        count_( 0 ),
+        armed_( false ),
+        destroyed_( false )
+        {
+            if( tickUs_ == 0 )
+                throw InvalidArgument(nullptr);
+            current_ = now();
+            for( unsigned int level = 0; level < LEVELS; ++level )
+            {
+                for( unsigned int slot = 0; slot < SLOTS; ++slot )
+                {
+                    Timer &head = heads_[level][slot];
+                    head.prev_ = head.next_ = &head;
+                }
+            }
+        }
+        
+        // timer fires not earlier than after timeout, if the adapter can't run the tick
+        // LogicError is thrown and the timer stays unscheduled
+        void schedule( Timer &timer, const struct timeval &timeout )
+        {
+            if( timer.scheduled() )
+                cancel( timer );
+            arm();
+            uint64_t us = static_cast<uint64_t>( timeout.tv_sec ) * 1000000 + timeout.tv_usec;
+            uint64_t ticks = ( us + tickUs_ - 1 ) / tickUs_;
+            // wheel can lag behind when the loop is busy, timer is counted from now anyway
+            uint64_t tick = now();
+            if( count_ == 0 && tick > current_ )
+                current_ = tick;
+            timer.expires_ = tick + ( ticks > 0 ? ticks : 1 );
+            place( timer );
+            ++count_;
+        }
+        
+        void cancel( Timer &timer )
+        {
+            if( timer.scheduled() )
+            {
+                unlink( timer );
+                --count_;
+            }
+        }
+        
+        inline size_t size() const
+        {
+            return count_;
+        }
+        
+        // wheel is deleted right away or by the pending tick
+        void destroy()
+        {
+            if( armed_ )
+                destroyed_ = true;
+            else
+                delete this;
+        }
+        
+    private:
+        ~TimerWheel() {}
+        
+        uint64_t now() const
+        {
+            uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now().time_since_epoch() ).count();
+            return us / tickUs_;
+        }
+        
+        void arm()
+        {
+            if( !armed_ )
+            {
+                if( adapter_.runAfter( resolution_, onTick, this ) != REDIS_OK )
+                    throw LogicError(nullptr, "adapter doesn't support timers");
+                armed_ = true;
+            }
+        }
+        
+        static void onTick( void *data )
+        {
+            TimerWheel *that = static_cast<TimerWheel*>( data );
+            that->armed_ = false;
+            if( that->destroyed_ )
+            {
+                delete that;
+                return;
+            }
+            that->advance( that->now() );
+            if( that->count_ > 0 )
+                that->arm();
+        }
+        
+        static inline void unlink( Timer &timer )
+        {
+            timer.prev_->next_ = timer.next_;
+            timer.next_->prev_ = timer.prev_;
+            timer.prev_ = timer.next_ = nullptr;
+        }
+        
+        static inline void link( Timer &head, Timer &timer )
+        {
+            timer.prev_ = head.prev_;
+            timer.next_ = &head;
+            head.prev_->next_ = &timer;
+            head.prev_ = &timer;
+        }
+        
+        void place( Timer &timer )
+        {
+            uint64_t delta = timer.expires_ > current_ ? timer.expires_ - current_ : 0;
+            for( unsigned int level = 0; level < LEVELS; ++level )
+            {
+                if( delta < ( uint64_t(1) << ( BITS * ( level + 1 ) ) ) )
+                {
+                    link( heads_[level][ ( timer.expires_ >> ( BITS * level ) ) & ( SLOTS - 1 ) ], timer );
+                    return;
+                }
+            }
+            // beyond the wheel range, timer is placed again when its slot is cascaded
+            uint64_t far = current_ + ( uint64_t(1) << ( BITS * LEVELS ) ) - 1;
+            link( heads_[LEVELS - 1][ ( far >> ( BITS * ( LEVELS - 1 ) ) ) & ( SLOTS - 1 ) ], timer );
+        }
+        
+        // moves timers of the slot to lower levels
+        void cascade( unsigned int level )
+        {
+            Timer &head = heads_[level][ ( current_ >> ( BITS * level ) ) & ( SLOTS - 1 ) ];
+            while( head.next_ != &head )
+            {
+                Timer &timer = *head.next_;
+                unlink( timer );
+                place( timer );
+            }
+        }
+        
+        void advance( uint64_t until )
+        {
+            if( count_ == 0 )
+            {
+                current_ = until > current_ ? until : current_;
+                return;
+            }
+            while( current_ < until )
+            {
+                ++current_;
+                for( unsigned int level = 1; level < LEVELS; ++level )
+                {
+                    if( ( current_ & ( ( uint64_t(1) << ( BITS * level ) ) - 1 ) ) != 0 )
+                        break;
+                    cascade( level );
+                }
+                Timer &head = heads_[0][ current_ & ( SLOTS - 1 ) ];
+                // expired timer callback can schedule and cancel other timers
+                while( head.next_ != &head )
+                {
+                    Timer &timer = *head.next_;
+                    unlink( timer );
+                    --count_;
+                    timer.fn_( timer.data_ );
+                }
+                if( count_ == 0 )
+                {
+                    current_ = until;
+                    return;
+                }
+            }
+        }
+        
+        Adapter &adapter_;
+        struct timeval resolution_;
+        uint64_t tickUs_;
+        uint64_t current_;
+        size_t count_;
+        bool armed_;
+        bool destroyed_;
+        Timer heads_[LEVELS][SLOTS];
+    };
+}
+
+#endif /* defined(__libredisCluster__timerwheel__) */
@@ -0,0 +1,648 @@
+/*
+ * Copyright (c) 2015, Dmitrii Shinkevich <shinmail at gmail dot com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef __libredisCluster__valuecodec__
+#define __libredisCluster__valuecodec__
+
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "asynchirediscommand.h"
+#include "hirediscommand.h"
+
+namespace RedisCluster
+{
+    using std::string;
+    
+    // Interface of compression algorithm used by ValueCodec, implementation must be
+    // thread safe if the codec is shared by threads
+    class Codec
+    {
+    public:
+        virtual ~Codec() {}
+        
+        // written to header of compressed values, must be unique and not 0
+        virtual unsigned char id() const = 0;
+        // appends compressed data to out
+        virtual void compress( const char *src, size_t len, string &out ) const = 0;
+        // writes exactly originalLen bytes to out, returns false if data is corrupted
+        virtual bool decompress( const char *src, size_t len, char *out, size_t originalLen ) const = 0;
+        // the most bytes len bytes of compressed data can decode to, headers claiming more
+        // are rejected before memory for the value is allocated
+        virtual size_t maxDecompressedSize( size_t len ) const = 0;
+    };
+    
+    // Built-in LZ77 codec in spirit of LZ4 block format: greedy matching through hash table
+    // of 4 byte sequences, literal runs and matches are encoded by one token byte with
+    // length extensions and 2 byte offset. It trades compression ratio for speed, JSON and
+    // text shrink several times at hundreds of megabytes per second.
+    class LzCodec : public Codec
+    {
+        static const int HashBits = 12;
+        static const size_t MinMatch = 4;
+        static const size_t MaxOffset = 65535;
+        // matches aren't searched at the end, so the last bytes are always literals
+        static const size_t LastLiterals = 5;
+        
+        static inline uint32_t read32( const char *p )
+        {
+            uint32_t value;
+            memcpy( &value, p, sizeof(value) );
+            return value;
+        }
+        
+        static inline uint32_t hash( uint32_t sequence )
+        {
+            return ( sequence * 2654435761u ) >> ( 32 - HashBits );
+        }
+        
+        static inline void writeLength( string &out, size_t length )
+        {
+            for( ; length >= 255; length -= 255 )
+                out.push_back( '\xff' );
+            out.push_back( static_cast<char>( length ) );
+        }
+        
+        static inline bool readLength( const unsigned char *&in, const unsigned char *end, size_t &length )
+        {
+            unsigned char byte;
+            do
+            {
+                if( in == end )
+                    return false;
+                byte = *in++;
+                length += byte;
+            }
+            while( byte == 255 );
+            return true;
+        }
+        
+        // match length 0 marks the last sequence, it has only literals
+        static void sequence( string &out, const char *literals, size_t literalLen, size_t offset, size_t matchLen )
+        {
+            size_t matchCode = matchLen == 0 ? 0 : matchLen - MinMatch;
+            out.push_back( static_cast<char>( ( ( literalLen < 15 ? literalLen : 15 ) << 4 ) | ( matchCode < 15 ? matchCode : 15 ) ) );
+            if( literalLen >= 15 )
+                writeLength( out, literalLen - 15 );
+            out.append( literals, literalLen );
+            if( matchLen == 0 )
+                return;
+            out.push_back( static_cast<char>( offset & 0xff ) );
+            out.push_back( static_cast<char>( offset >> 8 ) );
+            if( matchCode >= 15 )
+                writeLength( out, matchCode - 15 );
+        }
+        
+    public:
+        
+        unsigned char id() const override
+        {
+            return 1;
+        }
+        
+        void compress( const char *src, size_t len, string &out ) const override
+        {
+            // positions are kept plus one, so zero means empty entry
+            uint32_t table[1 << HashBits];
+            memset( table, 0, sizeof(table) );
+            out.reserve( out.size() + len / 2 + 16 );
+            
+            size_t anchor = 0, i = 0;
+            const size_t limit = len > LastLiterals + MinMatch ? len - LastLiterals : 0;
+            while( i + MinMatch <= limit )
+            {
+                uint32_t seq = read32( src + i );
+                uint32_t &entry = table[hash( seq )];
+                size_t candidate = entry;
+                entry = static_cast<uint32_t>( i + 1 );
+                
+                if( candidate != 0 && i - ( candidate - 1 ) <= MaxOffset && read32( src + candidate - 1 ) == seq )
+                {
+                    size_t match = candidate - 1;
+                    size_t length = MinMatch;
+                    while( i + length < limit && src[match + length] == src[i + length] )
+                        ++length;
+                    sequence( out, src + anchor, i - anchor, i - match, length );
+                    i += length;
+                    anchor = i;
+                }
+                else
+                {
+                    // step grows on data without matches, so incompressible values are passed quickly
+                    i += 1 + ( ( i - anchor ) >> 6 );
+                }
+            }
+            sequence( out, src + anchor, len - anchor, 0, 0 );
+        }
+        
+        bool decompress( const char *src, size_t len, char *out, size_t originalLen ) const override
+        {
+            const unsigned char *in = reinterpret_cast<const unsigned char*>( src );
+            const unsigned char *end = in + len;
+            char *op = out;
+            char *oend = out + originalLen;
+            
+            while( in < end )
+            {
+                unsigned char token = *in++;
+                size_t literalLen = token >> 4;
+                if( literalLen == 15 && !readLength( in, end, literalLen ) )
+                    return false;
+                if( literalLen > size_t( end - in ) || literalLen > size_t( oend - op ) )
+                    return false;
+                memcpy( op, in, literalLen );
+                in += literalLen;
+                op += literalLen;
+                
+                if( in == end )
+                    break;
+                
+                if( end - in < 2 )
+                    return false;
+                size_t offset = in[0] | ( size_t( in[1] ) << 8 );
+                in += 2;
+                size_t matchLen = token & 15;
+                if( matchLen == 15 && !readLength( in, end, matchLen ) )
+                    return false;
+                matchLen += MinMatch;
+                if( offset == 0 || offset > size_t( op - out ) || matchLen > size_t( oend - op ) )
+                    return false;
+                
+                const char *match = op - offset;
+                if( offset >= matchLen )
+                {
+                    memcpy( op, match, matchLen );
+                    op += matchLen;
+                }
+                else
+                {
+                    // overlapping match repeats the last offset bytes
+                    for( size_t j = 0; j < matchLen; ++j )
+                        *op++ = *match++;
+                }
+            }
+            return op == oend;
+        }
+        
+        size_t maxDecompressedSize( size_t len ) const override
+        {
+            // the longest output per input byte comes from length extensions of a match,
+            // token and offset are outweighed by the first of them
+            const size_t perByte = 255;
+            return len > SIZE_MAX / perByte ? SIZE_MAX : len * perByte;
+        }
+    };
+    
+    // Transparent compression of big values. Arguments of at least Options::threshold bytes
+    // are compressed before sending and get a header with the codec id and original length,
+    // string replies having the header are decompressed before they are returned. Command
+    // name and key (the first argument) are never compressed, so the command is routed and
+    // stored under the key it names. Values which don't shrink enough are sent as they are. Values are recognized by contents, so
+    // it's meant for commands writing and reading whole values (SET, GET, MGET, HSET,
+    // HGET...), not for APPEND, GETRANGE or STRLEN. Codec is thread safe and may be shared
+    // by threads and clusters.
+    //
+    //     ValueCodec codec;
+    //     const char *argv[] = { "SET", "doc:1", json.data() };
+    //     size_t argvlen[] = { 3, 5, json.size() };
+    //     codec.AltCommand( cluster_p, "doc:1", 3, argv, argvlen );
+    //     Reply reply = codec.AltCommand( cluster_p, "doc:1", "GET %s", "doc:1" );
+    class ValueCodec
+    {
+        ValueCodec(const ValueCodec&) = delete;
+        ValueCodec& operator=(const ValueCodec&) = delete;
+        
+        // header is magic, codec id (0 for values stored as they are) and original
+        // length in little endian
+        static const size_t MagicSize = 3;
+        static const size_t HeaderSize = MagicSize + 1 + 4;
+        
+        static inline const char* magic()
+        {
+            return "\0RZ";
+        }
+        
+        static inline bool marked( const char *str, size_t len )
+        {
+            return len >= MagicSize && memcmp( str, magic(), MagicSize ) == 0;
+        }
+        
+        static inline size_t align( size_t size )
+        {
+            const size_t a = sizeof(void*);
+            return ( size + a - 1 ) & ~( a - 1 );
+        }
+        
+        static inline uint64_t nanosSince( std::chrono::steady_clock::time_point start )
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count();
+        }
+        
+    public:
+        
+        struct Options
+        {
+            Options() :
+            threshold( 4096 ),
+            maxRatio( 0.9 )
+            {}
+            
+            // arguments shorter than this are sent as they are
+            size_t threshold;
+            // compressed value is sent only if it's not bigger than this part of original one
+            double maxRatio;
+        };
+        
+        struct Stats
+        {
+            // values sent compressed
+            uint64_t compressed;
+            // values of threshold size and longer which didn't shrink enough
+            uint64_t incompressible;
+            // original and compressed size of values sent compressed
+            uint64_t bytesIn;
+            uint64_t bytesOut;
+            // values decompressed from replies
+            uint64_t decompressed;
+            // CPU time spent in codec, in nanoseconds (compression of incompressible values too)
+            uint64_t compressNanos;
+            uint64_t decompressNanos;
+            
+            // compressed size to original size, lower is better
+            double ratio() const
+            {
+                return bytesIn == 0 ? 1. : double( bytesOut ) / double( bytesIn );
+            }
+            
+            // bytes saved on wire for writes
+            uint64_t saved() const
+            {
+                return bytesIn - bytesOut;
+            }
+        };
+        
+        explicit ValueCodec( const Options &options = Options(),
+                             std::shared_ptr<Codec> codec = std::make_shared<LzCodec>() ) :
+        codec_( codec ),
+        options_( options ),
+        compressed_( 0 ),
+        incompressible_( 0 ),
+        bytesIn_( 0 ),
+        bytesOut_( 0 ),
+        decompressed_( 0 ),
+        compressNanos_( 0 ),
+        decompressNanos_( 0 )
+        {
+            if( !codec_ || codec_->id() == 0 )
+                throw InvalidArgument(nullptr);
+        }
+        
+        // encodes value for sending, returns false if it must be sent as it is. Values
+        // beginning with codec header are always encoded, so they are read back unchanged
+        bool encode( const char *value, size_t len, string &out )
+        {
+            bool mustMark = marked( value, len );
+            out.clear();
+            if( len >= options_.threshold && len <= UINT32_MAX )
+            {
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                appendHeader( out, codec_->id(), len );
+                codec_->compress( value, len, out );
+                compressNanos_ += nanosSince( start );
+                
+                if( out.size() <= len * options_.maxRatio )
+                {
+                    ++compressed_;
+                    bytesIn_ += len;
+                    bytesOut_ += out.size();
+                    return true;
+                }
+                ++incompressible_;
+                out.clear();
+            }
+            if( !mustMark )
+                return false;
+            appendHeader( out, 0, len );
+            out.append( value, len );
+            return true;
+        }
+        
+        // size of value after decoding, value must be marked; the header is validated
+        // here, so nothing is allocated for lengths the value can't hold
+        size_t decodedSize( const char *value, size_t len ) const
+        {
+            if( len < HeaderSize )
+                throw LogicError( nullptr, "corrupted compressed value" );
+            const unsigned char *size = reinterpret_cast<const unsigned char*>( value ) + MagicSize + 1;
+            size_t originalLen = size_t( size[0] ) | ( size_t( size[1] ) << 8 ) | ( size_t( size[2] ) << 16 ) | ( size_t( size[3] ) << 24 );
+            unsigned char id = static_cast<unsigned char>( value[MagicSize] );
+            if( id == 0 )
+            {
+                if( len - HeaderSize != originalLen )
+                    throw LogicError( nullptr, "corrupted compressed value" );
+                return originalLen;
+            }
+            if( id != codec_->id() )
+                throw LogicError( nullptr, "value is compressed by unknown codec" );
+            if( originalLen > codec_->maxDecompressedSize( len - HeaderSize ) )
+                throw LogicError( nullptr, "corrupted compressed value" );
+            return originalLen;
+        }
+        
+        // decodes marked value to out which has room for decodedSize() bytes
+        void decode( const char *value, size_t len, char *out )
+        {
+            size_t originalLen = decodedSize( value, len );
+            if( value[MagicSize] == 0 )
+            {
+                memcpy( out, value + HeaderSize, originalLen );
+                return;
+            }
+            
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            bool valid = codec_->decompress( value + HeaderSize, len - HeaderSize, out, originalLen );
+            decompressNanos_ += nanosSince( start );
+            if( !valid )
+                throw LogicError( nullptr, "corrupted compressed value" );
+            ++decompressed_;
+        }
+        
+        // returns the same reply if it has no encoded values, otherwise a copy with decoded values
+        Reply decode( const Reply &reply )
+        {
+            if( !reply || !hasMarked( *reply ) )
+                return reply;
+            return Reply( decodedCopy( *reply ), free );
+        }
+        
+        // copy of reply with decoded values, released by free()
+        redisReply* decodedCopy( const redisReply &reply )
+        {
+            char *block = static_cast<char*>( malloc( blockSize( reply ) ) );
+            if( block == nullptr )
+                throw std::bad_alloc();
+            try
+            {
+                char *cursor = block;
+                return place( reply, cursor );
+            }
+            catch( ... )
+            {
+                free( block );
+                throw;
+            }
+        }
+        
+        template <typename Cluster>
+        Reply AltCommand( Cluster *cluster_p,
+                          const string &key,
+                          int argc,
+                          const char ** argv,
+                          const size_t *argvlen )
+        {
+            std::vector<string> values;
+            std::vector<const char*> encodedArgv;
+            std::vector<size_t> encodedArgvlen;
+            if( encodeArgs( argc, argv, argvlen, values, encodedArgv, encodedArgvlen ) )
+            {
+                argv = encodedArgv.data();
+                argvlen = encodedArgvlen.data();
+            }
+            return decode( HiredisCommand<Cluster>::AltCommand( cluster_p, key, argc, argv, argvlen ) );
+        }
+        
+        // for reads, format string arguments aren't compressed
+        template <typename Cluster>
+        Reply AltCommand( Cluster *cluster_p,
+                          const string &key,
+                          const char *format, ... )
+        {
+            va_list ap;
+            va_start( ap, format );
+            char *cmd = nullptr;
+            int len = redisvFormatCommand( &cmd, format, ap );
+            va_end( ap );
+            if( len < 0 )
+                throw InvalidArgument(nullptr);
+            return decode( HiredisCommand<Cluster>::AltFormattedCommand( cluster_p, key, cmd, len ) );
+        }
+        
+        // callback gets reply with decoded values, corrupted values make it an error reply
+        template <typename Cluster>
+        void Command( Cluster *cluster_p,
+                      const string &key,
+                      int argc,
+                      const char ** argv,
+                      const size_t *argvlen,
+                      const typename AsyncHiredisCommand<Cluster>::RedisCallback& redisCallback )
+        {
+            std::vector<string> values;
+            std::vector<const char*> encodedArgv;
+            std::vector<size_t> encodedArgvlen;
+            if( encodeArgs( argc, argv, argvlen, values, encodedArgv, encodedArgvlen ) )
+            {
+                argv = encodedArgv.data();
+                argvlen = encodedArgvlen.data();
+            }
+            AsyncHiredisCommand<Cluster>::Command( cluster_p, key, argc, argv, argvlen, decoding<Cluster>( redisCallback ) );
+        }
+        
+        template <typename Cluster>
+        void Command( Cluster *cluster_p,
+                      const string &key,
+                      const typename AsyncHiredisCommand<Cluster>::RedisCallback& redisCallback,
+                      const char *format, ... )
+        {
+            va_list ap;
+            va_start( ap, format );
+            char *cmd = nullptr;
+            int len = redisvFormatCommand( &cmd, format, ap );
+            va_end( ap );
+            if( len < 0 )
+                throw InvalidArgument(nullptr);
+            AsyncHiredisCommand<Cluster>::FormattedCommand( cluster_p, key, cmd, len, decoding<Cluster>( redisCallback ) );
+        }
+        
+        Stats stats() const
+        {
+            return Stats{ compressed_, incompressible_, bytesIn_, bytesOut_, decompressed_, compressNanos_, decompressNanos_ };
+        }
+        
+        const Options& options() const
+        {
+            return options_;
+        }
+        
+    private:
+        
+        static inline void appendHeader( string &out, unsigned char id, size_t len )
+        {
+            out.append( magic(), MagicSize );
+            out.push_back( static_cast<char>( id ) );
+            for( int i = 0; i < 4; ++i )
+                out.push_back( static_cast<char>( ( len >> ( 8 * i ) ) & 0xff ) );
+        }
+        
+        // command name and key aren't encoded, argvlen may be NULL for C strings as in
+        // hiredis. Returns false if all arguments are sent as they are
+        bool encodeArgs( int argc, const char **argv, const size_t *argvlen,
+                         std::vector<string> &values,
+                         std::vector<const char*> &encodedArgv,
+                         std::vector<size_t> &encodedArgvlen )
+        {
+            string value;
+            for( int i = 2; i < argc; ++i )
+            {
+                if( !encode( argv[i], argvlen != NULL ? argvlen[i] : strlen( argv[i] ), value ) )
+                    continue;
+                if( values.empty() )
+                {
+                    values.reserve( argc );
+                    encodedArgv.assign( argv, argv + argc );
+                    encodedArgvlen.resize( argc );
+                    for( int j = 0; j < argc; ++j )
+                        encodedArgvlen[j] = argvlen != NULL ? argvlen[j] : strlen( argv[j] );
+                }
+                values.push_back( string() );
+                values.back().swap( value );
+                encodedArgv[i] = values.back().data();
+                encodedArgvlen[i] = values.back().size();
+            }
+            return !values.empty();
+        }
+        
+        static bool hasMarked( const redisReply &reply )
+        {
+            if( reply.type == REDIS_REPLY_STRING )
+                return marked( reply.str, reply.len );
+            for( size_t i = 0; reply.element != nullptr && i < reply.elements; ++i )
+            {
+                if( hasMarked( *reply.element[i] ) )
+                    return true;
+            }
+            return false;
+        }
+        
+        // same layout as ReplyCopy, decoded values take place of encoded ones
+        size_t blockSize( const redisReply &reply ) const
+        {
+            size_t size = align( sizeof(redisReply) );
+            if( reply.str != nullptr )
+            {
+                bool decoded = reply.type == REDIS_REPLY_STRING && marked( reply.str, reply.len );
+                size += align( ( decoded ? decodedSize( reply.str, reply.len ) : reply.len ) + 1 );
+            }
+            if( reply.element != nullptr )
+            {
+                size += align( reply.elements * sizeof(redisReply*) );
+                for( size_t i = 0; i < reply.elements; ++i )
+                    size += blockSize( *reply.element[i] );
+            }
+            return size;
+        }
+        
+        redisReply* place( const redisReply &reply, char *&cursor )
+        {
+            redisReply *copy = reinterpret_cast<redisReply*>( cursor );
+            cursor += align( sizeof(redisReply) );
+            *copy = reply;
+            if( reply.str != nullptr )
+            {
+                copy->str = cursor;
+                if( reply.type == REDIS_REPLY_STRING && marked( reply.str, reply.len ) )
+                {
+                    copy->len = decodedSize( reply.str, reply.len );
+                    decode( reply.str, reply.len, copy->str );
+                }
+                else
+                {
+                    memcpy( copy->str, reply.str, reply.len );
+                }
+                copy->str[copy->len] = '\0';
+                cursor += align( copy->len + 1 );
+            }
+            if( reply.element != nullptr )
+            {
+                copy->element = reinterpret_cast<redisReply**>( cursor );
+                cursor += align( reply.elements * sizeof(redisReply*) );
+                for( size_t i = 0; i < reply.elements; ++i )
+                    copy->element[i] = place( *reply.element[i], cursor );
+            }
+            return copy;
+        }
+        
+        // replies are passed as they are if they have no encoded values, decoded copy
+        // lives while callback runs
+        template <typename Cluster>
+        typename AsyncHiredisCommand<Cluster>::RedisCallback decoding( const typename AsyncHiredisCommand<Cluster>::RedisCallback& redisCallback )
+        {
+            return [this, redisCallback]( const redisReply &reply )
+            {
+                if( !redisCallback )
+                    return;
+                if( !hasMarked( reply ) )
+                {
+                    redisCallback( reply );
+                    return;
+                }
+                std::unique_ptr<redisReply, void (*)(void*)> decoded( nullptr, free );
+                try
+                {
+                    decoded.reset( decodedCopy( reply ) );
+                }
+                catch( const ClusterException& )
+                {
+                    redisCallback( makeErrorReply( "corrupted compressed value" ) );
+                    return;
+                }
+                redisCallback( *decoded );
+            };
+        }
+        
+        std::shared_ptr<Codec> codec_;
+        Options options_;
+        std::atomic<uint64_t> compressed_;
+        std::atomic<uint64_t> incompressible_;
+        std::atomic<uint64_t> bytesIn_;
+        std::atomic<uint64_t> bytesOut_;
+        std::atomic<uint64_t> decompressed_;
+        std::atomic<uint64_t> compressNanos_;
+        std::atomic<uint64_t> decompressNanos_;
+    };
+}
+
+#endif /* defined(__libredisCluster__valuecodec__) */
@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2015, Dmitrii Shinkevich <shinmail at gmail dot com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __libredisCluster__writebatcher__
+#define __libredisCluster__writebatcher__
+
+#include <vector>
+
+#include "adapters/adapter.h"  // for Adapter
+
+extern "C"
+{
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+}
+
+namespace RedisCluster
+{
+    // Write batcher (corking) for async connections.
+    // hiredis asks event library for a write event after every command appended to
+    // the output buffer. Batcher intercepts this request, remembers the connection
+    // and writes its whole output buffer once, when the event loop finished current
+    // iteration. So all the commands issued to one node during one loop iteration are
+    // sent with one write syscall and without write event registrations.
+    class WriteBatcher
+    {
+        WriteBatcher(const WriteBatcher&) = delete;
+        WriteBatcher& operator=(const WriteBatcher&) = delete;
+
+        // original event hooks of the attached event library
+        struct Hooks
+        {
+            WriteBatcher *batcher;
+            redisAsyncContext *ac;
+            void *data;
+            void (*addRead)(void *privdata);
+            void (*delRead)(void *privdata);
+            void (*addWrite)(void *privdata);
+            void (*delWrite)(void *privdata);
+            void (*cleanup)(void *privdata);
+#if HIREDIS_MAJOR >= 1
+            void (*scheduleTimer)(void *privdata, struct timeval tv);
+#endif
+            // connection is waiting for the flush
+            bool pending;
+            // write event is registered in the event library
+            bool armed;
+        };
+
+    public:
+        explicit WriteBatcher( Adapter &adapter ) :
+        adapter_( adapter ),
+        dirty_(),
+        flushing_(),
+        writing_( nullptr ),
+        scheduled_( false ),
+        destroyed_( false )
+        {
+        }
+
+        // batcher is deleted by the scheduled flush if there is one, so the loop never
+        // runs flush of deleted batcher
+        void destroy()
+        {
+            if( scheduled_ )
+                destroyed_ = true;
+            else
+                delete this;
+        }
+
+        // Wrap event hooks of the connection, must be called right after the
+        // connection was attached to the adapter. Returns REDIS_ERR if adapter
+        // doesn't support batching, in this case connection stays untouched.
+        int attach( redisAsyncContext &ac )
+        {
+            if( ac.ev.addWrite == nullptr )
+                return REDIS_ERR;
+
+            Hooks *hooks = new Hooks();
+            hooks->batcher = this;
+            hooks->ac = &ac;
+            hooks->data = ac.ev.data;
+            hooks->addRead = ac.ev.addRead;
+            hooks->delRead = ac.ev.delRead;
+            hooks->addWrite = ac.ev.addWrite;
+            hooks->delWrite = ac.ev.delWrite;
+            hooks->cleanup = ac.ev.cleanup;
+            hooks->pending = false;
+            hooks->armed = false;
+
+            ac.ev.data = hooks;
+            ac.ev.addRead = addRead;
+            ac.ev.delRead = delRead;
+            ac.ev.addWrite = addWrite;
+            ac.ev.delWrite = delWrite;
+            ac.ev.cleanup = cleanup;
+#if HIREDIS_MAJOR >= 1
+            hooks->scheduleTimer = ac.ev.scheduleTimer;
+            if( ac.ev.scheduleTimer != nullptr )
+                ac.ev.scheduleTimer = scheduleTimer;
+#endif
+            return REDIS_OK;
+        }
+
+        // write output buffers of all connections, waiting for the flush
+        void flush()
+        {
+            scheduled_ = false;
+            flushing_.swap( dirty_ );
+            for( size_t i = 0; i < flushing_.size(); ++i )
+            {
+                Hooks *hooks = flushing_[i];
+                if( hooks->ac == nullptr )
+                {
+                    // connection was freed while waiting for the flush
+                    delete hooks;
+                    continue;
+                }
+                hooks->pending = false;
+                if( !hooks->armed )
+                {
+                    // in case of partial write hiredis asks for write event again,
+                    // it would go directly to event library, as buffer is not empty
+                    writing_ = hooks;
+                    redisAsyncHandleWrite( hooks->ac );
+                    writing_ = nullptr;
+                }
+            }
+            flushing_.clear();
+        }
+
+    private:
+        typedef std::vector<Hooks*> HooksList;
+
+        ~WriteBatcher()
+        {
+            // connections are already freed here, so only release hooks waiting for flush
+            for( size_t i = 0; i < dirty_.size(); ++i )
+            {
+                if( dirty_[i]->ac == nullptr )
+                    delete dirty_[i];
+            }
+        }
+
+        static void runFlush( void *data )
+        {
+            WriteBatcher *that = static_cast<WriteBatcher*>( data );
+            if( that->destroyed_ )
+            {
+                delete that;
+                return;
+            }
+            that->flush();
+        }
+
+        static void addRead( void *privdata )
+        {
+            Hooks *hooks = static_cast<Hooks*>( privdata );
+            if( hooks->addRead )
+                hooks->addRead( hooks->data );
+        }
+
+        static void delRead( void *privdata )
+        {
+            Hooks *hooks = static_cast<Hooks*>( privdata );
+            if( hooks->delRead )
+                hooks->delRead( hooks->data );
+        }
+
+        static void addWrite( void *privdata )
+        {
+            Hooks *hooks = static_cast<Hooks*>( privdata );
+            WriteBatcher *that = hooks->batcher;
+
+            // connect is detected by write event, and partial writes must wait for writability,
+            // so in this cases (and if loop can't run our flush) just ask event library
+            if( hooks->armed || that->writing_ == hooks ||
+                !( hooks->ac->c.flags & REDIS_CONNECTED ) || !that->schedule() )
+            {
+                hooks->armed = true;
+                hooks->addWrite( hooks->data );
+            }
+            else if( !hooks->pending )
+            {
+                hooks->pending = true;
+                that->dirty_.push_back( hooks );
+            }
+        }
+
+        static void delWrite( void *privdata )
+        {
+            Hooks *hooks = static_cast<Hooks*>( privdata );
+            hooks->armed = false;
+            if( hooks->delWrite )
+                hooks->delWrite( hooks->data );
+        }
+
+        static void cleanup( void *privdata )
+        {
+            Hooks *hooks = static_cast<Hooks*>( privdata );
+            if( hooks->cleanup )
+                hooks->cleanup( hooks->data );
+
+            hooks->ac->ev.data = nullptr;
+            if( hooks->pending )
+            {
+                // batcher holds the pointer, hooks would be deleted with the flush
+                hooks->ac = nullptr;
+            }
+            else
+            {
+                delete hooks;
+            }
+        }
+
+#if HIREDIS_MAJOR >= 1
+        static void scheduleTimer( void *privdata, struct timeval tv )
+        {
+            Hooks *hooks = static_cast<Hooks*>( privdata );
+            hooks->scheduleTimer( hooks->data, tv );
+        }
+#endif
+
+        bool schedule()
+        {
+            if( !scheduled_ )
+            {
+                if( adapter_.runLater( runFlush, this ) != REDIS_OK )
+                    return false;
+                scheduled_ = true;
+            }
+            return true;
+        }
+
+        Adapter &adapter_;
+        HooksList dirty_;
+        HooksList flushing_;
+        Hooks *writing_;
+        bool scheduled_;
+        // destroy() was called while flush was scheduled
+        bool destroyed_;
+    };
+}
+
+#endif /* defined(__libredisCluster__writebatcher__) */
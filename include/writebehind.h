@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 2015, Dmitrii Shinkevich <shinmail at gmail dot com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __libredisCluster__writebehind__
+#define __libredisCluster__writebehind__
+
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "adapters/adapter.h"  // for Adapter
+#include "asynchirediscommand.h"
+
+namespace RedisCluster
+{
+    using std::string;
+    
+    // Write-behind buffer over asynchronous cluster for fire-and-forget counters and overwrites.
+    // Writes are kept locally for a short window: increments of the same key (or hash field) are
+    // summed, SET of the same key replaces the buffered one (last write wins), INCRBY after
+    // a buffered integer SET is folded into it. When the window ends, one command per key and
+    // field is issued, all of them in one event loop iteration, so every node gets them as one
+    // pipelined batch (one write with corking, see AsyncHiredisCommand::Options::corking).
+    //
+    //     WriteBehind<> buffer( adapter, cluster_p );
+    //     buffer.incrBy( "visits", 1 );
+    //     buffer.hincrBy( "{user1000}:counters", "clicks", 1 );
+    //     buffer.set( "last_seen", "1460000000" );
+    //
+    // Flush latency: a write is issued at most Options::window after it's buffered, or right away
+    // when there are Options::maxKeys buffered keys, or when flush() is called.
+    // Loss semantics: buffered writes are lost if the process dies before they're issued, they
+    // are issued by flush() and by destructor, so destroy the buffer before the cluster. Replies
+    // are not waited for, writes issued when the cluster is going down can be lost as well. Error
+    // replies and commands which can't be sent are counted in Stats::errors.
+    // Writes of a key are sent in order of kinds (SET, INCRBY, HINCRBY) on the connection of
+    // its slot, so containers with several connections per node can reorder them.
+    // It's not thread safe and is used from the event loop thread, adapter must support
+    // Adapter::runAfter.
+    template < typename Cluster = Cluster<redisAsyncContext> >
+    class WriteBehind
+    {
+        typedef AsyncHiredisCommand<Cluster> AsyncCommand;
+        typedef std::chrono::steady_clock Clock;
+        
+        WriteBehind(const WriteBehind&) = delete;
+        WriteBehind& operator=(const WriteBehind&) = delete;
+        
+        // buffered writes of one key
+        struct Entry
+        {
+            Entry() : set( false ), value(), incr( 0 ), hasIncr( false ), fields() {}
+            
+            bool set;
+            string value;
+            long long incr;
+            bool hasIncr;
+            std::map<string, long long> fields;
+        };
+        
+        // scheduled flush, it outlives the buffer if the buffer is destroyed before it fires
+        struct Tick
+        {
+            WriteBehind *owner;
+        };
+        
+    public:
+        
+        struct Options
+        {
+            Options() :
+            window{ 0, 10000 },
+            maxKeys( 100000 )
+            {}
+            
+            // time the writes are kept before they're issued
+            struct timeval window;
+            // number of buffered keys which makes them issued right away, 0 means no limit
+            size_t maxKeys;
+        };
+        
+        struct Stats
+        {
+            // writes buffered
+            uint64_t writes;
+            // commands issued for them
+            uint64_t commands;
+            uint64_t flushes;
+            // error replies and commands which couldn't be sent
+            uint64_t errors;
+            // the longest time a write was buffered, in microseconds
+            uint64_t maxLatency;
+        };
+        
+        WriteBehind( Adapter &adapter, typename Cluster::ptr_t cluster_p, const Options &options = Options() ) :
+        adapter_( adapter ),
+        cluster_p_( cluster_p ),
+        options_( options ),
+        entries_(),
+        stats_( std::make_shared<Stats>() ),
+        tick_( nullptr ),
+        oldest_()
+        {
+            if( cluster_p == nullptr )
+                throw InvalidArgument(nullptr);
+        }
+        
+        ~WriteBehind()
+        {
+            flush();
+            if( tick_ != nullptr )
+                tick_->owner = nullptr;
+        }
+        
+        void incrBy( const string &key, long long delta )
+        {
+            Entry &entry = buffer( key );
+            if( entry.set && !entry.hasIncr && foldIncr( entry.value, delta ) )
+                return;
+            entry.incr += delta;
+            entry.hasIncr = true;
+        }
+        
+        void hincrBy( const string &key, const string &field, long long delta )
+        {
+            buffer( key ).fields[field] += delta;
+        }
+        
+        // overwrite drops writes of the key buffered before
+        void set( const string &key, const string &value )
+        {
+            Entry &entry = buffer( key );
+            entry.set = true;
+            entry.value = value;
+            entry.incr = 0;
+            entry.hasIncr = false;
+            entry.fields.clear();
+        }
+        
+        // issues all buffered writes now
+        void flush()
+        {
+            if( entries_.empty() )
+                return;
+            
+            std::unordered_map<string, Entry> entries;
+            entries.swap( entries_ );
+            uint64_t age = std::chrono::duration_cast<std::chrono::microseconds>( Clock::now() - oldest_ ).count();
+            if( age > stats_->maxLatency )
+                stats_->maxLatency = age;
+            ++stats_->flushes;
+            
+            for( typename std::unordered_map<string, Entry>::value_type &entry : entries )
+            {
+                const string &key = entry.first;
+                if( entry.second.set )
+                    issue( key, "SET %b %b", key.data(), key.size(), entry.second.value.data(), entry.second.value.size() );
+                if( entry.second.hasIncr )
+                    issue( key, "INCRBY %b %lld", key.data(), key.size(), entry.second.incr );
+                for( typename std::map<string, long long>::value_type &field : entry.second.fields )
+                    issue( key, "HINCRBY %b %b %lld", key.data(), key.size(), field.first.data(), field.first.size(), field.second );
+            }
+        }
+        
+        // number of keys with buffered writes
+        size_t pending() const
+        {
+            return entries_.size();
+        }
+        
+        Stats stats() const
+        {
+            return *stats_;
+        }
+        
+    private:
+        
+        Entry& buffer( const string &key )
+        {
+            if( entries_.empty() )
+            {
+                oldest_ = Clock::now();
+                schedule();
+            }
+            else if( options_.maxKeys != 0 && entries_.size() >= options_.maxKeys && entries_.count( key ) == 0 )
+            {
+                flush();
+                oldest_ = Clock::now();
+            }
+            ++stats_->writes;
+            return entries_[key];
+        }
+        
+        // SET "10" followed by INCRBY 5 is SET "15"
+        static bool foldIncr( string &value, long long delta )
+        {
+            if( value.empty() || value.size() > 20 )
+                return false;
+            char *end = nullptr;
+            errno = 0;
+            long long number = strtoll( value.c_str(), &end, 10 );
+            if( errno != 0 || *end != '\0' || std::to_string( number ) != value )
+                return false;
+            if( ( delta > 0 && number > LLONG_MAX - delta ) || ( delta < 0 && number < LLONG_MIN - delta ) )
+                return false;
+            value = std::to_string( number + delta );
+            return true;
+        }
+        
+        void schedule()
+        {
+            if( tick_ != nullptr )
+                return;
+            tick_ = new Tick{ this };
+            if( adapter_.runAfter( options_.window, onTick, tick_ ) != REDIS_OK )
+            {
+                delete tick_;
+                tick_ = nullptr;
+                throw LogicError(nullptr, "adapter doesn't support timers");
+            }
+        }
+        
+        static void onTick( void *data )
+        {
+            Tick *tick = static_cast<Tick*>( data );
+            WriteBehind *owner = tick->owner;
+            delete tick;
+            if( owner == nullptr )
+                return;
+            owner->tick_ = nullptr;
+            owner->flush();
+        }
+        
+        // callback keeps the counters alive, the buffer can be gone when the reply comes
+        template <typename... Args>
+        void issue( const string &key, const char *format, Args... args )
+        {
+            std::shared_ptr<Stats> stats = stats_;
+            try
+            {
+                AsyncCommand::Command( cluster_p_, key, [stats]( const redisReply &reply ) {
+                    if( reply.type == REDIS_REPLY_ERROR )
+                        ++stats->errors;
+                }, format, args... );
+                ++stats_->commands;
+            }
+            catch( const ClusterException & )
+            {
+                ++stats_->errors;
+            }
+        }
+        
+        Adapter &adapter_;
+        typename Cluster::ptr_t cluster_p_;
+        Options options_;
+        std::unordered_map<string, Entry> entries_;
+        std::shared_ptr<Stats> stats_;
+        Tick *tick_;
+        Clock::time_point oldest_;
+    };
+}
+
+#endif /* defined(__libredisCluster__writebehind__) */
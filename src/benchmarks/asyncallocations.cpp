@@ -0,0 +1,119 @@
+
+#include <iostream>
+#include <atomic>
+#include <event2/event.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <adapters/libeventadapter.h>
+
+#include "asynchirediscommand.h"
+
+using namespace RedisCluster;
+using std::string;
+using std::cout;
+using std::endl;
+
+/*
+ * Benchmark counting heap allocations per asynchronous command in steady state.
+ * malloc family is interposed here, so allocations made inside hiredis
+ * (formatting, callback list, replies) are counted too.
+ */
+
+extern "C"
+{
+    void *__libc_malloc( size_t size );
+    void *__libc_calloc( size_t n, size_t size );
+    void *__libc_realloc( void *p, size_t size );
+    void __libc_free( void *p );
+}
+
+static std::atomic<unsigned long> allocations( 0 );
+
+extern "C"
+{
+    void *malloc( size_t size )
+    {
+        allocations.fetch_add( 1, std::memory_order_relaxed );
+        return __libc_malloc( size );
+    }
+
+    void *calloc( size_t n, size_t size )
+    {
+        allocations.fetch_add( 1, std::memory_order_relaxed );
+        return __libc_calloc( n, size );
+    }
+
+    void *realloc( void *p, size_t size )
+    {
+        allocations.fetch_add( 1, std::memory_order_relaxed );
+        return __libc_realloc( p, size );
+    }
+
+    void free( void *p )
+    {
+        __libc_free( p );
+    }
+}
+
+typedef Cluster<redisAsyncContext>::ptr_t ClusterPtr;
+
+static const int commandsNum = 100000;
+static const int batchSize = 100;
+static int replies = 0;
+
+// issue commands by batches from event loop, so the loop processes replies in between
+static void issueBatch( ClusterPtr cluster_p, struct event_base *base, int count )
+{
+    for( int i = 0; i < count; ++i )
+    {
+        AsyncHiredisCommand<>::Command( cluster_p,
+                                       "{bench}:counter",
+                                       [base]( const redisReply & ) {
+                                           if( --replies == 0 )
+                                               event_base_loopbreak( base );
+                                       },
+                                       "INCR %s",
+                                       "{bench}:counter" );
+    }
+}
+
+static unsigned long runCommands( ClusterPtr cluster_p, struct event_base *base, int count )
+{
+    unsigned long before = allocations.load();
+    replies = count;
+    for( int sent = 0; sent < count; sent += batchSize )
+    {
+        issueBatch( cluster_p, base, batchSize );
+        event_base_loop( base, EVLOOP_NONBLOCK );
+    }
+    if( replies > 0 )
+        event_base_dispatch( base );
+    return allocations.load() - before;
+}
+
+int main(int argc, const char * argv[])
+{
+    signal(SIGPIPE, SIG_IGN);
+    struct event_base *base = event_base_new();
+    LibeventAdapter adapter(*base);
+
+    try
+    {
+        ClusterPtr cluster_p = AsyncHiredisCommand<>::createCluster( "127.0.0.1", 7000, adapter );
+
+        // warm up pools and buffers
+        runCommands( cluster_p, base, commandsNum );
+        unsigned long total = runCommands( cluster_p, base, commandsNum );
+
+        cout << "commands: " << commandsNum << endl;
+        cout << "allocations: " << total << endl;
+        cout << "allocations per command: " << double(total) / commandsNum << endl;
+
+        delete cluster_p;
+    } catch ( const RedisCluster::ClusterException &e )
+    {
+        cout << "Cluster exception: " << e.what() << endl;
+    }
+    event_base_free(base);
+    return 0;
+}
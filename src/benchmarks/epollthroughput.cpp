@@ -0,0 +1,118 @@
+
+#include <iostream>
+#include <chrono>
+#include <string>
+#include <event2/event.h>
+#include <signal.h>
+#include <adapters/epolladapter.h>
+#include <adapters/libeventadapter.h>
+#ifdef HAVE_LIBURING
+#include <adapters/uringadapter.h>
+#endif
+
+#include "asynchirediscommand.h"
+
+using namespace RedisCluster;
+using std::string;
+using std::cout;
+using std::endl;
+
+/*
+ * Benchmark of single event loop throughput with the built-in epoll adapter
+ * (and io_uring adapter if liburing is found) compared to the libevent adapter. Commands are issued from reply callbacks,
+ * so a fixed number of them is in flight all the time.
+ * Usage: bench_epoll_throughput [commands in flight]
+ */
+
+typedef Cluster<redisAsyncContext>::ptr_t ClusterPtr;
+
+static const int commandsNum = 1000000;
+
+struct Run
+{
+    ClusterPtr cluster_p;
+    int sent;
+    int done;
+};
+
+static void issue( Run *run )
+{
+    int n = run->sent++;
+    string key = "bench:" + std::to_string( n % 10000 );
+    AsyncHiredisCommand<>::Command( run->cluster_p,
+                                   key,
+                                   [run]( const redisReply & ) {
+                                       if( ++run->done == commandsNum )
+                                           // disconnecting cluster will brake the event loop
+                                           run->cluster_p->disconnect();
+                                       else if( run->sent < commandsNum )
+                                           issue( run );
+                                   },
+                                   "SET %s %d",
+                                   key.c_str(),
+                                   n );
+}
+
+template <typename Loop>
+static double measure( ClusterPtr cluster_p, int window, Loop loop )
+{
+    Run run = { cluster_p, 0, 0 };
+    auto start = std::chrono::steady_clock::now();
+    for( int i = 0; i < window && run.sent < commandsNum; ++i )
+        issue( &run );
+    loop();
+    double elapsed = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+    return run.done / elapsed;
+}
+
+int main(int argc, const char * argv[])
+{
+    signal(SIGPIPE, SIG_IGN);
+    int window = argc > 1 ? atoi( argv[1] ) : 1000;
+
+    try
+    {
+        struct event_base *base = event_base_new();
+        LibeventAdapter libeventAdapter(*base);
+        ClusterPtr cluster_p = AsyncHiredisCommand<>::createCluster( "127.0.0.1", 7000, libeventAdapter );
+        double libevent = measure( cluster_p, window, [base]() { event_base_dispatch( base ); } );
+        delete cluster_p;
+        event_base_free( base );
+
+        // epoll loop runs in its own thread
+        EpollAdapter epollAdapter;
+        cluster_p = AsyncHiredisCommand<>::createCluster( "127.0.0.1", 7000, epollAdapter );
+        double epoll = measure( cluster_p, window, [&epollAdapter]() {
+            epollAdapter.start();
+            epollAdapter.join();
+        } );
+        delete cluster_p;
+
+        cout << "commands: " << commandsNum << ", in flight: " << window << endl;
+        cout << "libevent adapter, commands per second: " << libevent << endl;
+        cout << "epoll adapter, commands per second: " << epoll << endl;
+
+#ifdef HAVE_LIBURING
+        UringAdapter uringAdapter;
+        if( uringAdapter.valid() )
+        {
+            cluster_p = AsyncHiredisCommand<>::createCluster( "127.0.0.1", 7000, uringAdapter );
+            double uring = measure( cluster_p, window, [&uringAdapter]() {
+                uringAdapter.start();
+                uringAdapter.join();
+            } );
+            delete cluster_p;
+            cout << "io_uring adapter" << ( uringAdapter.fixedBuffers() ? "" : " (buffers not registered)" )
+                 << ", commands per second: " << uring << endl;
+        }
+        else
+        {
+            cout << "io_uring is not supported by the kernel" << endl;
+        }
+#endif
+    } catch ( const RedisCluster::ClusterException &e )
+    {
+        cout << "Cluster exception: " << e.what() << endl;
+    }
+    return 0;
+}
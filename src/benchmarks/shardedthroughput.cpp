@@ -0,0 +1,105 @@
+
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+#include <event2/event.h>
+#include <event2/thread.h>
+#include <signal.h>
+#include <adapters/libeventadapter.h>
+
+#include "shardedcluster.h"
+
+using namespace RedisCluster;
+using std::string;
+using std::cout;
+using std::endl;
+
+/*
+ * Benchmark of asynchronous throughput depending on the number of event loops.
+ * Usage: bench_sharded_throughput [loops] [producer threads]
+ * Run it with 1, 2, 4... loops to see how throughput scales with cores.
+ */
+
+static const int commandsNum = 1000000;
+static const int window = 10000;
+
+static std::atomic<int> submitted( 0 );
+static std::atomic<int> completed( 0 );
+
+static void producer( ShardedAsyncCluster<> &cluster, int count )
+{
+    ShardedAsyncCluster<>::Completion completion = []( const Reply & ) {
+        completed.fetch_add( 1, std::memory_order_relaxed );
+    };
+    for( int i = 0; i < count; ++i )
+    {
+        // keep the number of commands in flight bounded
+        int n = submitted.fetch_add( 1, std::memory_order_relaxed );
+        while( n - completed.load( std::memory_order_relaxed ) > window )
+            std::this_thread::yield();
+        string key = "bench:" + std::to_string( n );
+        cluster.Command( key, completion, "SET %s %d", key.c_str(), n );
+    }
+}
+
+int main(int argc, const char * argv[])
+{
+    signal(SIGPIPE, SIG_IGN);
+    evthread_use_pthreads();
+
+    unsigned int hw = std::thread::hardware_concurrency();
+    int loopsNum = argc > 1 ? atoi( argv[1] ) : ( hw > 0 ? hw : 1 );
+    int producersNum = argc > 2 ? atoi( argv[2] ) : loopsNum;
+
+    std::vector<struct event_base*> bases;
+    std::vector<LibeventAdapter*> adapters;
+    std::vector<Adapter*> loops;
+    for( int i = 0; i < loopsNum; ++i )
+    {
+        bases.push_back( event_base_new() );
+        adapters.push_back( new LibeventAdapter( *bases.back() ) );
+        loops.push_back( adapters.back() );
+    }
+
+    try
+    {
+        ShardedAsyncCluster<> cluster( "127.0.0.1", 7000, loops, ShardedAsyncCluster<>::BY_SLOT );
+
+        std::vector<std::thread> threads;
+        for( struct event_base *base : bases )
+            threads.push_back( std::thread( event_base_dispatch, base ) );
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> producers;
+        for( int i = 0; i < producersNum; ++i )
+            producers.push_back( std::thread( producer, std::ref( cluster ), commandsNum / producersNum ) );
+        for( auto &thread : producers )
+            thread.join();
+        while( completed.load() < submitted.load() )
+            std::this_thread::yield();
+        auto elapsed = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+
+        cout << "loops: " << loopsNum << ", producers: " << producersNum << endl;
+        cout << "commands: " << completed.load() << endl;
+        cout << "commands per second: " << completed.load() / elapsed << endl;
+
+        // disconnecting clusters will brake the event loops
+        cluster.disconnect();
+        for( auto &thread : threads )
+            thread.join();
+    } catch ( const RedisCluster::ClusterException &e )
+    {
+        cout << "Cluster exception: " << e.what() << endl;
+    }
+
+    for( int i = 0; i < loopsNum; ++i )
+    {
+        delete adapters[i];
+        event_base_free( bases[i] );
+    }
+    return 0;
+}
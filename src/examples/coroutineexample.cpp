@@ -0,0 +1,77 @@
+
+#include <iostream>
+#include <coroutine>
+#include <exception>
+#include <event2/event.h>
+#include <signal.h>
+#include <adapters/libeventadapter.h>
+
+#include "asyncawait.h"
+
+using namespace RedisCluster;
+using std::string;
+using std::cout;
+using std::cerr;
+using std::endl;
+
+// Example of usage of asynchronous client from C++20 coroutines
+// Coroutine is resumed straight from redis reply callback in event loop thread
+
+// minimal fire and forget coroutine type, real applications have their own task types
+struct Detached
+{
+    struct promise_type
+    {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception()
+        {
+            try
+            {
+                std::rethrow_exception( std::current_exception() );
+            } catch ( const ClusterException &e )
+            {
+                cerr << "Cluster exception: " << e.what() << endl;
+            }
+        }
+    };
+};
+
+typedef Cluster<redisAsyncContext>::ptr_t ClusterPtr;
+
+Detached setAndGet( ClusterPtr cluster_p )
+{
+    Reply reply = co_await AwaitCommand( cluster_p, "FOO", "SET %s %s", "FOO", "BAR1" );
+    cout << "Reply to SET FOO BAR1: " << reply->str << endl;
+
+    reply = co_await AwaitCommand( cluster_p, "FOO", "GET %s", "FOO" );
+    if( reply->type == REDIS_REPLY_STRING )
+        cout << "Reply to GET FOO: " << reply->str << endl;
+    else if( reply->type == REDIS_REPLY_ERROR )
+        cerr << "Error: " << reply->str << endl;
+
+    // disconnecting cluster will brake the event loop
+    cluster_p->disconnect();
+}
+
+int main(int argc, const char * argv[])
+{
+    signal(SIGPIPE, SIG_IGN);
+    struct event_base *base = event_base_new();
+    LibeventAdapter adapter(*base);
+
+    try
+    {
+        ClusterPtr cluster_p = AsyncHiredisCommand<>::createCluster( "127.0.0.1", 7000, adapter );
+        setAndGet( cluster_p );
+        event_base_dispatch(base);
+        delete cluster_p;
+    } catch ( const RedisCluster::ClusterException &e )
+    {
+        cout << "Cluster exception: " << e.what() << endl;
+    }
+    event_base_free(base);
+    return 0;
+}
@@ -0,0 +1,85 @@
+
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <event2/event.h>
+#include <event2/thread.h>
+#include <signal.h>
+#include <adapters/libeventadapter.h>
+
+#include "asyncdispatcher.h"
+
+using namespace RedisCluster;
+using std::string;
+using std::cout;
+using std::endl;
+
+// Example of thread safe asynchronous client: worker threads submit commands
+// and wait for futures, while one event loop thread does all the network work
+
+typedef Cluster<redisAsyncContext>::ptr_t ClusterPtr;
+
+static const int threadsNum = 4;
+static const int commandsNum = 1000;
+
+void worker( AsyncDispatcher<> &dispatcher, int id )
+{
+    string key = "{worker" + std::to_string( id ) + "}:counter";
+    std::vector< std::future<Reply> > futures;
+    for( int i = 0; i < commandsNum; ++i )
+    {
+        futures.push_back( dispatcher.Command( key, "INCR %s", key.c_str() ) );
+    }
+    try
+    {
+        Reply reply;
+        for( auto &future : futures )
+            reply = future.get();
+        if( reply->type == REDIS_REPLY_INTEGER )
+            cout << key << " = " << reply->integer << endl;
+    } catch ( const ClusterException &e )
+    {
+        cout << "Cluster exception: " << e.what() << endl;
+    }
+}
+
+static void stopLoop( void *data )
+{
+    // disconnecting cluster will brake the event loop
+    static_cast<ClusterPtr>( data )->disconnect();
+}
+
+int main(int argc, const char * argv[])
+{
+    signal(SIGPIPE, SIG_IGN);
+    // must be called before event base is created, Adapter::post is used from worker threads
+    evthread_use_pthreads();
+    struct event_base *base = event_base_new();
+    LibeventAdapter adapter(*base);
+
+    try
+    {
+        ClusterPtr cluster_p = AsyncHiredisCommand<>::createCluster( "127.0.0.1", 7000, adapter );
+        {
+            AsyncDispatcher<> dispatcher( cluster_p, adapter );
+
+            std::thread control( [&dispatcher, &adapter, cluster_p]() {
+                std::vector<std::thread> threads;
+                for( int i = 0; i < threadsNum; ++i )
+                    threads.push_back( std::thread( worker, std::ref( dispatcher ), i ) );
+                for( auto &thread : threads )
+                    thread.join();
+                adapter.post( stopLoop, cluster_p );
+            } );
+
+            event_base_dispatch(base);
+            control.join();
+        }
+        delete cluster_p;
+    } catch ( const RedisCluster::ClusterException &e )
+    {
+        cout << "Cluster exception: " << e.what() << endl;
+    }
+    event_base_free(base);
+    return 0;
+}
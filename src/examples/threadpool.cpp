@@ -43,6 +43,8 @@ class ThreadedPool
     typedef std::map <typename RCluster::SlotRange, ConPool*, typename RCluster::SlotComparator> ClusterNodes;
     // Container for saving connections by host and port (for redirecting)
     typedef std::map <typename RCluster::Host, ConPool*> RedirectConnections;
+    // Node addresses by slots, they are needed to replace discarded connections
+    typedef std::map <typename RCluster::SlotRange, std::pair<string, int>, typename RCluster::SlotComparator> Endpoints;
     // rename cluster types
     typedef typename RCluster::SlotConnection SlotConnection;
     typedef typename RCluster::HostConnection HostConnection;
@@ -114,6 +116,7 @@ public:
         ConPool* &pool = nodes_[slots];
         pool = new ConPool();
         fillPool(*pool, host, port);
+        endpoints_[slots] = std::make_pair( string( host ), port );
     }
     
     // function inserts or returning existing one connection used for redirecting (ASKING or MOVED)
@@ -167,6 +170,42 @@ public:
         pushConnection( locker, *connections_[conn.first], conn.second );
     }
     
+    // this function is invoked instead of releaseConnection when connection can't be reused
+    // (i.e. command timed out and reply is left unread), pool must keep its size, so a new
+    // connection to the same node takes its place
+    inline void discardConnection( SlotConnection conn )
+    {
+        std::unique_lock<std::mutex> locker(conLock_);
+        std::pair<string, int> endpoint = endpoints_[conn.first];
+        locker.unlock();
+        
+        redisConnection *con = reconnect( endpoint.first.c_str(), endpoint.second, conn.second );
+        locker.lock();
+        pushConnection( locker, *nodes_[conn.first], con );
+    }
+    // same function for redirection connections
+    inline void discardConnection( HostConnection conn )
+    {
+        string::size_type colon = conn.first.rfind( ':' );
+        redisConnection *con = reconnect( conn.first.substr( 0, colon ).c_str(),
+                                         std::stoi( conn.first.substr( colon + 1 ) ),
+                                         conn.second );
+        std::unique_lock<std::mutex> locker(conLock_);
+        pushConnection( locker, *connections_[conn.first], con );
+    }
+    
+    // helper for replacing broken connection, new one can be broken too if the node is down,
+    // then the next command fails fast and discards it again
+    inline redisConnection* reconnect( const char* host, int port, redisConnection *con )
+    {
+        redisConnection *fresh = connect_( host, port, data_ );
+        if( fresh == NULL )
+            return con;
+        if( disconnect_ != NULL )
+            disconnect_( con );
+        return fresh;
+    }
+    
     // disconnect both thread pools
     inline void disconnect()
     {
@@ -209,6 +248,7 @@ private:
     typename RCluster::pt2RedisFreeFunc disconnect_;
     RedirectConnections connections_;
     ClusterNodes nodes_;
+    Endpoints endpoints_;
     std::mutex conLock_;
 };
 
@@ -225,8 +265,9 @@ std::mutex lock;
 void commandThread( ThreadPoolCluster::ptr_t cluster_p )
 {
     redisReply * reply;
-    // use defined custom cluster as template parameter for HiredisCommand here
-    reply = static_cast<redisReply*>( HiredisCommand<ThreadPoolCluster>::Command( cluster_p, "FOO", "SET %s %s", "FOO", "BAR1" ) );
+    // use defined custom cluster as template parameter for HiredisCommand here,
+    // command throws TimeoutException if it's not done in 500 milliseconds
+    reply = static_cast<redisReply*>( HiredisCommand<ThreadPoolCluster>::Command( cluster_p, "FOO", { 0, 500000 }, "SET %s %s", "FOO", "BAR1" ) );
     
     // check the result with assert
     assert( reply->type == REDIS_REPLY_STATUS && string(reply->str) == "OK" );
@@ -239,6 +280,20 @@ void commandThread( ThreadPoolCluster::ptr_t cluster_p )
     freeReplyObject( reply );
 }
 
+// when a thread sends several commands to the same hash tag, lease the connection once
+// so the pool lock is taken only one time for the whole burst
+void commandBurstThread( ThreadPoolCluster::ptr_t cluster_p )
+{
+    ThreadPoolCluster::Lease lease = cluster_p->lease( "{user1000}" );
+    
+    for( int i = 0; i < 20; ++i )
+    {
+        Reply reply = HiredisCommand<ThreadPoolCluster>::AltCommand( lease, "HINCRBY %s %s %d", "{user1000}:counters", "visits", 1 );
+        assert( reply->type == REDIS_REPLY_INTEGER );
+    }
+    // connection is returned to the pool here, when lease goes out of scope
+}
+
 void processCommandPool()
 {
     const int threadsNum = 1000;
@@ -251,7 +306,7 @@ void processCommandPool()
     std::thread thr[threadsNum];
     for( int i = 0; i < threadsNum; ++i )
     {
-        thr[i] = std::thread( commandThread, cluster_p );
+        thr[i] = std::thread( i % 10 ? commandThread : commandBurstThread, cluster_p );
     }
     
     for( int i = 0; i < threadsNum; ++i )
@@ -0,0 +1,133 @@
+#include <assert.h>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <event.h>
+#include <adapters/libeventadapter.h>
+
+#include "hirediscommand.h"
+#include "asynchirediscommand.h"
+#include "singleflight.h"
+#include "writebehind.h"
+
+using namespace RedisCluster;
+using namespace std;
+
+/*
+ * Tests of request coalescing, they need cluster on 127.0.0.1:7000.
+ * Usage: testing_coalescing
+ */
+
+static const int requests = 16;
+
+void runSingleFlightTest()
+{
+    Cluster<redisContext>::ptr_t cluster_p;
+    cluster_p = HiredisCommand<>::createCluster( "127.0.0.1", 7000 );
+
+    redisReply *reply = static_cast<redisReply*>( HiredisCommand<>::Command( cluster_p, "coalescing:flight", "SET %s %s", "coalescing:flight", "shared" ) );
+    assert( REDIS_REPLY_ERROR != reply->type );
+    freeReplyObject( reply );
+
+    SingleFlight<> flight;
+    vector<Reply> replies( requests );
+    vector<thread> threads;
+    for( int i = 0; i < requests; ++i )
+    {
+        threads.push_back( thread( [&flight, &replies, cluster_p, i]() {
+            replies[i] = flight.AltCommand( cluster_p, "coalescing:flight", "GET %s", "coalescing:flight" );
+        } ) );
+    }
+    for( thread &t : threads )
+        t.join();
+
+    // threads which came while the command was in flight got its reply
+    SingleFlight<>::Stats stats = flight.stats();
+    assert( stats.requests + stats.shared == requests );
+    assert( stats.requests >= 1 );
+    for( const Reply &shared : replies )
+    {
+        assert( REDIS_REPLY_STRING == shared->type );
+        assert( string("shared") == shared->str );
+    }
+
+    delete cluster_p;
+    cout << "single flight: ok" << endl;
+}
+
+void runAsyncCoalescingTest()
+{
+    Cluster<redisAsyncContext>::ptr_t cluster_p;
+
+    struct event_base *base = event_base_new();
+    LibeventAdapter adapter(*base);
+    cluster_p = AsyncHiredisCommand<>::createCluster( "127.0.0.1", 7000, adapter);
+    {
+        AsyncSingleFlight<> flight;
+        WriteBehind<> buffer( adapter, cluster_p );
+        int answered = 0;
+
+        AsyncHiredisCommand<>::Command( cluster_p, "coalescing:counter", []( const redisReply &reply ) {
+            assert( REDIS_REPLY_ERROR != reply.type );
+        }, "DEL %s", "coalescing:counter" );
+
+        // identical commands sent before the loop runs share the first one
+        for( int i = 0; i < requests; ++i )
+        {
+            flight.Command( cluster_p, "coalescing:flight", [&]( const redisReply &reply ) {
+                assert( REDIS_REPLY_STRING == reply.type );
+                assert( string("shared") == reply.str );
+                ++answered;
+            }, "GET %s", "coalescing:flight" );
+        }
+        assert( flight.stats().requests == 1 );
+        assert( flight.stats().shared == requests - 1 );
+
+        // increments of one key are summed into one command
+        long long sum = 0;
+        for( int i = 1; i <= requests; ++i )
+        {
+            buffer.incrBy( "coalescing:counter", i );
+            sum += i;
+        }
+        buffer.flush();
+        assert( buffer.stats().writes == requests );
+        assert( buffer.stats().commands == 1 );
+
+        // commands sent after them on the same connections are answered after the shared
+        // GET and INCRBY, keys may be served by different nodes
+        int checked = 0;
+        AsyncHiredisCommand<>::Command( cluster_p, "coalescing:flight", [&, cluster_p]( const redisReply &reply ) {
+            assert( REDIS_REPLY_STRING == reply.type );
+            assert( answered == requests );
+            if( ++checked == 2 )
+                cluster_p->disconnect();
+        }, "GET %s", "coalescing:flight" );
+        AsyncHiredisCommand<>::Command( cluster_p, "coalescing:counter", [&, sum, cluster_p]( const redisReply &reply ) {
+            assert( REDIS_REPLY_STRING == reply.type );
+            assert( to_string( sum ) == reply.str );
+            if( ++checked == 2 )
+                cluster_p->disconnect();
+        }, "GET %s", "coalescing:counter" );
+
+        event_base_dispatch(base);
+        assert( buffer.stats().errors == 0 );
+    }
+    delete cluster_p;
+    event_base_free(base);
+    cout << "async coalescing: ok" << endl;
+}
+
+int main(int argc, const char * argv[])
+{
+    try
+    {
+        runSingleFlightTest();
+        runAsyncCoalescingTest();
+    } catch ( const RedisCluster::ClusterException &e )
+    {
+        cout << "Cluster exception: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,57 @@
+#include "adapters/adapter.h"
+#include "asyncawait.h"
+#include "asyncdispatcher.h"
+#include "asynchirediscommand.h"
+#include "bulkloader.h"
+#include "clientcache.h"
+#include "cluster.h"
+#include "clusterexception.h"
+#include "commandtemplate.h"
+#include "container.h"
+#include "hedgedreads.h"
+#include "hirediscommand.h"
+#include "hiredisprocess.h"
+#include "inflightlimiter.h"
+#include "inlinefunction.h"
+#include "nodepoolcontainer.h"
+#include "reply.h"
+#include "replyarena.h"
+#include "replyview.h"
+#include "shardedcluster.h"
+#include "shardedsubscriber.h"
+#include "singleflight.h"
+#include "slabpool.h"
+#include "slothash.h"
+#include "timerwheel.h"
+#include "valuecodec.h"
+#include "writebatcher.h"
+#include "writebehind.h"
+
+/*
+ * Every header is included and every class template is instantiated here,
+ * so the build checks the code no example or test happens to use.
+ */
+
+namespace RedisCluster
+{
+    template class Cluster<redisContext>;
+    template class Cluster<redisAsyncContext>;
+    template class Cluster< redisAsyncContext, NodePoolContainer<redisAsyncContext> >;
+    template class HiredisCommand<>;
+    template class AsyncHiredisCommand<>;
+    template class AsyncHiredisCommand< Cluster< redisAsyncContext, NodePoolContainer<redisAsyncContext> > >;
+    template class AsyncDispatcher<>;
+    template class BulkLoader<>;
+    template class ClientCache<>;
+    template class HedgedReads<>;
+    template class ShardedAsyncCluster<>;
+    template class ShardedSubscriber<>;
+    template class SingleFlight<>;
+    template class AsyncSingleFlight<>;
+    template class WriteBehind<>;
+}
+
+int main(int argc, const char * argv[])
+{
+    return 0;
+}
@@ -0,0 +1,893 @@
+#include <assert.h>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "asyncdispatcher.h"
+#include "commandtemplate.h"
+#include "inflightlimiter.h"
+#include "inlinefunction.h"
+#include "nodepoolcontainer.h"
+#include "replyarena.h"
+#include "replyview.h"
+#include "slabpool.h"
+#include "timerwheel.h"
+#include "valuecodec.h"
+#include "writebatcher.h"
+
+using namespace RedisCluster;
+using namespace std;
+
+/*
+ * Tests of the parts which don't need a cluster, every test asserts and prints its name.
+ * Usage: testing_units
+ */
+
+// adapter running delayed tasks when the test says so
+class ManualAdapter : public Adapter
+{
+public:
+    ManualAdapter( bool timers = true ) : timers_( timers ), mutex_(), tasks_() {}
+
+    virtual int attachContext( redisAsyncContext & ) override
+    {
+        return REDIS_OK;
+    }
+
+    virtual int runLater( Task task, void *data ) override
+    {
+        return post( task, data );
+    }
+
+    virtual int runAfter( const struct timeval &, Task task, void *data ) override
+    {
+        if( !timers_ )
+            return REDIS_ERR;
+        return post( task, data );
+    }
+
+    virtual int post( Task task, void *data ) override
+    {
+        std::lock_guard<std::mutex> lock( mutex_ );
+        tasks_.push_back( TaskData( task, data ) );
+        return REDIS_OK;
+    }
+
+    void runTasks()
+    {
+        TaskList tasks;
+        {
+            std::lock_guard<std::mutex> lock( mutex_ );
+            tasks.swap( tasks_ );
+        }
+        for( const TaskData &task : tasks )
+            task.first( task.second );
+    }
+
+    size_t tasks()
+    {
+        std::lock_guard<std::mutex> lock( mutex_ );
+        return tasks_.size();
+    }
+
+private:
+    typedef std::pair<Task, void*> TaskData;
+    typedef std::vector<TaskData> TaskList;
+
+    bool timers_;
+    std::mutex mutex_;
+    TaskList tasks_;
+};
+
+// event library hooks of fake connections, they only count calls
+struct Events
+{
+    int writes;
+    int cleanups;
+};
+
+static void countWrite( void *data )
+{
+    ++static_cast<Events*>( data )->writes;
+}
+
+static void countCleanup( void *data )
+{
+    ++static_cast<Events*>( data )->cleanups;
+}
+
+static void fakeConnection( redisAsyncContext &ac, Events &events, bool connected )
+{
+    memset( &ac, 0, sizeof( ac ) );
+    ac.c.flags = connected ? REDIS_CONNECTED : 0;
+    ac.ev.data = &events;
+    ac.ev.addWrite = countWrite;
+    ac.ev.cleanup = countCleanup;
+}
+
+void testWriteBatcher()
+{
+    ManualAdapter adapter;
+    WriteBatcher *batcher = new WriteBatcher( adapter );
+    Events events = { 0, 0 };
+
+    // writes of connected connections wait for one flush after the loop iteration
+    redisAsyncContext ac[2];
+    for( redisAsyncContext &c : ac )
+    {
+        fakeConnection( c, events, true );
+        assert( batcher->attach( c ) == REDIS_OK );
+    }
+    ac[0].ev.addWrite( ac[0].ev.data );
+    ac[0].ev.addWrite( ac[0].ev.data );
+    ac[1].ev.addWrite( ac[1].ev.data );
+    assert( events.writes == 0 && adapter.tasks() == 1 );
+
+    // connections freed before the flush are forgotten, not written
+    ac[0].ev.cleanup( ac[0].ev.data );
+    ac[1].ev.cleanup( ac[1].ev.data );
+    assert( events.cleanups == 2 );
+    adapter.runTasks();
+
+    // connect is detected by write event, so it goes to event library at once
+    redisAsyncContext connecting;
+    fakeConnection( connecting, events, false );
+    assert( batcher->attach( connecting ) == REDIS_OK );
+    connecting.ev.addWrite( connecting.ev.data );
+    assert( events.writes == 1 && adapter.tasks() == 0 );
+    connecting.ev.delWrite( connecting.ev.data );
+    connecting.ev.cleanup( connecting.ev.data );
+
+    // connection of event library without hooks stays untouched
+    redisAsyncContext bare;
+    memset( &bare, 0, sizeof( bare ) );
+    assert( batcher->attach( bare ) == REDIS_ERR );
+
+    // adapter which can't run flush makes batcher write directly
+    Adapter plain;
+    WriteBatcher *direct = new WriteBatcher( plain );
+    redisAsyncContext unbatched;
+    fakeConnection( unbatched, events, true );
+    assert( direct->attach( unbatched ) == REDIS_OK );
+    unbatched.ev.addWrite( unbatched.ev.data );
+    assert( events.writes == 2 );
+    unbatched.ev.cleanup( unbatched.ev.data );
+    direct->destroy();
+
+    // batcher destroyed with scheduled flush is deleted by it
+    fakeConnection( ac[0], events, true );
+    assert( batcher->attach( ac[0] ) == REDIS_OK );
+    ac[0].ev.addWrite( ac[0].ev.data );
+    ac[0].ev.cleanup( ac[0].ev.data );
+    batcher->destroy();
+    assert( adapter.tasks() == 1 );
+    adapter.runTasks();
+    assert( events.writes == 2 && events.cleanups == 5 );
+
+    cout << "write batcher: ok" << endl;
+}
+
+static int twice( int x )
+{
+    return 2 * x;
+}
+
+// callable counting its moves, move constructor may throw or not
+template <bool NoThrow>
+struct Counted
+{
+    explicit Counted( int *moves ) : moves( moves ) {}
+    Counted( const Counted &other ) : moves( other.moves ) {}
+    Counted( Counted &&other ) noexcept( NoThrow ) : moves( other.moves )
+    {
+        ++*moves;
+    }
+    Counted& operator=( const Counted& ) = delete;
+
+    int operator()( int x ) const
+    {
+        return x;
+    }
+
+    int *moves;
+};
+
+void testInlineFunction()
+{
+    typedef InlineFunction<int (int)> Function;
+
+    // empty wrappers and null pointers make empty function
+    std::function<int (int)> none;
+    int (*null)( int ) = nullptr;
+    assert( !Function( none ) && !Function( null ) && !Function() );
+
+    Function f( twice );
+    assert( f && f( 2 ) == 4 );
+    std::function<int (int)> next = []( int x ) { return x + 1; };
+    f = next;
+    assert( f( 2 ) == 3 );
+    f = none;
+    assert( !f );
+
+    // big callables go to heap, both kinds are moved and copied
+    shared_ptr<int> shared = make_shared<int>( 5 );
+    char pad[64] = { 1 };
+    Function big( [shared, pad]( int x ) { return *shared + x + pad[0]; } );
+    Function small( [shared]( int x ) { return *shared * x; } );
+    assert( big( 1 ) == 7 && small( 2 ) == 10 && shared.use_count() == 3 );
+    Function moved( std::move( big ) );
+    assert( !big && moved( 1 ) == 7 && shared.use_count() == 3 );
+    Function copied( moved );
+    copied = small;
+    assert( copied( 3 ) == 15 && shared.use_count() == 4 );
+    small = std::move( copied );
+    assert( !copied && small( 1 ) == 5 && shared.use_count() == 3 );
+    moved = nullptr;
+    small.reset();
+    assert( !moved && !small && shared.use_count() == 1 );
+
+    // callable which may throw on move is kept on heap, so moving the function
+    // never calls its move constructor
+    int moves = 0;
+    Function inlined{ Counted<true>( &moves ) };
+    moves = 0;
+    Function inlinedMoved( std::move( inlined ) );
+    assert( moves == 1 && inlinedMoved( 4 ) == 4 );
+    moves = 0;
+    Function heap{ Counted<false>( &moves ) };
+    moves = 0;
+    Function heapMoved( std::move( heap ) );
+    assert( moves == 0 && heapMoved( 4 ) == 4 );
+
+    cout << "inline function: ok" << endl;
+}
+
+void testSlabPool()
+{
+    // freed block is reused by the next allocation of its size class
+    void *block = SlabPool::allocate( 100 );
+    memset( block, 1, 128 );
+    SlabPool::deallocate( block, 100 );
+    assert( SlabPool::allocate( 120 ) == block );
+    SlabPool::deallocate( block, 120 );
+
+    // blocks over 4096 bytes are not pooled, null is ignored
+    void *big = SlabPool::allocate( 5000 );
+    memset( big, 1, 5000 );
+    SlabPool::deallocate( big, 5000 );
+    SlabPool::deallocate( nullptr, 64 );
+
+    // blocks freed by other thread go to its cache, which is released with the thread
+    vector<void*> blocks;
+    for( size_t size = 1; size <= 4096; size *= 2 )
+        blocks.push_back( SlabPool::allocate( size ) );
+    thread( [&blocks]() {
+        size_t size = 1;
+        for( void *p : blocks )
+        {
+            SlabPool::deallocate( p, size );
+            size *= 2;
+        }
+    } ).join();
+
+    cout << "slab pool: ok" << endl;
+}
+
+static redisAsyncContext* noConnect( const char*, int, void* )
+{
+    return nullptr;
+}
+
+static void noDisconnect( redisAsyncContext* )
+{
+}
+
+void testAsyncDispatcher()
+{
+    // cluster without slots, so every command fails in the loop after it was delivered
+    redisReply slots;
+    memset( &slots, 0, sizeof( slots ) );
+    slots.type = REDIS_REPLY_ARRAY;
+    Cluster<redisAsyncContext> cluster( &slots, noConnect, noDisconnect, nullptr );
+    ManualAdapter adapter;
+    AsyncDispatcher<> *dispatcher = new AsyncDispatcher<>( &cluster, adapter );
+
+    // commands of all producers reach the loop exactly once, in order of each producer
+    const int producers = 4, commands = 2000;
+    vector<int> answered( producers, 0 );
+    vector< vector< future<Reply> > > futures( producers );
+    vector<thread> threads;
+    for( int p = 0; p < producers; ++p )
+    {
+        threads.push_back( thread( [&, p]() {
+            for( int i = 0; i < commands; ++i )
+            {
+                if( i % 2 )
+                {
+                    futures[p].push_back( dispatcher->Command( "key", "GET key:%d", i ) );
+                    continue;
+                }
+                dispatcher->Command( "key", [&answered, p, i]( const Reply &reply ) {
+                    assert( reply->type == REDIS_REPLY_ERROR );
+                    assert( answered[p] == i / 2 );
+                    ++answered[p];
+                }, "GET key:%d", i );
+            }
+        } ) );
+    }
+    while( count( answered.begin(), answered.end(), commands / 2 ) != producers )
+    {
+        adapter.runTasks();
+        this_thread::yield();
+    }
+    for( thread &t : threads )
+        t.join();
+    for( vector< future<Reply> > &results : futures )
+    {
+        assert( results.size() == commands / 2 );
+        for( future<Reply> &result : results )
+        {
+            bool thrown = false;
+            try { result.get(); } catch( const ClusterException & ) { thrown = true; }
+            assert( thrown );
+        }
+    }
+    adapter.runTasks();
+
+    // the loop is woken up once until it drains the queue, commands left in the queue
+    // fail with the dispatcher and its wakeup runs harmlessly later
+    int failed = 0;
+    dispatcher->Command( "key", [&failed]( const Reply &reply ) {
+        assert( reply->type == REDIS_REPLY_ERROR );
+        ++failed;
+    }, "GET key" );
+    future<Reply> pending = dispatcher->Command( "key", "GET key" );
+    assert( adapter.tasks() == 1 );
+    delete dispatcher;
+    assert( failed == 1 );
+    bool thrown = false;
+    try { pending.get(); } catch( const DisconnectedException & ) { thrown = true; }
+    assert( thrown && adapter.tasks() == 1 );
+    adapter.runTasks();
+
+    // adapter which can't be woken up from other threads is reported
+    Adapter plain;
+    AsyncDispatcher<> refused( &cluster, plain );
+    thrown = false;
+    try { refused.Command( "key", "GET key" ); } catch( const LogicError & ) { thrown = true; }
+    assert( thrown );
+
+    cout << "async dispatcher: ok" << endl;
+}
+
+// connection of the pool test, only err is looked at by container
+struct FakeConnection
+{
+    int err;
+};
+
+static int connected = 0, disconnected = 0;
+
+static FakeConnection* fakeConnect( const char*, int, void* )
+{
+    ++connected;
+    return new FakeConnection{ 0 };
+}
+
+static void fakeDisconnect( FakeConnection *con )
+{
+    ++disconnected;
+    delete con;
+}
+
+void testNodePoolContainer()
+{
+    typedef NodePoolContainer<FakeConnection, 3> Pool;
+    typedef Cluster<FakeConnection, Pool>::SlotConnection SlotConnection;
+    Pool *pool = new Pool( fakeConnect, fakeDisconnect, nullptr );
+
+    // slot ranges of one node share its connections
+    pool->insert( { 0, 100 }, "10.0.0.1", 7000 );
+    pool->insert( { 101, 200 }, "10.0.0.2", 7000 );
+    pool->insert( { 201, 300 }, "10.0.0.1", 7000 );
+    assert( connected == 6 );
+
+    // connection with the fewest pending replies is chosen whatever slot range asks
+    SlotConnection first = pool->getConnection( 5 );
+    SlotConnection second = pool->getConnection( 250 );
+    SlotConnection third = pool->getConnection( 6 );
+    assert( first.second != second.second && second.second != third.second && first.second != third.second );
+    assert( pool->pending( 7 ) == 3 && pool->pending( 150 ) == 0 );
+    SlotConnection fourth = pool->getConnection( 8 );
+    assert( pool->pending( 8 ) == 4 );
+    pool->releaseConnection( fourth );
+    pool->releaseConnection( second );
+    assert( pool->getConnection( 9 ).second == second.second );
+
+    // lost connection is the last choice even with no pending replies
+    pool->releaseConnection( first );
+    first.second->err = 1;
+    SlotConnection next = pool->getConnection( 10 );
+    assert( next.second != first.second && pool->pending( 10 ) == 3 );
+    first.second->err = 0;
+
+    // discarded connection is replaced by a new one to the same node
+    pool->discardConnection( third );
+    assert( connected == 7 && disconnected == 1 );
+    assert( pool->pending( 10 ) == 2 );
+
+    // node which lost all its connections no longer serves its slots
+    FakeConnection *cons[3];
+    for( FakeConnection *&con : cons )
+        con = pool->getConnection( 150 ).second;
+    for( FakeConnection *con : cons )
+    {
+        pool->deleteConnection( con );
+        fakeDisconnect( con );
+    }
+    bool thrown = false;
+    try { pool->getConnection( 150 ); } catch( const NodeSearchException & ) { thrown = true; }
+    assert( thrown );
+    assert( pool->getConnection( 250 ).second != nullptr );
+
+    delete pool;
+    assert( disconnected == connected );
+
+    cout << "node pool container: ok" << endl;
+}
+
+struct Waiter
+{
+    InFlightLimiter *limiter;
+    string host;
+    int id;
+    vector<int> *sent;
+    int *resumed;
+    int *cancelled;
+    InFlightLimiter::Ticket ticket;
+};
+
+static void resumeWaiter( void *data, bool cancel )
+{
+    Waiter *waiter = static_cast<Waiter*>( data );
+    if( cancel )
+    {
+        ++*waiter->cancelled;
+        return;
+    }
+    ++*waiter->resumed;
+    if( !waiter->limiter->acquire( waiter->host ) )
+        assert( waiter->limiter->enqueue( waiter->host, waiter, resumeWaiter, waiter->ticket ) );
+    else
+        waiter->sent->push_back( waiter->id );
+}
+
+void testInFlightLimiter()
+{
+    // 3 in flight, 2 per node, 3 waiting
+    InFlightLimiter limiter( 3, 2, 3 );
+    const string a( "10.0.0.1:7000" ), b( "10.0.0.2:7000" );
+
+    assert( limiter.acquire( a ) && limiter.acquire( a ) );
+    assert( !limiter.acquire( a ) );
+    assert( limiter.acquire( b ) );
+    assert( !limiter.acquire( b ) );
+    assert( limiter.inFlight() == 3 && limiter.inFlight( a ) == 2 && limiter.inFlight( b ) == 1 );
+
+    vector<int> sent;
+    int resumed = 0, cancelled = 0;
+    vector<Waiter> waiters;
+    for( int id = 1; id <= 5; ++id )
+        waiters.push_back( Waiter{ &limiter, id % 2 ? a : b, id, &sent, &resumed, &cancelled, InFlightLimiter::Ticket() } );
+    for( int i = 0; i < 3; ++i )
+        assert( limiter.enqueue( waiters[i].host, &waiters[i], resumeWaiter, waiters[i].ticket ) );
+    assert( !limiter.enqueue( waiters[3].host, &waiters[3], resumeWaiter, waiters[3].ticket ) );
+    assert( limiter.queued() == 3 && limiter.queued( a ) == 2 && limiter.queued( b ) == 1 && limiter.rejected() == 1 );
+
+    // room is freed on b, waiters of a are not touched while a is full
+    limiter.release( b );
+    assert( sent == vector<int>( { 2 } ) && resumed == 1 );
+    assert( limiter.queued() == 2 );
+
+    // the oldest waiter of a is sent, the next one waits for global room
+    limiter.release( a );
+    assert( sent == vector<int>( { 2, 1 } ) && resumed == 2 );
+    assert( limiter.queued() == 1 && limiter.queued( a ) == 1 );
+
+    // node is counted by address, whatever connection the command went through
+    limiter.release( b );
+    assert( sent == vector<int>( { 2, 1 } ) && resumed == 2 );
+    limiter.release( a );
+    assert( sent == vector<int>( { 2, 1, 3 } ) && resumed == 3 );
+    assert( limiter.inFlight( a ) == 2 && limiter.inFlight( b ) == 0 && limiter.inFlight() == 2 );
+
+    // command taken out (i.e. timed out) doesn't hold a place in the queue
+    assert( limiter.enqueue( a, &waiters[4], resumeWaiter, waiters[4].ticket ) );
+    limiter.remove( waiters[4].ticket );
+    assert( limiter.queued() == 0 && limiter.queued( a ) == 0 );
+    limiter.release( a );
+    assert( resumed == 3 );
+
+    assert( limiter.enqueue( a, &waiters[4], resumeWaiter, waiters[4].ticket ) );
+    assert( limiter.enqueue( a, &waiters[3], resumeWaiter, waiters[3].ticket ) );
+    limiter.cancel();
+    assert( cancelled == 2 && limiter.queued() == 0 );
+
+    cout << "in flight limiter: ok" << endl;
+}
+
+static vector<int> fired;
+
+static void onExpire( void *data )
+{
+    fired.push_back( static_cast<int>( reinterpret_cast<intptr_t>( data ) ) );
+}
+
+void testTimerWheel()
+{
+    ManualAdapter adapter;
+    TimerWheel *wheel = new TimerWheel( adapter, { 0, 1000 } );
+
+    // delays in milliseconds, they span three levels of the wheel
+    const int delays[] = { 5, 1, 70, 300, 2, 100 };
+    vector< unique_ptr<TimerWheel::Timer> > timers;
+    for( int delay : delays )
+    {
+        timers.push_back( unique_ptr<TimerWheel::Timer>(
+            new TimerWheel::Timer( onExpire, reinterpret_cast<void*>( static_cast<intptr_t>( delay ) ) ) ) );
+        wheel->schedule( *timers.back(), { 0, delay * 1000 } );
+    }
+    assert( wheel->size() == 6 );
+    assert( adapter.tasks() == 1 );
+
+    // cancelled timer never fires, rescheduled one fires once at its new time
+    wheel->cancel( *timers[5] );
+    assert( !timers[5]->scheduled() );
+    wheel->schedule( *timers[4], { 0, 3000 } );
+    assert( wheel->size() == 5 );
+
+    while( wheel->size() > 0 )
+    {
+        this_thread::sleep_for( chrono::microseconds( 500 ) );
+        adapter.runTasks();
+    }
+    const vector<int> expected = { 1, 2, 5, 70, 300 };
+    assert( fired == expected );
+    for( const unique_ptr<TimerWheel::Timer> &timer : timers )
+        assert( !timer->scheduled() );
+
+    // the tick still scheduled in the loop deletes the wheel
+    TimerWheel::Timer late( onExpire, nullptr );
+    wheel->schedule( late, { 1, 0 } );
+    wheel->cancel( late );
+    wheel->destroy();
+    adapter.runTasks();
+
+    // adapter without timers is refused before the timer is linked
+    ManualAdapter noTimers( false );
+    TimerWheel *refused = new TimerWheel( noTimers, { 0, 1000 } );
+    bool thrown = false;
+    try { refused->schedule( late, { 1, 0 } ); } catch( const LogicError & ) { thrown = true; }
+    assert( thrown && !late.scheduled() && refused->size() == 0 );
+    refused->destroy();
+
+    cout << "timer wheel: ok" << endl;
+}
+
+static redisReply fakeReply( int type, const char *str = nullptr, long long integer = 0 )
+{
+    redisReply reply;
+    memset( &reply, 0, sizeof( reply ) );
+    reply.type = type;
+    reply.integer = integer;
+    if( str != nullptr )
+    {
+        reply.str = const_cast<char*>( str );
+        reply.len = strlen( str );
+    }
+    return reply;
+}
+
+// returns true if the call throws ReplyTypeException
+template <typename F>
+static bool mismatch( F f )
+{
+    try { f(); } catch( const ReplyTypeException & ) { return true; }
+    return false;
+}
+
+void testReplyView()
+{
+    redisReply number = fakeReply( REDIS_REPLY_INTEGER, nullptr, 300 );
+    redisReply negative = fakeReply( REDIS_REPLY_STRING, "-5" );
+    redisReply biggest = fakeReply( REDIS_REPLY_STRING, "18446744073709551615" );
+    redisReply text = fakeReply( REDIS_REPLY_STRING, "12x" );
+    redisReply status = fakeReply( REDIS_REPLY_STATUS, "1.5" );
+    redisReply error = fakeReply( REDIS_REPLY_ERROR, "ERR wrong" );
+    redisReply nil = fakeReply( REDIS_REPLY_NIL );
+
+    // integers are converted only when they fit the type
+    assert( ReplyView( number ).integer<short>() == 300 );
+    assert( mismatch( [&]() { ReplyView( number ).integer<unsigned char>(); } ) );
+    assert( ReplyView( negative ).integer<signed char>() == -5 );
+    assert( mismatch( [&]() { ReplyView( negative ).integer<unsigned>(); } ) );
+    assert( ReplyView( biggest ).integer<unsigned long long>() == ULLONG_MAX );
+    assert( mismatch( [&]() { ReplyView( biggest ).integer(); } ) );
+    number.integer = LLONG_MIN;
+    assert( mismatch( [&]() { ReplyView( number ).integer<int>(); } ) );
+    assert( mismatch( [&]() { ReplyView( text ).integer(); } ) );
+    assert( ReplyView( status ).real() == 1.5 );
+    assert( mismatch( [&]() { ReplyView( text ).real(); } ) );
+
+    // strings, errors and arrays are taken only from replies of their type
+    assert( ReplyView( error ).error() == "ERR wrong" && ReplyView( error ).isError() );
+    assert( mismatch( [&]() { ReplyView( text ).error(); } ) );
+    assert( mismatch( [&]() { ReplyView( number ).str(); } ) );
+    assert( mismatch( [&]() { ReplyView( text ).size(); } ) );
+    assert( ReplyView( nil ).size() == 0 && ReplyView( nil ).begin() == ReplyView( nil ).end() );
+
+    redisReply fields[] = { fakeReply( REDIS_REPLY_STRING, "a" ), fakeReply( REDIS_REPLY_STRING, "1" ),
+                            fakeReply( REDIS_REPLY_STRING, "b" ), fakeReply( REDIS_REPLY_STRING, "2" ),
+                            fakeReply( REDIS_REPLY_STRING, "c" ) };
+    redisReply *elements[] = { &fields[0], &fields[1], &fields[2], &fields[3], &fields[4] };
+    redisReply array = fakeReply( REDIS_REPLY_ARRAY );
+    array.element = elements;
+    array.elements = 4;
+    ReplyView view( array );
+    assert( mismatch( [&]() { view.str(); } ) );
+    assert( mismatch( [&]() { view[4]; } ) );
+    assert( view[3].integer() == 2 );
+
+    map<string, long long> pairs;
+    view.pairsTo( pairs );
+    assert( pairs.size() == 2 && pairs["a"] == 1 && pairs["b"] == 2 );
+    vector<string> values;
+    view.appendTo( values );
+    assert( values.size() == 4 && values[2] == "b" );
+    vector<int> numbers;
+    assert( mismatch( [&]() { view.appendTo( numbers ); } ) );
+
+    // array of odd length isn't taken for pairs
+    array.elements = 5;
+    assert( mismatch( [&]() { view.pairsTo( pairs ); } ) );
+
+    // iterator works with algorithms which need random access
+    assert( distance( view.begin(), view.end() ) == 5 );
+    assert( view.begin()[4].str() == "c" && ( *( view.end() - 2 ) ).integer() == 2 );
+    reverse_iterator<ReplyView::Iterator> last( view.end() );
+    assert( ( *last ).str() == "c" && ( *++last ).integer() == 2 );
+    ReplyView::Iterator it = view.begin();
+    it += 3;
+    assert( it > view.begin() && it - view.begin() == 3 && 2 + view.begin() <= it );
+
+    const redisReply *none = nullptr;
+    bool thrown = false;
+    try { ReplyView invalid( none ); } catch( const InvalidArgument & ) { thrown = true; }
+    assert( thrown );
+
+    cout << "reply view: ok" << endl;
+}
+
+static redisReadTask readTask( int type, int idx, redisReadTask *parent )
+{
+    redisReadTask task;
+    memset( &task, 0, sizeof( task ) );
+    task.type = type;
+    task.idx = idx;
+    task.parent = parent;
+    return task;
+}
+
+void testReplyArena()
+{
+    redisReplyObjectFunctions *fn = ReplyArena::functions();
+
+    // small and large arrays with strings bigger than the first block, nested
+    // array in the last element
+    for( int count : { 3, 1000 } )
+    {
+        redisReadTask root = readTask( REDIS_REPLY_ARRAY, -1, nullptr );
+        redisReply *reply = static_cast<redisReply*>( fn->createArray( &root, count + 1 ) );
+        root.obj = reply;
+        vector<string> values;
+        for( int i = 0; i < count; ++i )
+        {
+            values.push_back( "value" + to_string( i ) + string( i % 7 ? 0 : 700, 'x' ) );
+            redisReadTask task = readTask( REDIS_REPLY_STRING, i, &root );
+            fn->createString( &task, &values.back()[0], values.back().size() );
+        }
+        redisReadTask nested = readTask( REDIS_REPLY_ARRAY, count, &root );
+        nested.obj = fn->createArray( &nested, 2 );
+        redisReadTask integer = readTask( REDIS_REPLY_INTEGER, 0, &nested );
+        fn->createInteger( &integer, 42 );
+        redisReadTask nil = readTask( REDIS_REPLY_NIL, 1, &nested );
+        fn->createNil( &nil );
+
+        assert( reply->type == REDIS_REPLY_ARRAY && reply->elements == size_t( count + 1 ) );
+        for( int i = 0; i < count; ++i )
+        {
+            assert( reply->element[i]->type == REDIS_REPLY_STRING );
+            assert( string( reply->element[i]->str, reply->element[i]->len ) == values[i] );
+            assert( reply->element[i]->str[reply->element[i]->len] == '\0' );
+        }
+        redisReply *last = reply->element[count];
+        assert( last->elements == 2 && last->element[0]->integer == 42 && last->element[1]->type == REDIS_REPLY_NIL );
+
+        // all blocks go with the root
+        ReplyArena::release( reply );
+    }
+
+    // single value is a root too
+    redisReadTask task = readTask( REDIS_REPLY_STRING, -1, nullptr );
+    char text[] = "text";
+    redisReply *single = static_cast<redisReply*>( fn->createString( &task, text, 4 ) );
+    assert( string( single->str ) == "text" );
+    ReplyArena::release( single );
+
+    // connection decides how its replies are freed
+    redisReader reader;
+    memset( &reader, 0, sizeof( reader ) );
+    redisContext con;
+    memset( &con, 0, sizeof( con ) );
+    assert( ReplyArena::freeFunction( con ) == freeReplyObject && !ReplyArena::installed( con ) );
+    con.reader = &reader;
+    ReplyArena::install( con );
+    assert( ReplyArena::installed( con ) && ReplyArena::freeFunction( con ) != freeReplyObject );
+    redisReadTask number = readTask( REDIS_REPLY_INTEGER, -1, nullptr );
+    freeReply( con, fn->createInteger( &number, 1 ) );
+
+    cout << "reply arena: ok" << endl;
+}
+
+static string encoded( const CommandTemplate &command )
+{
+    return string( command.data(), command.size() );
+}
+
+void testCommandTemplate()
+{
+    CommandTemplate set( "SET {%s}:key %b" );
+    set.bind( "tag", CommandTemplate::Bytes( "a\0b", 3 ) );
+    assert( encoded( set ) == string( "*3\r\n$3\r\nSET\r\n$9\r\n{tag}:key\r\n$3\r\na\0b\r\n", 37 ) );
+
+    // buffer is reused, shorter values leave nothing of the previous ones
+    set.bind( string( "t" ), "" );
+    assert( encoded( set ) == "*3\r\n$3\r\nSET\r\n$7\r\n{t}:key\r\n$0\r\n\r\n" );
+
+    CommandTemplate incr( "INCRBY counter:%d %lld" );
+    incr.bind( 7, LLONG_MIN );
+    assert( encoded( incr ) == "*3\r\n$6\r\nINCRBY\r\n$9\r\ncounter:7\r\n$20\r\n-9223372036854775808\r\n" );
+
+    // unsigned values above LLONG_MAX stay positive
+    CommandTemplate big( "SET big %llu" );
+    big.bind( ULLONG_MAX );
+    assert( encoded( big ) == "*3\r\n$3\r\nSET\r\n$3\r\nbig\r\n$20\r\n18446744073709551615\r\n" );
+    big.bind( 0u );
+    assert( encoded( big ) == "*3\r\n$3\r\nSET\r\n$3\r\nbig\r\n$1\r\n0\r\n" );
+
+    CommandTemplate percent( "ECHO 100%% %s%%" );
+    percent.bind( "x" );
+    assert( encoded( percent ) == "*3\r\n$4\r\nECHO\r\n$4\r\n100%\r\n$2\r\nx%\r\n" );
+
+    CommandTemplate ping( "  PING  " );
+    ping.bind();
+    assert( encoded( ping ) == "*1\r\n$4\r\nPING\r\n" );
+
+    // wrong number or kind of arguments and unknown placeholders are rejected
+    bool thrown = false;
+    try { set.bind( "tag" ); } catch( const InvalidArgument & ) { thrown = true; }
+    assert( thrown );
+    thrown = false;
+    try { incr.bind( "7", 1 ); } catch( const InvalidArgument & ) { thrown = true; }
+    assert( thrown );
+    thrown = false;
+    try { CommandTemplate bad( "GET %f" ); } catch( const InvalidArgument & ) { thrown = true; }
+    assert( thrown );
+
+    cout << "command template: ok" << endl;
+}
+
+void testLzCodec()
+{
+    LzCodec codec;
+    mt19937 random( 1 );
+
+    string json;
+    for( int i = 0; i < 2000; ++i )
+        json += "{\"id\":" + to_string( i ) + ",\"name\":\"user" + to_string( i % 50 ) + "\"},";
+    string noise( 70000, '\0' );
+    for( char &c : noise )
+        c = static_cast<char>( random() );
+
+    // text, data with no matches, long runs (overlapping matches), offsets over 64KB and tiny inputs
+    const string inputs[] = { json, noise, string( 100000, 'x' ) + "tail", noise + noise, "abc", "" };
+    for( const string &input : inputs )
+    {
+        string compressed;
+        codec.compress( input.data(), input.size(), compressed );
+        string output( input.size(), '\0' );
+        assert( codec.decompress( compressed.data(), compressed.size(), &output[0], output.size() ) );
+        assert( output == input );
+    }
+
+    string compressed;
+    codec.compress( json.data(), json.size(), compressed );
+    assert( compressed.size() < json.size() / 2 );
+    string output( json.size(), '\0' );
+
+    // corrupted data is reported, never read or written out of bounds
+    assert( !codec.decompress( compressed.data(), compressed.size() - 1, &output[0], output.size() ) );
+    assert( !codec.decompress( compressed.data(), compressed.size(), &output[0], output.size() - 1 ) );
+    assert( !codec.decompress( compressed.data(), compressed.size(), &output[0], output.size() + 1 ) );
+    for( int i = 0; i < 1000; ++i )
+    {
+        string corrupted( compressed );
+        for( int j = 0; j < 4; ++j )
+            corrupted[random() % corrupted.size()] = static_cast<char>( random() );
+        codec.decompress( corrupted.data(), corrupted.size(), &output[0], output.size() );
+        string garbage( random() % 64, '\0' );
+        for( char &c : garbage )
+            c = static_cast<char>( random() );
+        codec.decompress( garbage.data(), garbage.size(), &output[0], output.size() );
+    }
+
+    // value codec refuses to decode corrupted values
+    ValueCodec values;
+    string value;
+    assert( values.encode( json.data(), json.size(), value ) );
+    value.resize( value.size() - 10 );
+    redisReply reply;
+    memset( &reply, 0, sizeof( reply ) );
+    reply.type = REDIS_REPLY_STRING;
+    reply.str = &value[0];
+    reply.len = value.size();
+    bool thrown = false;
+    try { values.decode( Reply( &reply, []( redisReply * ) {} ) ); } catch( const LogicError & ) { thrown = true; }
+    assert( thrown );
+
+    // lengths in headers are checked before anything is allocated for them
+    const string headers[] = {
+        string( "\0RZ\0\xff\xff\xff\xff", 8 ) + "stored",
+        string( "\0RZ\0\x07\0\0\0", 8 ) + "stored",
+        string( "\0RZ\x01\xff\xff\xff\xff", 8 ) + "tiny",
+        string( "\0RZ\x09\x04\0\0\0", 8 ) + "data" };
+    for( const string &header : headers )
+    {
+        value = header;
+        reply.str = &value[0];
+        reply.len = value.size();
+        thrown = false;
+        try { values.decode( Reply( &reply, []( redisReply * ) {} ) ); } catch( const LogicError & ) { thrown = true; }
+        assert( thrown );
+    }
+    string runs;
+    codec.compress( inputs[2].data(), inputs[2].size(), runs );
+    assert( codec.maxDecompressedSize( runs.size() ) >= inputs[2].size() );
+
+    cout << "lz codec: ok" << endl;
+}
+
+int main()
+{
+    testWriteBatcher();
+    testInlineFunction();
+    testSlabPool();
+    testAsyncDispatcher();
+    testNodePoolContainer();
+    testInFlightLimiter();
+    testTimerWheel();
+    testReplyView();
+    testReplyArena();
+    testCommandTemplate();
+    testLzCodec();
+    return 0;
+}
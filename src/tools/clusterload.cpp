@@ -0,0 +1,176 @@
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "hirediscommand.h"
+#include "bulkloader.h"
+
+using namespace RedisCluster;
+using std::string;
+using std::cout;
+using std::cerr;
+using std::endl;
+
+/*
+ * Cluster aware bulk loader, like "redis-cli --pipe" for redis cluster.
+ * Usage: cluster_load [-h host] [-p port] [-w window] [file]
+ *
+ * Reads commands from file (or stdin), one command per line in redis-cli syntax:
+ *
+ *     SET user:1000 "John Smith"
+ *     HSET {user1000}:info age 33 city "New \"York\""
+ *
+ * Arguments are separated by spaces, quoted ones can contain \n, \r, \t, \", \\ and \xHH escapes.
+ * The second word is the key the command is routed by. Prints throughput and errors per node.
+ */
+
+// splits line into arguments, returns false if quotes are not balanced
+static bool splitLine( const string &line, std::vector<string> &args )
+{
+    args.clear();
+    size_t i = 0;
+    while( true )
+    {
+        while( i < line.size() && isspace( static_cast<unsigned char>( line[i] ) ) )
+            ++i;
+        if( i == line.size() )
+            return true;
+        
+        string arg;
+        bool quoted = false;
+        while( i < line.size() )
+        {
+            char c = line[i];
+            if( quoted )
+            {
+                if( c == '\\' && i + 1 < line.size() )
+                {
+                    char e = line[++i];
+                    if( e == 'x' && i + 2 < line.size() && isxdigit( line[i + 1] ) && isxdigit( line[i + 2] ) )
+                    {
+                        arg += static_cast<char>( strtol( line.substr( i + 1, 2 ).c_str(), nullptr, 16 ) );
+                        i += 2;
+                    }
+                    else
+                    {
+                        arg += e == 'n' ? '\n' : e == 'r' ? '\r' : e == 't' ? '\t' : e;
+                    }
+                }
+                else if( c == '"' )
+                {
+                    quoted = false;
+                }
+                else
+                {
+                    arg += c;
+                }
+            }
+            else if( c == '"' )
+            {
+                quoted = true;
+            }
+            else if( isspace( static_cast<unsigned char>( c ) ) )
+            {
+                break;
+            }
+            else
+            {
+                arg += c;
+            }
+            ++i;
+        }
+        if( quoted )
+            return false;
+        args.push_back( arg );
+    }
+}
+
+int main(int argc, const char * argv[])
+{
+    string host = "127.0.0.1";
+    int port = 7000;
+    BulkLoader<>::Options options;
+    const char *file = nullptr;
+    
+    for( int i = 1; i < argc; ++i )
+    {
+        if( strcmp( argv[i], "-h" ) == 0 && i + 1 < argc )
+            host = argv[++i];
+        else if( strcmp( argv[i], "-p" ) == 0 && i + 1 < argc )
+            port = atoi( argv[++i] );
+        else if( strcmp( argv[i], "-w" ) == 0 && i + 1 < argc )
+            options.window = strtoul( argv[++i], nullptr, 10 );
+        else
+            file = argv[i];
+    }
+    
+    std::ifstream input;
+    if( file != nullptr )
+    {
+        input.open( file );
+        if( !input )
+        {
+            cerr << "can't open " << file << endl;
+            return 1;
+        }
+    }
+    std::istream &in = file != nullptr ? input : std::cin;
+    
+    try
+    {
+        Cluster<redisContext>::ptr_t cluster_p = HiredisCommand<>::createCluster( host.c_str(), port );
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        uint64_t skipped = 0;
+        {
+            BulkLoader<> loader( cluster_p, options );
+            string line;
+            std::vector<string> args;
+            std::vector<const char*> argvs;
+            std::vector<size_t> argvlens;
+            
+            while( std::getline( in, line ) )
+            {
+                if( !splitLine( line, args ) || args.size() < 2 )
+                {
+                    if( !args.empty() )
+                        ++skipped;
+                    continue;
+                }
+                argvs.clear();
+                argvlens.clear();
+                for( const string &arg : args )
+                {
+                    argvs.push_back( arg.data() );
+                    argvlens.push_back( arg.size() );
+                }
+                loader.Command( args[1], static_cast<int>( args.size() ), argvs.data(), argvlens.data() );
+            }
+            
+            uint64_t total = 0, errors = 0;
+            for( const BulkLoader<>::NodeReport &node : loader.finish() )
+            {
+                cout << node.host << ": " << node.commands << " commands, " << node.bytes << " bytes, "
+                     << static_cast<uint64_t>( node.rate() ) << " commands/s, " << node.errors << " errors";
+                if( !node.firstError.empty() )
+                    cout << " (" << node.firstError << ")";
+                cout << endl;
+                total += node.commands;
+                errors += node.errors;
+            }
+            double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+            cout << "total: " << total << " commands in " << seconds << " s, " << errors << " errors, "
+                 << skipped << " lines skipped" << endl;
+        }
+        delete cluster_p;
+    }
+    catch ( const RedisCluster::ClusterException &e )
+    {
+        cerr << "Cluster exception: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}